@@ -5,9 +5,9 @@
 //
 // Demo application to test the flashloader.
 // Listens on the default UART for an Intel hex file containing a new
-// application.  This is stored in flash and the system is rebooted into the
-// flashloader which overwrites the existing application with the new image
-// and boots into it.
+// application.  This is stored in flash and, once the UART has been quiet
+// for a while, the system is rebooted into the flashloader which overwrites
+// the existing application with the new image and boots into it.
 // Because the flashloader is not overwriting itself, it is power-fail safe.
 //
 // This code is for demonstration purposes.  There is not very much
@@ -21,6 +21,17 @@
 #include "hardware/watchdog.h"
 #include "hardware/structs/watchdog.h"
 #include "flashloader.h"
+#include "flashlayout.h"
+#include "flashpartition.h"
+#include "flashstage.h"
+#include "flashwear.h"
+#include "flashverify.h"
+#include "flashcommit.h"
+#include "intelhex.h"
+#include "crc32.h"
+#include "updateagent.h"
+#include "xipstats.h"
+#include "pcsample.h"
 
 #ifndef PICO_DEFAULT_LED_PIN
     #error This example needs a board with an LED
@@ -30,18 +41,15 @@
     #error LED_DELAY_MS must be defined!
 #endif
 
+// How long nothing has to have been received for before a staged image is
+// committed (0 to leave it to the host)
+#ifndef APP_COMMIT_IDLE_MS
+    #define APP_COMMIT_IDLE_MS 1000
+#endif
+
 #define STRINGIFY(x) #x
 #define TO_TEXT(x) STRINGIFY(x)
 
-// Intel HEX record
-typedef struct
-{
-    uint8_t  count;
-    uint16_t addr;
-    uint8_t  type;
-    uint8_t  data[256];
-}tRecord;
-
 // Intel HEX record types
 static const uint8_t TYPE_DATA      = 0x00;
 static const uint8_t TYPE_EOF       = 0x01;
@@ -50,16 +58,21 @@ static const uint8_t TYPE_STARTSEG  = 0x03;
 static const uint8_t TYPE_EXTLIN    = 0x04;
 static const uint8_t TYPE_STARTLIN  = 0x05;
 
-// Offset within flash of the new app image to be flashed by the flashloader
-static const uint32_t FLASH_IMAGE_OFFSET = 128 * 1024;
+// The header we build is the fixed header followed by a single extension
+// record containing the staging sequence number (so we can work out which
+// image was staged most recently)
+#define APP_HEADER_LENGTH (sizeof(tFlashHeader) + sizeof(tFlashTlv) + sizeof(uint32_t))
 
-// Buffer to hold the incoming data before flashing
+// Buffer to hold the incoming data before flashing (with enough room to
+// round up to a whole page)
 static union
 {
     tFlashHeader header;
-    uint8_t      buffer[sizeof(tFlashHeader) + 65536];
+    uint8_t      buffer[APP_HEADER_LENGTH + 65536 + FLASH_PAGE_SIZE];
 } flashbuf;
 
+#define flashbufdata (&flashbuf.buffer[APP_HEADER_LENGTH])
+
 //****************************************************************************
 bool repeating_timer_callback(struct repeating_timer *t)
 {
@@ -69,141 +82,250 @@ bool repeating_timer_callback(struct repeating_timer *t)
 }
 
 //****************************************************************************
-// Simple CRC32 (no reflection, no final XOR) implementation.
-// This can be done with a lookup table or using the DMA sniffer too.
-uint32_t crc32(const uint8_t *data, uint32_t len, uint32_t crc)
+// Writes an unsigned decimal number to the standard UART
+void putDecimal(uint32_t value)
 {
-    while(len--)
+    char  text[11];
+    char* ptr = &text[sizeof(text) - 1];
+
+    *ptr = 0;
+    do
     {
-        crc ^= (*data++ << 24);
+        *--ptr = '0' + (value % 10);
+        value /= 10;
+    }while(value);
 
-        for(int bit = 0; bit < 8; bit++)
-        {
-            if(crc & (1L << 31))
-                crc = (crc << 1) ^ 0x04C11DB7;
-            else
-                crc = (crc << 1);
-        }
-    }
-    return crc;
+    uart_puts(PICO_DEFAULT_UART_INSTANCE, ptr);
 }
 
 //****************************************************************************
-// Converts an ASCII hex character into its binary representation.
-// The existing value is shifted across one nibble before the new value is
-// stored in the lower nibble.
-// Returns non-zero if the character could be converted
-int hex2nibble(char c, uint8_t* value)
+// Writes a 32-bit number to the standard UART in hex with a leading "0x"
+void putHex(uint32_t value)
 {
-    int success = 0;
+    char text[11];
 
-    if(c >= '0' && c <= '9')
-    {
-        *value <<= 4;
-        *value |= (uint8_t)(c - '0');
-        success = 1;
-    }
-    else
+    text[0]  = '0';
+    text[1]  = 'x';
+    text[10] = 0;
+
+    for(int digit = 9; digit > 1; digit--)
     {
-        c |= 32;
-        if(c >= 'a' && c <= 'z')
-        {
-            *value <<= 4;
-            *value |= (uint8_t)(c - 'a') + 10;
-            success = 1;
-        }
+        text[digit] = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
     }
 
-    return success;
+    uart_puts(PICO_DEFAULT_UART_INSTANCE, text);
 }
 
 //****************************************************************************
-// Converts two ASCII hex characters to an 8-bit binary value.
-// Returns non-zero if valid hex characters were found
-int parseHex(const char* str, uint8_t* value)
+// Report the most worn sectors and roughly how many more updates can be
+// performed before the worst of them reaches the flash's rated endurance
+void reportWear()
 {
-    int success;
+    tFlashWearSector hottest[3];
+    uint32_t count = flashWearHottest(hottest, 3);
+    uint32_t remaining;
 
-    *value = 0;
-    success = hex2nibble(*str++, value) && hex2nibble(*str, value);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "Sector at ");
+        putDecimal(hottest[i].offset / 1024);
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "k erased ");
+        putDecimal(hottest[i].count);
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, " times\r\n");
+    }
 
-    return success;
+    remaining = flashWearUpdatesRemaining(newestStagedSequence());
+    if(remaining != 0xffffffff)
+    {
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "Estimated updates remaining: ");
+        putDecimal(remaining);
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "\r\n");
+    }
 }
 
 //****************************************************************************
-// Converts an Intel hex record in text form to a binary representation.
-// Returns non-zero if the text could be parsed successfully
-int processRecord(const char* line, tRecord* record)
+// Report the XIP cache hit rate for each phase the application has been
+// through since it started
+void reportXipStats()
 {
-    int     success = 0;
-    int     offset = 0;
-    uint8_t value;
-    uint8_t data[256 + 5]; // Max payload 256 bytes plus 5 for fields
-    uint8_t checksum = 0;
+    const tXipPhase* phases;
+    uint32_t count;
+    uint32_t rate;
 
-    while(*line && (*line != ':'))
-        line++;
+    phases = xipStatsPhases(&count);
 
-    if(*line++ == ':')
+    for(uint32_t i = 0; i < count; i++)
     {
-        while(parseHex(line, &value) && (offset < sizeof(data)))
-        {
-            data[offset++] = value;
-            checksum += value;
-            line += 2;
-        }
+        rate = xipStatsHitRate(&phases[i]);
+
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "XIP cache ");
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, phases[i].name);
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, ": ");
+        putDecimal(rate / 10);
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, ".");
+        putDecimal(rate % 10);
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "% hits of ");
+        putDecimal((uint32_t)phases[i].accesses);
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, " accesses\r\n");
     }
+}
 
-    // Checksum is two's-complement of the sum of the previous bytes so
-    // final checksum should be zero if everything was OK.
-    if((offset > 0) && (checksum == 0))
+#ifdef APP_PC_SAMPLE_US
+//****************************************************************************
+// Write out the PC samples recorded since start-up in the format expected
+// by profiletool.py
+void reportPcSamples()
+{
+    const uint32_t* samples;
+    uint32_t count;
+
+    pcSampleStop();
+    samples = pcSamples(&count);
+
+    uart_puts(PICO_DEFAULT_UART_INSTANCE, "PC samples:\r\n");
+    for(uint32_t i = 0; i < count; i++)
     {
-        record->count = data[0];
-        record->addr  = data[2] | (data[1] << 8);
-        record->type  = data[3];
-        memcpy(record->data, &data[4], data[0]);
-        success = 1;
+        putHex(samples[i]);
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "\r\n");
     }
+}
+#endif
+
+//****************************************************************************
+// Report what we've measured and then reboot into the flashloader to flash
+// the image staged at the given offset
+void rebootIntoFlashloader(uint32_t offset)
+{
+    reportXipStats();
+#ifdef APP_PC_SAMPLE_US
+    reportPcSamples();
+#endif
+
+    // Set up watchdog scratch registers so that the flashloader knows
+    // what to do after the reset
+    watchdog_hw->scratch[0] = FLASH_MAGIC1;
+    watchdog_hw->scratch[1] = XIP_BASE + offset;
 
-    return success;
+    // There's no need to wait any longer than it takes for the messages to
+    // actually leave the UART.  A zero delay triggers the reset immediately.
+    uart_tx_wait_blocking(PICO_DEFAULT_UART_INSTANCE);
+    watchdog_reboot(0x00000000, 0x00000000, 0);
+
+    // Wait for the reset
+    while(true)
+        tight_loop_contents();
 }
 
 //****************************************************************************
-// Store the given image in flash then reboot into the flashloader to replace
-// the current application with the new image.
-void flashImage(tFlashHeader* header, uint32_t length)
+// Store the given image in flash ready for the flashloader to replace the
+// current application with it (see commitWhenIdle).  'crc' is the CRC of
+// the image data if it has already been calculated (i.e. 'crcLength' is the
+// same as 'length').
+void flashImage(tFlashHeader* header, uint32_t length, uint32_t crc, uint32_t crcLength)
 {
     // Calculate length of header plus length of data
-    uint32_t totalLength = sizeof(tFlashHeader) + length;
+    uint32_t totalLength = APP_HEADER_LENGTH + length;
 
     // Round erase length up to next 4096 byte boundary
     uint32_t eraseLength = (totalLength + 4095) & 0xfffff000;
-    uint32_t status;
+    tFlashTlv* tlv = (tFlashTlv*)header->tlv;
+    uint32_t sequence;
+    uint32_t offset;
+    uint32_t start;
 
-    header->magic1 = FLASH_MAGIC1;
-    header->magic2 = FLASH_MAGIC2;
-    header->length = length;
-    header->crc32  = crc32(header->data, length, 0xffffffff);
+    if(eraseLength > FLASH_STAGING_LENGTH)
+    {
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "Image too large for staging area\r\n");
+        return;
+    }
 
-    uart_puts(PICO_DEFAULT_UART_INSTANCE, "Storing new image in flash and then rebooting\r\n");
+    if(length > FLASH_APPLICATION_LENGTH)
+    {
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "Image too large for application area\r\n");
+        return;
+    }
 
-    status = save_and_disable_interrupts();
+    // Let core1 finish with anything the update agent left behind
+    flashVerifyWait();
 
-    flash_range_erase(FLASH_IMAGE_OFFSET, eraseLength);
-    flash_range_program(FLASH_IMAGE_OFFSET, (uint8_t*)header, totalLength);
+    offset = nextStagingOffset(eraseLength, &sequence);
 
-    restore_interrupts(status);
-    uart_puts(PICO_DEFAULT_UART_INSTANCE, "Rebooting into flashloader in 1 second\r\n");
+    tlv->type   = FLASH_TLV_SEQUENCE;
+    tlv->length = sizeof(uint32_t);
+    memcpy(tlv->value, &sequence, sizeof(uint32_t));
 
-    // Set up watchdog scratch registers so that the flashloader knows
-    // what to do after the reset
-    watchdog_hw->scratch[0] = FLASH_MAGIC1;
-    watchdog_hw->scratch[1] = XIP_BASE + FLASH_IMAGE_OFFSET;
-    watchdog_reboot(0x00000000, 0x00000000, 1000);
+    if(crcLength != length)
+        crc = crc32(flashHeaderData(header), length, FLASH_CRC32_INIT);
 
-    // Wait for the reset
-    while(true)
-        tight_loop_contents();
+    flashHeaderInit(header, APP_HEADER_LENGTH);
+    header->length       = length;
+    header->crc32        = crc;
+    header->tlvCrc32     = crc32(header->tlv, flashHeaderTlvLength(header), FLASH_CRC32_INIT);
+
+    uart_puts(PICO_DEFAULT_UART_INSTANCE, "Storing new image in flash\r\n");
+
+    xipStatsPhase("stage");
+    start = time_us_32();
+
+    // Usually already done in the background while we were waiting
+    eraseStagingArea(offset, eraseLength);
+
+    // A page at a time so core1 can read each one back while the next is
+    // being programmed
+    for(uint32_t page = 0; page < totalLength; page += FLASH_PAGE_SIZE)
+        flashVerifyProgram(offset + page, (uint8_t*)header + page);
+
+    if(flashVerifyWait() < 0)
+    {
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "Image could not be stored correctly\r\n");
+        return;
+    }
+
+    uart_puts(PICO_DEFAULT_UART_INSTANCE, "Image stored in ");
+    putDecimal(time_us_32() - start);
+    uart_puts(PICO_DEFAULT_UART_INSTANCE, "us\r\n");
+
+    if(!flashCommitCheck(offset))
+    {
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "Image would not be flashed\r\n");
+        invalidateStagedImage(offset);
+        return;
+    }
+
+    flashCommitReady(offset);
+}
+
+//****************************************************************************
+// Reboot into the flashloader to flash a staged image once nothing has been
+// received for a while.  A real application might instead wait for a
+// maintenance window or until it can afford the predicted downtime.
+void commitWhenIdle()
+{
+#if APP_COMMIT_IDLE_MS
+    if(flashCommitPending() && (updateAgentIdleUs() > (APP_COMMIT_IDLE_MS * 1000)))
+    {
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "Rebooting into flashloader.  Predicted downtime: ");
+        putDecimal(flashCommitDowntimeUs());
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "us\r\n");
+
+        flashCommitNow();
+    }
+#endif
+}
+
+//****************************************************************************
+// Reads the next character from the standard UART that isn't part of a
+// frame for the update agent (which handles those itself), committing any
+// staged image while waiting
+char getChar()
+{
+    int c;
+
+    while((c = updateAgentRead()) < 0)
+        commitWhenIdle();
+
+    return (char)c;
 }
 
 //****************************************************************************
@@ -216,7 +338,7 @@ char* getLine(char* buffer)
 
     do
     {
-        c = uart_getc(PICO_DEFAULT_UART_INSTANCE);
+        c = getChar();
 
         if((c != '\n') && (c != '\r'))
             *ptr++ = c;
@@ -232,11 +354,16 @@ char* getLine(char* buffer)
 // Reads an Intel hex file from the standard UART, stores it in flash then
 // triggers the flashloader to overwrite the existing application with the
 // new image.
+// The CRC is calculated as each record arrives (while the next one is still
+// being received) so it's ready as soon as the end of the file is reached.
+// It only has to be calculated again if the data didn't arrive in order.
 void readIntelHex()
 {
     uint32_t      offset = 0;
     char          line[1024];
     uint32_t      count = 0;
+    uint32_t      crc = FLASH_CRC32_INIT;
+    uint32_t      crcLength = 0;
 
     while (true)
     {
@@ -247,7 +374,17 @@ void readIntelHex()
             switch(rec.type)
             {
                 case TYPE_DATA:
-                    memcpy(&flashbuf.header.data[offset], rec.data, rec.count);
+                    if(offset == 0)
+                        xipStatsPhase("receive");
+
+                    memcpy(&flashbufdata[offset], rec.data, rec.count);
+
+                    if(crcLength == offset)
+                    {
+                        crc = crc32(rec.data, rec.count, crc);
+                        crcLength += rec.count;
+                    }
+
                     offset += rec.count;
                     offset %= 65536;
                     if((offset % 1024) == 0)
@@ -255,7 +392,7 @@ void readIntelHex()
                     break;
 
                 case TYPE_EOF:
-                    flashImage(&flashbuf.header, offset);
+                    flashImage(&flashbuf.header, offset, crc, crcLength);
                     break;
 
                 case TYPE_EXTSEG:
@@ -266,7 +403,9 @@ void readIntelHex()
 
                 case TYPE_EXTLIN:
                     // Move to the start of the data buffer
-                    offset = 0;
+                    offset    = 0;
+                    crc       = FLASH_CRC32_INIT;
+                    crcLength = 0;
                     break;
 
                 default:
@@ -278,16 +417,49 @@ void readIntelHex()
 }
 
 
+//****************************************************************************
+// Make sure the flashloader was built with the same flash layout as we were
+// (otherwise it won't look for images where we stage them)
+void checkPartitions()
+{
+    const tFlashPartitionTable* table =
+        (const tFlashPartitionTable*)(XIP_BASE + FLASH_PARTITION_TABLE_OFFSET);
+
+    if((table->magic != FLASH_PARTITION_MAGIC) ||
+       (table->crc32 != FLASH_PARTITION_TABLE_CRC32))
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "Warning: flashloader uses a different flash layout\r\n");
+}
+
 //****************************************************************************
 // Entry point - start flashing the on-board LED and wait for a new
 // application image.
 int main()
 {
+    // Time since the timer was reset (i.e. how long it took to get here)
+    uint32_t startup = time_us_32();
+
+    // Sample the XIP cache counters (cleared by the flashloader just before
+    // it started us) every second so they can't overflow
+    xipStatsStart(1000);
+
+#ifdef APP_PC_SAMPLE_US
+    pcSampleStart(APP_PC_SAMPLE_US);
+#endif
+
     gpio_set_function(PICO_DEFAULT_UART_TX_PIN, GPIO_FUNC_UART);
     gpio_set_function(PICO_DEFAULT_UART_RX_PIN, GPIO_FUNC_UART);
 
     uart_init(PICO_DEFAULT_UART_INSTANCE, 115200);
 
+    // Core1 reads back everything staged (see flashverify.h)
+    flashVerifyInit();
+    flashCommitInit(rebootIntoFlashloader, startup);
+
+    // Images can also be sent by the host uploader (tools/flashupload.cpp)
+    updateAgentInit(PICO_DEFAULT_UART_INSTANCE,
+                    watchdog_hw->scratch[0] == FLASH_APP_UPDATED,
+                    watchdog_hw->scratch[3], startup);
+
     gpio_init(PICO_DEFAULT_LED_PIN);
     gpio_set_dir(PICO_DEFAULT_LED_PIN, GPIO_OUT);
 
@@ -296,12 +468,29 @@ int main()
 
     if(watchdog_hw->scratch[0] == FLASH_APP_UPDATED)
     {
+        // The flashloader leaves the time it spent flashing the image in
+        // scratch register 3
         uart_puts(PICO_DEFAULT_UART_INSTANCE, "Application just updated!\r\n");
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "Update downtime: ");
+        putDecimal(watchdog_hw->scratch[3]);
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "us flashloader + ");
+        putDecimal(startup);
+        uart_puts(PICO_DEFAULT_UART_INSTANCE, "us start-up\r\n");
+
         watchdog_hw->scratch[0] = 0;
+        watchdog_hw->scratch[3] = 0;
+
+        reportWear();
     }
 
+    // Make sure the erase counters are ready for the next update
+    flashWearCompact();
+    checkPartitions();
+
     uart_puts(PICO_DEFAULT_UART_INSTANCE, "Flashing LED every " TO_TEXT(LED_DELAY_MS) " milliseconds\r\n");
 
+    xipStatsPhase("idle");
+
     readIntelHex();
 
     return 0;
@@ -0,0 +1,286 @@
+#!/usr/bin/env python3
+#
+# Copyright 2021 Richard Hulme
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Script to handle the board and flash profiles (see flashprofiles.txt) that
+# the flashloader variants are built for.
+#
+# The 'cmake' command checks the profiles and writes the settings for each
+# one for the build: the compile definitions that fix the flashloader's
+# erase size, watchdog timeout, flash size and clocks (including the PLL
+# settings for the system clock), and the boot2 and flash clock divider.
+#
+# The 'report' command is run once a variant has been built and prints how
+# much of the flashloader's area it uses and a prediction of how long it
+# will take to erase, program and read back a full application with the
+# profile's flash.
+#
+
+import argparse
+import os
+import re
+import subprocess
+
+SECTOR_SIZE = 4096
+PAGE_SIZE   = 256
+
+# The only block size that the SDK's flash_range_erase supports
+BLOCK_SIZE  = 65536
+
+# The RP2040's watchdog can't count beyond about 8.3 seconds
+MAX_WATCHDOG_MS = 8000
+
+# Flash clocks taken for each byte of the 8-byte reads the XIP cache makes
+# with each of the SDK's boot2 images (the command, address and dummy
+# cycles are spread across the eight bytes)
+BOOT2 = {
+    'w25q080':      3.5,        # Quad I/O, continuous read mode
+    'is25lp080':    3.5,
+    'at25sf128a':   3.5,
+    'w25x10cl':     6,          # Dual I/O, continuous read mode
+    'generic_03h':  12,         # Serial read command for every access
+}
+
+class Profile:
+    def __init__(self, fields, line):
+        self.name = fields[0]
+        self.line = line
+
+        self.flash      = auto_size(fields[1])
+        self.sector_ms  = int(fields[2])
+        self.block      = None if fields[3] == '-' else auto_size(fields[3])
+        self.block_ms   = None if fields[4] == '-' else int(fields[4])
+        self.max_ms     = int(fields[5])
+        self.page_us    = int(fields[6])
+        self.boot2      = fields[7]
+        self.clkdiv     = int(fields[8])
+        self.sys_mhz    = int(fields[9])
+
+        # Allow a quarter more than the datasheet's maximum (but never less
+        # than the generic flashloader's 500ms)
+        self.watchdog_ms = max(500, (self.max_ms * 5) // 4)
+
+    @property
+    def erase_size(self):
+        return self.block if self.block else SECTOR_SIZE
+
+def auto_size(text):
+    match = re.match(r"^(0x[0-9a-fA-F]+|\d+)([kKM]?)$", text)
+    if not match:
+        raise ValueError(f"invalid size '{text}'")
+
+    return int(match.group(1), 0) * {'': 1, 'k': 1024, 'K': 1024, 'M': 1024 * 1024}[match.group(2)]
+
+# Find the PLL settings for the given system clock (from a reference divider
+# of 1), preferring the highest VCO frequency as the SDK does
+def pll_settings(sys_mhz, xosc_mhz):
+    for fbdiv in range(1600 // xosc_mhz, 15, -1):
+        vco = fbdiv * xosc_mhz
+
+        if vco < 750:
+            break
+
+        for postdiv1 in range(7, 0, -1):
+            for postdiv2 in range(postdiv1, 0, -1):
+                if vco == sys_mhz * postdiv1 * postdiv2:
+                    return vco, postdiv1, postdiv2
+
+    return None
+
+def read_profiles(filename, xosc_mhz):
+    profiles = []
+
+    with open(filename) as f:
+        for number, line in enumerate(f, 1):
+            fields = line.split('#')[0].split()
+
+            if not fields:
+                continue
+
+            try:
+                if len(fields) != 10:
+                    raise ValueError("expected <name> <flash> <sector_ms> <block> <block_ms> "
+                                     "<max_erase_ms> <page_us> <boot2> <clkdiv> <sys_mhz>")
+
+                if not re.match(r"^[a-zA-Z_]\w*$", fields[0]):
+                    raise ValueError(f"invalid profile name '{fields[0]}'")
+
+                profile = Profile(fields, number)
+
+                if any(p.name == profile.name for p in profiles):
+                    raise ValueError("duplicate profile name")
+
+                if (profile.flash % SECTOR_SIZE) or (profile.flash > (16 * 1024 * 1024)):
+                    raise ValueError("flash must be a multiple of 4k and no more than 16M")
+
+                if (profile.block is None) != (profile.block_ms is None):
+                    raise ValueError("block and block_ms must both be given or both be '-'")
+
+                if profile.block not in (None, BLOCK_SIZE):
+                    raise ValueError(f"only {BLOCK_SIZE // 1024}k blocks can be erased")
+
+                if profile.watchdog_ms > MAX_WATCHDOG_MS:
+                    raise ValueError("max_erase_ms is too long for the watchdog")
+
+                if profile.boot2 not in BOOT2:
+                    raise ValueError(f"unknown boot2 '{profile.boot2}' (expected one of {', '.join(BOOT2)})")
+
+                if (profile.clkdiv < 2) or (profile.clkdiv & 1):
+                    raise ValueError("clkdiv must be an even number, at least 2")
+
+                profile.pll = pll_settings(profile.sys_mhz, xosc_mhz)
+                if not profile.pll:
+                    raise ValueError(f"{profile.sys_mhz}MHz can't be made from a {xosc_mhz}MHz crystal")
+
+                profiles.append(profile)
+            except ValueError as e:
+                raise SystemExit(f"{filename}:{number}: {e}")
+
+    return profiles
+
+# Only touch the file if it has changed so everything isn't rebuilt each
+# time the project is configured
+def write(filename, text):
+    if os.path.exists(filename):
+        with open(filename) as f:
+            if f.read() == text:
+                return
+
+    with open(filename, mode='w') as f:
+        f.write(text)
+
+# Settings for the build, as CMake variables
+def cmake(args, profiles):
+    lines = [f"# Generated by boardtool.py from {os.path.basename(args.profiles)} - do not edit",
+             f"set(FLASH_PROFILES {' '.join(p.name for p in profiles)})"]
+
+    for profile in profiles:
+        vco, postdiv1, postdiv2 = profile.pll
+        prefix = f"FLASH_PROFILE_{profile.name}"
+
+        lines.append(f"set({prefix}_FLASH 0x{profile.flash:08x})")
+        lines.append(f"set({prefix}_BOOT2 {profile.boot2})")
+        lines.append(f"set({prefix}_CLKDIV {profile.clkdiv})")
+        lines.append(f"set({prefix}_DEFINITIONS")
+        lines.append(f"        PICO_FLASH_SIZE_BYTES=0x{profile.flash:08x}")
+        lines.append(f"        FLASHLOADER_ERASE_SIZE=0x{profile.erase_size:x}")
+        lines.append(f"        FLASHLOADER_WATCHDOG_MS={profile.watchdog_ms}")
+        lines.append(f"        FLASHLOADER_SYS_MHZ={profile.sys_mhz}")
+        lines.append(f"        FLASHLOADER_VCO_MHZ={vco}")
+        lines.append(f"        FLASHLOADER_POSTDIV1={postdiv1}")
+        lines.append(f"        FLASHLOADER_POSTDIV2={postdiv2}")
+        lines.append(f"        )")
+
+    text = "\n".join(lines) + "\n"
+
+    if args.outfile:
+        write(args.outfile, text)
+    else:
+        print(text, end='')
+
+# Read the given symbols' values from the ELF file
+def read_values(nm, elf, names):
+    output = subprocess.run([nm, "--defined-only", elf],
+                            check=True, capture_output=True, text=True).stdout
+    values = {}
+
+    for line in output.splitlines():
+        fields = line.split()
+
+        if (len(fields) == 3) and (fields[2] in names):
+            values[fields[2]] = int(fields[0], 16)
+
+    missing = [name for name in names if name not in values]
+    if missing:
+        raise SystemExit(f"{elf}: {', '.join(missing)} not found")
+
+    return values
+
+# Erase the range the same way as flashFirmware in flashloader.c.
+# Returns the number of sectors and blocks and the time taken.
+def erase_time(profile, offset, length):
+    end = offset + length
+    sectors = 0
+    blocks = 0
+
+    while offset < end:
+        if profile.block and ((offset % profile.block) == 0) and ((end - offset) >= profile.block):
+            blocks += 1
+            offset += profile.block
+        else:
+            sectors += 1
+            offset += SECTOR_SIZE
+
+    return sectors, blocks, (sectors * profile.sector_ms) + (blocks * (profile.block_ms or 0))
+
+def report(args, profiles):
+    profile = next((p for p in profiles if p.name == args.profile), None)
+    if not profile:
+        raise SystemExit(f"{args.profiles}: no profile called '{args.profile}'")
+
+    values = read_values(args.nm, args.elf,
+                         ["__flash_binary_end", "__FLASHLOADER_START", "__PARTITION_TABLE_OFFSET"])
+
+    used = values["__flash_binary_end"] - 0x10000000 - values["__FLASHLOADER_START"]
+    available = values["__PARTITION_TABLE_OFFSET"] - values["__FLASHLOADER_START"]
+
+    flash_mhz = profile.sys_mhz / profile.clkdiv
+    sectors, blocks, erase_ms = erase_time(profile, args.app_offset, args.app_length)
+    pages = args.app_length // PAGE_SIZE
+    program_ms = (pages * profile.page_us) / 1000
+    read_ms = (args.app_length * BOOT2[profile.boot2]) / (flash_mhz * 1000)
+
+    def row(name, detail, ms):
+        return f"    {name:<8}{detail:<24}{ms:>8.1f}ms"
+
+    lines = [f"{os.path.basename(args.elf)} ({profile.name} profile)",
+             f"  size      {used} of {available} bytes ({(used * 100) // available}%), {available - used} free",
+             f"  clocks    {profile.sys_mhz}MHz system, {flash_mhz:g}MHz flash ({profile.boot2})",
+             f"  erase     " + (f"{profile.block // 1024}k blocks where aligned, otherwise " if profile.block else "")
+                           + f"4k sectors, watchdog {profile.watchdog_ms}ms",
+             f"  full application ({args.app_length // 1024}k):",
+             row("erase", f"{sectors} sectors, {blocks} blocks", erase_ms),
+             row("program", f"{pages} pages", program_ms),
+             row("read", "each pass", read_ms),
+             row("total", "", erase_ms + program_ms + read_ms)]
+
+    text = "\n".join(lines) + "\n"
+
+    if args.outfile:
+        with open(args.outfile, mode='w') as f:
+            f.write(text)
+
+    print(text, end='')
+
+    if used > available:
+        raise SystemExit(f"{args.elf}: too big for the flashloader's area")
+
+def main():
+    parser = argparse.ArgumentParser()
+
+    parser.add_argument('--xosc', type=int, default=12, help="crystal frequency in MHz")
+    parser.add_argument('--nm', default="arm-none-eabi-nm")
+    parser.add_argument('--profile', help="profile the flashloader was built for (report)")
+    parser.add_argument('--app-offset', type=lambda x: int(x, 0), default=0x1000,
+                        help="offset of the application in flash (report)")
+    parser.add_argument('--app-length', type=lambda x: int(x, 0), default=0x1f000,
+                        help="length of the application partition (report)")
+    parser.add_argument('-o', dest='outfile')
+    parser.add_argument('command', choices=['cmake', 'report'])
+    parser.add_argument('profiles')
+    parser.add_argument('elf', nargs='?', help="flashloader variant (report)")
+
+    args = parser.parse_args()
+
+    profiles = read_profiles(args.profiles, args.xosc)
+
+    if args.command == 'cmake':
+        cmake(args, profiles)
+    else:
+        if not (args.profile and args.elf):
+            parser.error("report needs --profile and the flashloader's ELF file")
+        report(args, profiles)
+
+main()
@@ -0,0 +1,113 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// CRC32 for the application.  See crc32.h for details.
+
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "crc32.h"
+
+// Tables are filled in on first use.  Each implementation has its own so
+// that only the ones actually used take up RAM.
+static tFlashCrcTable sTable[1];
+static tFlashCrcTable sSlice4[4];
+static tFlashCrcTable sSlice8[8];
+static int            sTableReady;
+static int            sSlice4Ready;
+static int            sSlice8Ready;
+static int            sDmaChannel = -1;
+
+//****************************************************************************
+uint32_t crc32Bitwise(const uint8_t *data, uint32_t len, uint32_t crc)
+{
+    return flashCrc32Bitwise(data, len, crc);
+}
+
+//****************************************************************************
+uint32_t crc32Table(const uint8_t *data, uint32_t len, uint32_t crc)
+{
+    if(!sTableReady)
+    {
+        flashCrc32MakeTables(sTable, 1);
+        sTableReady = 1;
+    }
+
+    return flashCrc32Table(sTable, data, len, crc);
+}
+
+//****************************************************************************
+uint32_t crc32Slice4(const uint8_t *data, uint32_t len, uint32_t crc)
+{
+    if(!sSlice4Ready)
+    {
+        flashCrc32MakeTables(sSlice4, 4);
+        sSlice4Ready = 1;
+    }
+
+    return flashCrc32Slice4(sSlice4, data, len, crc);
+}
+
+//****************************************************************************
+uint32_t crc32Slice8(const uint8_t *data, uint32_t len, uint32_t crc)
+{
+    if(!sSlice8Ready)
+    {
+        flashCrc32MakeTables(sSlice8, 8);
+        sSlice8Ready = 1;
+    }
+
+    return flashCrc32Slice8(sSlice8, data, len, crc);
+}
+
+//****************************************************************************
+// Let the DMA sniffer calculate the CRC (as the flashloader does) while
+// copying the data to a dummy location.  The CPU just waits but the DMA
+// handles a byte per cycle.
+uint32_t crc32Dma(const uint8_t *data, uint32_t len, uint32_t crc)
+{
+    uint8_t dummy;
+
+    if(len == 0)
+        return crc;
+
+    if(sDmaChannel < 0)
+        sDmaChannel = dma_claim_unused_channel(true);
+
+    dma_channel_config c = dma_channel_get_default_config(sDmaChannel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_sniff_enable(&c, true);
+
+    // Turn on CRC32 (non-bit-reversed data)
+    dma_sniffer_enable(sDmaChannel, 0x00, true);
+    dma_hw->sniff_data = crc;
+
+    dma_channel_configure(sDmaChannel, &c, &dummy, data, len, true);
+    dma_channel_wait_for_finish_blocking(sDmaChannel);
+
+    crc = dma_hw->sniff_data;
+    dma_sniffer_disable();
+
+    return crc;
+}
+
+//****************************************************************************
+uint32_t crc32(const uint8_t *data, uint32_t len, uint32_t crc)
+{
+#if APP_CRC == APP_CRC_BITWISE
+    return crc32Bitwise(data, len, crc);
+#elif APP_CRC == APP_CRC_TABLE
+    return crc32Table(data, len, crc);
+#elif APP_CRC == APP_CRC_SLICE4
+    return crc32Slice4(data, len, crc);
+#elif APP_CRC == APP_CRC_SLICE8
+    return crc32Slice8(data, len, crc);
+#elif APP_CRC == APP_CRC_DMA
+    return crc32Dma(data, len, crc);
+#else
+    #error Unknown APP_CRC implementation
+#endif
+}
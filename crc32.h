@@ -0,0 +1,43 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// CRC32 as used for update images: polynomial 0x04C11DB7, no reflection and
+// no final XOR (the same as the RP2040's DMA sniffer calculates).  See
+// flashcrc.h for the software implementations.
+//
+// The implementation used by crc32() is chosen at build time by defining
+// APP_CRC as one of the APP_CRC_xxx values below (the DMA sniffer by
+// default).  Every implementation can still be called directly (e.g. to
+// compare them) and anything that isn't used is dropped by the linker.
+
+#ifndef __CRC32_INCL__
+#define __CRC32_INCL__
+
+#include <stdint.h>
+#include "flashcrc.h"
+
+#define APP_CRC_BITWISE     1   // No table
+#define APP_CRC_TABLE       2   // 1k table in RAM
+#define APP_CRC_SLICE4      3   // 4k of tables in RAM
+#define APP_CRC_SLICE8      4   // 8k of tables in RAM
+#define APP_CRC_DMA         5   // DMA sniffer (claims a DMA channel)
+
+#ifndef APP_CRC
+    #define APP_CRC APP_CRC_DMA
+#endif
+
+// Continue the CRC 'crc' over 'len' bytes of 'data' (start with
+// FLASH_CRC32_INIT)
+uint32_t crc32(const uint8_t *data, uint32_t len, uint32_t crc);
+
+// The individual implementations.  Any tables (or the DMA channel) are set
+// up on first use.
+uint32_t crc32Bitwise(const uint8_t *data, uint32_t len, uint32_t crc);
+uint32_t crc32Table(const uint8_t *data, uint32_t len, uint32_t crc);
+uint32_t crc32Slice4(const uint8_t *data, uint32_t len, uint32_t crc);
+uint32_t crc32Slice8(const uint8_t *data, uint32_t len, uint32_t crc);
+uint32_t crc32Dma(const uint8_t *data, uint32_t len, uint32_t crc);
+
+#endif // __CRC32_INCL__
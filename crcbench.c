@@ -0,0 +1,168 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Benchmark for the application's CRC32 implementations (see crc32.h).
+// Each one is run over a buffer in RAM and over the program itself in
+// flash (through the XIP cache, as the update agent does when checking a
+// staged image) and the results are printed on the default UART.  Every
+// implementation must give the same answer as the bit-at-a-time version.
+//
+// The AES-CTR keystream generation used for encrypted update images (see
+// flashaes.h) is timed here too, from RAM as the flashloader runs it, and
+// compared with the time taken to program a page.  As long as it's quicker,
+// the flashloader's core1 can decrypt each page while core0 is programming
+// the previous one.
+//
+// This is a standalone program: load crcbench.uf2 with the bootrom rather
+// than through the flashloader.
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "crc32.h"
+
+#define FLASH_AES_FUNC(name) __not_in_flash_func(name)
+#include "flashaes.h"
+
+#define RAM_LENGTH      16384
+#define FLASH_LENGTH    65536
+#define REPEATS         4
+#define PAGE_LENGTH     256
+#define PAGE_US         400     // Typical page program time
+
+typedef uint32_t (*tCrcFunction)(const uint8_t *data, uint32_t len, uint32_t crc);
+
+typedef struct
+{
+    const char*  name;
+    tCrcFunction function;
+}tImplementation;
+
+static const tImplementation sImplementations[] =
+{
+    { "bitwise", crc32Bitwise },
+    { "table",   crc32Table },
+    { "slice4",  crc32Slice4 },
+    { "slice8",  crc32Slice8 },
+    { "dma",     crc32Dma },
+};
+
+static uint8_t sBuffer[RAM_LENGTH];
+static uint8_t sKeystream[PAGE_LENGTH];
+static tFlashAes sAes;
+
+//****************************************************************************
+// Run the implementation over the data and print how long it took.
+// Returns the CRC.
+static uint32_t measure(const tImplementation* impl, const char* where,
+                        const uint8_t* data, uint32_t length)
+{
+    uint32_t crc = 0;
+    uint32_t start;
+    uint32_t elapsed;
+
+    // Once first to set up any tables
+    impl->function(data, 1, FLASH_CRC32_INIT);
+
+    start = time_us_32();
+    for(int i = 0; i < REPEATS; i++)
+        crc = impl->function(data, length, FLASH_CRC32_INIT);
+    elapsed = (time_us_32() - start) / REPEATS;
+
+    printf("%-8s %-6s %7luus %8lu kB/s %5lu.%02lu cycles/byte\n",
+           impl->name, where, (unsigned long)elapsed,
+           (unsigned long)(((uint64_t)length * 1000000 / 1024) / (elapsed ? elapsed : 1)),
+           (unsigned long)(((uint64_t)elapsed * (clock_get_hz(clk_sys) / 10000)) / length / 100),
+           (unsigned long)(((uint64_t)elapsed * (clock_get_hz(clk_sys) / 10000)) / length % 100));
+
+    return crc;
+}
+
+//****************************************************************************
+// Time generating the keystream for a page and check the cipher against
+// FIPS-197 appendix C.1
+static void measureAes(void)
+{
+    static const uint8_t key[FLASH_AES_KEY_LENGTH] =
+        { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+          0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+    static const uint8_t plain[FLASH_AES_BLOCK_LENGTH] =
+        { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+          0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+    static const uint8_t cipher[FLASH_AES_BLOCK_LENGTH] =
+        { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+          0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+    static const uint8_t nonce[FLASH_AES_NONCE_LENGTH] = { 0 };
+    uint8_t block[FLASH_AES_BLOCK_LENGTH];
+    uint32_t start;
+    uint32_t elapsed;
+    uint32_t cycles;
+
+    start = time_us_32();
+    flashAesInit(&sAes, key);
+    elapsed = time_us_32() - start;
+
+    flashAesEncrypt(&sAes, plain, block);
+    for(uint32_t i = 0; i < sizeof(block); i++)
+    {
+        if(block[i] != cipher[i])
+        {
+            printf("aes: wrong ciphertext\n");
+            break;
+        }
+    }
+
+    printf("aes-init        %7luus\n", (unsigned long)elapsed);
+
+    start = time_us_32();
+    for(uint32_t offset = 0; offset < (REPEATS * PAGE_LENGTH); offset += PAGE_LENGTH)
+        flashAesKeystream(&sAes, nonce, offset / FLASH_AES_BLOCK_LENGTH, sKeystream, PAGE_LENGTH);
+    elapsed = (time_us_32() - start) / REPEATS;
+
+    cycles = (uint32_t)(((uint64_t)elapsed * (clock_get_hz(clk_sys) / 1000)) / 1000);
+
+    printf("aes-ctr  page   %7luus %8lu kB/s %8lu cycles/block (%lu%% of %uus page program)\n",
+           (unsigned long)elapsed,
+           (unsigned long)((PAGE_LENGTH * 1000000 / 1024) / (elapsed ? elapsed : 1)),
+           (unsigned long)(cycles / (PAGE_LENGTH / FLASH_AES_BLOCK_LENGTH)),
+           (unsigned long)((elapsed * 100) / PAGE_US), PAGE_US);
+}
+
+//****************************************************************************
+int main(void)
+{
+    const uint8_t* flash = (const uint8_t*)XIP_BASE;
+    uint32_t expectRam;
+    uint32_t expectFlash;
+
+    stdio_init_all();
+
+    for(uint32_t i = 0; i < sizeof(sBuffer); i++)
+        sBuffer[i] = (uint8_t)(i * 2654435761u >> 24);
+
+    expectRam   = crc32Bitwise(sBuffer, sizeof(sBuffer), FLASH_CRC32_INIT);
+    expectFlash = crc32Bitwise(flash, FLASH_LENGTH, FLASH_CRC32_INIT);
+
+    while(true)
+    {
+        printf("\nCRC32 over %u bytes of RAM and %u bytes of flash at %lu MHz\n",
+               RAM_LENGTH, FLASH_LENGTH, (unsigned long)(clock_get_hz(clk_sys) / 1000000));
+
+        for(uint32_t i = 0; i < sizeof(sImplementations) / sizeof(sImplementations[0]); i++)
+        {
+            const tImplementation* impl = &sImplementations[i];
+
+            if(measure(impl, "ram", sBuffer, sizeof(sBuffer)) != expectRam)
+                printf("%s: wrong CRC for RAM\n", impl->name);
+
+            if(measure(impl, "flash", flash, FLASH_LENGTH) != expectFlash)
+                printf("%s: wrong CRC for flash\n", impl->name);
+        }
+
+        measureAes();
+
+        sleep_ms(10000);
+    }
+}
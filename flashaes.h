@@ -0,0 +1,240 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// AES-128 in counter (CTR) mode, used for encrypted update images (see
+// tFlashEncryption in flashloader.h).
+//
+// This is shared by the flashloader and the host tools (which encrypt the
+// images) so must not depend on the Pico SDK.  CTR mode only ever needs the
+// forward cipher, so there is no decryption here.  The keystream for a
+// 16-byte block is the encryption of the 12-byte nonce followed by the
+// block's index (big-endian), so any block can be decrypted on its own.
+//
+// Each round uses a single 1k table combining SubBytes and MixColumns (the
+// other three columns are rotations of it, which are free on the M0+).  A
+// block is estimated (not measured, crcbench measures it on the device) to
+// take in the region of 1500 cycles.  The tables are generated
+// by flashAesInit rather than stored, so they cost no flash and can be
+// placed in RAM where they're usable while the flash is being programmed.
+//
+// flashAesKeystream (and everything it calls) can be placed in RAM, to use
+// while the flash is busy, by defining FLASH_AES_FUNC (e.g. as
+// __not_in_flash_func) before including this file.
+
+#ifndef __FLASHAES_INCL__
+#define __FLASHAES_INCL__
+
+#include <stdint.h>
+
+#ifndef FLASH_AES_FUNC
+    #define FLASH_AES_FUNC(name) name
+#endif
+
+#define FLASH_AES_KEY_LENGTH    16
+#define FLASH_AES_BLOCK_LENGTH  16
+#define FLASH_AES_NONCE_LENGTH  12
+
+typedef struct
+{
+    uint32_t table[256];        // SubBytes and MixColumns for the first row
+    uint32_t roundKey[44];
+    uint8_t  sbox[256];
+}tFlashAes;
+
+//****************************************************************************
+static inline uint32_t FLASH_AES_FUNC(flashAesRotl)(uint32_t value, unsigned bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+//****************************************************************************
+static inline uint8_t flashAesXtime(uint8_t value)
+{
+    return (uint8_t)((value << 1) ^ ((value & 0x80) ? 0x1b : 0));
+}
+
+//****************************************************************************
+static inline uint32_t flashAesSubWord(const tFlashAes* aes, uint32_t value)
+{
+    return (uint32_t)aes->sbox[value & 0xff] |
+           ((uint32_t)aes->sbox[(value >> 8) & 0xff] << 8) |
+           ((uint32_t)aes->sbox[(value >> 16) & 0xff] << 16) |
+           ((uint32_t)aes->sbox[value >> 24] << 24);
+}
+
+//****************************************************************************
+// Read four bytes as a little-endian value (the first byte is row 0)
+static inline uint32_t FLASH_AES_FUNC(flashAesLoad32)(const uint8_t* ptr)
+{
+    return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) |
+           ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+//****************************************************************************
+// Generate the tables and expand the key
+static inline void flashAesInit(tFlashAes* aes, const uint8_t* key)
+{
+    uint8_t p = 1;
+    uint8_t q = 1;
+    uint8_t rcon = 1;
+
+    // Step through every non-zero value as powers of 3 (p), keeping its
+    // inverse (q) alongside, and apply the affine transformation
+    do
+    {
+        p = (uint8_t)(p ^ (p << 1) ^ ((p & 0x80) ? 0x1b : 0));
+
+        q ^= (uint8_t)(q << 1);
+        q ^= (uint8_t)(q << 2);
+        q ^= (uint8_t)(q << 4);
+        if(q & 0x80)
+            q ^= 0x09;
+
+        aes->sbox[p] = (uint8_t)(q ^ (uint8_t)((q << 1) | (q >> 7)) ^
+                                     (uint8_t)((q << 2) | (q >> 6)) ^
+                                     (uint8_t)((q << 3) | (q >> 5)) ^
+                                     (uint8_t)((q << 4) | (q >> 4)) ^ 0x63);
+    }while(p != 1);
+
+    aes->sbox[0] = 0x63;
+
+    // Column (2, 1, 1, 3) of MixColumns, least significant byte first
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        uint8_t s = aes->sbox[i];
+        uint8_t s2 = flashAesXtime(s);
+
+        aes->table[i] = (uint32_t)s2 | ((uint32_t)s << 8) | ((uint32_t)s << 16) |
+                        ((uint32_t)(s2 ^ s) << 24);
+    }
+
+    for(uint32_t i = 0; i < 4; i++)
+        aes->roundKey[i] = flashAesLoad32(&key[i * 4]);
+
+    for(uint32_t i = 4; i < 44; i++)
+    {
+        uint32_t value = aes->roundKey[i - 1];
+
+        if((i % 4) == 0)
+        {
+            value = flashAesSubWord(aes, flashAesRotl(value, 24)) ^ rcon;
+            rcon  = flashAesXtime(rcon);
+        }
+
+        aes->roundKey[i] = aes->roundKey[i - 4] ^ value;
+    }
+}
+
+//****************************************************************************
+// Encrypt one block given as four columns (see flashAesLoad32)
+static inline void FLASH_AES_FUNC(flashAesEncryptColumns)(const tFlashAes* aes,
+                                                          uint32_t s0, uint32_t s1,
+                                                          uint32_t s2, uint32_t s3,
+                                                          uint8_t* out)
+{
+    const uint32_t* table = aes->table;
+    const uint32_t* key = aes->roundKey;
+    uint32_t t0, t1, t2, t3;
+
+    s0 ^= key[0];
+    s1 ^= key[1];
+    s2 ^= key[2];
+    s3 ^= key[3];
+
+    for(int round = 1; round < 10; round++)
+    {
+        key += 4;
+
+        // ShiftRows picks row 'r' of output column 'c' from input column
+        // 'c + r'.  Its contribution to MixColumns is the table entry
+        // rotated by 'r' bytes.
+        t0 = table[s0 & 0xff] ^ flashAesRotl(table[(s1 >> 8) & 0xff], 8) ^
+             flashAesRotl(table[(s2 >> 16) & 0xff], 16) ^ flashAesRotl(table[s3 >> 24], 24) ^ key[0];
+        t1 = table[s1 & 0xff] ^ flashAesRotl(table[(s2 >> 8) & 0xff], 8) ^
+             flashAesRotl(table[(s3 >> 16) & 0xff], 16) ^ flashAesRotl(table[s0 >> 24], 24) ^ key[1];
+        t2 = table[s2 & 0xff] ^ flashAesRotl(table[(s3 >> 8) & 0xff], 8) ^
+             flashAesRotl(table[(s0 >> 16) & 0xff], 16) ^ flashAesRotl(table[s1 >> 24], 24) ^ key[2];
+        t3 = table[s3 & 0xff] ^ flashAesRotl(table[(s0 >> 8) & 0xff], 8) ^
+             flashAesRotl(table[(s1 >> 16) & 0xff], 16) ^ flashAesRotl(table[s2 >> 24], 24) ^ key[3];
+
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+
+    // The last round has no MixColumns
+    key += 4;
+    t0 = ((uint32_t)aes->sbox[s0 & 0xff] | ((uint32_t)aes->sbox[(s1 >> 8) & 0xff] << 8) |
+          ((uint32_t)aes->sbox[(s2 >> 16) & 0xff] << 16) | ((uint32_t)aes->sbox[s3 >> 24] << 24)) ^ key[0];
+    t1 = ((uint32_t)aes->sbox[s1 & 0xff] | ((uint32_t)aes->sbox[(s2 >> 8) & 0xff] << 8) |
+          ((uint32_t)aes->sbox[(s3 >> 16) & 0xff] << 16) | ((uint32_t)aes->sbox[s0 >> 24] << 24)) ^ key[1];
+    t2 = ((uint32_t)aes->sbox[s2 & 0xff] | ((uint32_t)aes->sbox[(s3 >> 8) & 0xff] << 8) |
+          ((uint32_t)aes->sbox[(s0 >> 16) & 0xff] << 16) | ((uint32_t)aes->sbox[s1 >> 24] << 24)) ^ key[2];
+    t3 = ((uint32_t)aes->sbox[s3 & 0xff] | ((uint32_t)aes->sbox[(s0 >> 8) & 0xff] << 8) |
+          ((uint32_t)aes->sbox[(s1 >> 16) & 0xff] << 16) | ((uint32_t)aes->sbox[s2 >> 24] << 24)) ^ key[3];
+
+    for(int i = 0; i < 4; i++)
+    {
+        out[i]      = (uint8_t)(t0 >> (8 * i));
+        out[i + 4]  = (uint8_t)(t1 >> (8 * i));
+        out[i + 8]  = (uint8_t)(t2 >> (8 * i));
+        out[i + 12] = (uint8_t)(t3 >> (8 * i));
+    }
+}
+
+//****************************************************************************
+// Encrypt one 16-byte block ('in' and 'out' may be the same)
+static inline void flashAesEncrypt(const tFlashAes* aes, const uint8_t* in, uint8_t* out)
+{
+    flashAesEncryptColumns(aes, flashAesLoad32(&in[0]), flashAesLoad32(&in[4]),
+                           flashAesLoad32(&in[8]), flashAesLoad32(&in[12]), out);
+}
+
+//****************************************************************************
+// Write 'length' bytes (a multiple of 16) of keystream to 'out', starting
+// with block number 'block'
+static inline void FLASH_AES_FUNC(flashAesKeystream)(const tFlashAes* aes,
+                                                     const uint8_t* nonce, uint32_t block,
+                                                     uint8_t* out, uint32_t length)
+{
+    uint32_t n0 = flashAesLoad32(&nonce[0]);
+    uint32_t n1 = flashAesLoad32(&nonce[4]);
+    uint32_t n2 = flashAesLoad32(&nonce[8]);
+
+    // The block number is stored most significant byte first
+    for(; length >= FLASH_AES_BLOCK_LENGTH; length -= FLASH_AES_BLOCK_LENGTH, block++)
+    {
+        flashAesEncryptColumns(aes, n0, n1, n2,
+                               (block >> 24) | ((block >> 8) & 0xff00) |
+                               ((block << 8) & 0xff0000) | (block << 24),
+                               out);
+        out += FLASH_AES_BLOCK_LENGTH;
+    }
+}
+
+//****************************************************************************
+// Encrypt or decrypt 'length' bytes of 'data' in place, starting at the
+// beginning of block number 'block'
+static inline void flashAesCtr(const tFlashAes* aes, const uint8_t* nonce, uint32_t block,
+                               uint8_t* data, uint32_t length)
+{
+    uint8_t keystream[FLASH_AES_BLOCK_LENGTH];
+
+    while(length)
+    {
+        uint32_t count = (length < FLASH_AES_BLOCK_LENGTH) ? length : FLASH_AES_BLOCK_LENGTH;
+
+        flashAesKeystream(aes, nonce, block++, keystream, FLASH_AES_BLOCK_LENGTH);
+
+        for(uint32_t i = 0; i < count; i++)
+            data[i] ^= keystream[i];
+
+        data   += count;
+        length -= count;
+    }
+}
+
+#endif // __FLASHAES_INCL__
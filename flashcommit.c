@@ -0,0 +1,148 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Committing staged update images.  See flashcommit.h for details.
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/structs/watchdog.h"
+#include "flashloader.h"
+#include "flashlayout.h"
+#include "flashstage.h"
+#include "flashverify.h"
+#include "crc32.h"
+#include "flashcommit.h"
+
+static tFlashCommitReboot sReboot;
+static uint32_t           sStartupUs;
+static uint32_t           sOffset;      // Image ready to be flashed (0 if none)
+static uint32_t           sReadyTime;
+
+//****************************************************************************
+// flashImageCheck wants the flashloader's CRC function signature
+static uint32_t imageCrc(const void* data, size_t length, uint32_t crc)
+{
+    return crc32((const uint8_t*)data, length, crc);
+}
+
+//****************************************************************************
+uint32_t flashCommitCheck(uint32_t offset)
+{
+    const tFlashCompression* compression;
+    const tFlashEncryption* encryption;
+
+    return flashImageCheck((const tFlashHeader*)(XIP_BASE + offset),
+                           FLASH_STAGING_OFFSET + FLASH_STAGING_LENGTH - offset,
+                           FLASH_APPLICATION_LENGTH, imageCrc,
+                           &compression, &encryption);
+}
+
+//****************************************************************************
+// Returns non-zero if there is a complete image at the given offset that
+// hasn't been flashed or replaced and that the flashloader will take
+static int imageReady(uint32_t offset)
+{
+    const tFlashHeader* header = (const tFlashHeader*)(XIP_BASE + offset);
+
+    return flashCommitCheck(offset) &&
+           (crc32(flashHeaderData(header), header->length, FLASH_CRC32_INIT) == header->crc32);
+}
+
+//****************************************************************************
+void flashCommitInit(tFlashCommitReboot reboot, uint32_t startupUs)
+{
+    uint32_t sequence;
+
+    sReboot    = reboot;
+    sStartupUs = startupUs;
+
+    // Staging another image invalidates any other that hasn't been flashed
+    // so there can only be one
+    for(uint32_t offset = FLASH_STAGING_OFFSET;
+        offset < (FLASH_STAGING_OFFSET + FLASH_STAGING_LENGTH);
+        offset += FLASH_SECTOR_SIZE)
+    {
+        if(getStagedSequence(offset, &sequence) && imageReady(offset))
+        {
+            flashCommitReady(offset);
+            break;
+        }
+    }
+
+    // If we were committing the image but the flashloader didn't flash it,
+    // committing it again won't do any better
+    if(watchdog_hw->scratch[0] == FLASH_APP_REJECTED)
+    {
+        if(sOffset && (watchdog_hw->scratch[1] == (XIP_BASE + sOffset)))
+            flashCommitCancel();
+
+        watchdog_hw->scratch[0] = 0;
+    }
+}
+
+//****************************************************************************
+void flashCommitReady(uint32_t offset)
+{
+    sOffset    = offset;
+    sReadyTime = time_us_32();
+}
+
+//****************************************************************************
+uint32_t flashCommitPending(void)
+{
+    // Replaced (and so invalidated) by another image being staged since
+    if(sOffset && (((const tFlashHeader*)(XIP_BASE + sOffset))->magic1 != FLASH_MAGIC1))
+        sOffset = 0;
+
+    return sOffset;
+}
+
+//****************************************************************************
+uint32_t flashCommitWaitingUs(void)
+{
+    return flashCommitPending() ? (time_us_32() - sReadyTime) : 0;
+}
+
+//****************************************************************************
+uint32_t flashCommitDowntimeUs(void)
+{
+    uint32_t eraseUs = stageEraseUs();
+    uint32_t pageUs = flashVerifyPageUs();
+    uint32_t length;
+
+    if(!flashCommitPending())
+        return 0;
+
+    length = flashCommitCheck(sOffset);
+
+    if(!eraseUs)
+        eraseUs = FLASH_COMMIT_ERASE_US;
+
+    if(!pageUs)
+        pageUs = FLASH_COMMIT_PAGE_US;
+
+    return FLASH_COMMIT_OVERHEAD_US + sStartupUs +
+           (((length + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE) * eraseUs) +
+           (((length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE) * pageUs);
+}
+
+//****************************************************************************
+void flashCommitNow(void)
+{
+    if(flashCommitPending())
+        sReboot(sOffset);
+}
+
+//****************************************************************************
+void flashCommitCancel(void)
+{
+    if(flashCommitPending())
+    {
+        // Core1 mustn't be reading the flash while it's programmed
+        flashVerifyWait();
+        invalidateStagedImage(sOffset);
+        sOffset = 0;
+    }
+}
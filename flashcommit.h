@@ -0,0 +1,92 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Committing staged update images.
+//
+// Staging an image doesn't reboot into the flashloader straight away.
+// Instead, the image is marked as ready and the application decides when
+// the device can afford to be out of action (e.g. when it's idle, within a
+// maintenance window or when told to by whatever is orchestrating the
+// update) and then calls flashCommitNow.  The image stays ready (even
+// across a reset) until it's either committed, cancelled or replaced by
+// another image being staged.
+//
+// flashCommitDowntimeUs predicts how long the device will be out of action
+// for: the flashloader erasing and programming the application (using the
+// sector erase and page program times measured while staging, or typical
+// times if nothing has been measured yet) plus the time it took this
+// application to start up.
+
+#ifndef __FLASHCOMMIT_INCL__
+#define __FLASHCOMMIT_INCL__
+
+#include <stdint.h>
+#include "flashloader.h"
+
+// Typical 4k sector erase and 256-byte page program times (in
+// microseconds), used until they have been measured
+#ifndef FLASH_COMMIT_ERASE_US
+    #define FLASH_COMMIT_ERASE_US 45000
+#endif
+
+#ifndef FLASH_COMMIT_PAGE_US
+    #define FLASH_COMMIT_PAGE_US 400
+#endif
+
+// Time (in microseconds) for the reboot and the flashloader's own checks,
+// on top of erasing and programming
+#ifndef FLASH_COMMIT_OVERHEAD_US
+    #define FLASH_COMMIT_OVERHEAD_US 5000
+#endif
+
+// Called to reboot into the flashloader to flash the image staged at the
+// given offset.  Must not return.
+typedef void (*tFlashCommitReboot)(uint32_t offset);
+
+//****************************************************************************
+// Set the function used to reboot into the flashloader and how long it took
+// the application to start (in microseconds).  Picks up any image that was
+// left ready before a reset, unless it was being committed and the
+// flashloader didn't flash it (in which case it's cancelled).
+void flashCommitInit(tFlashCommitReboot reboot, uint32_t startupUs);
+
+//****************************************************************************
+// Returns the length of the application the flashloader will write from the
+// image staged at the given offset or zero if it won't flash it (using the
+// flashloader's own checks, see flashImageCheck in flashloader.h).  The
+// application has to be built with the same FLASHLOADER_COMPRESSION and
+// FLASHLOADER_ENCRYPTION settings as the flashloader.  The CRC of the image
+// data isn't checked.
+uint32_t flashCommitCheck(uint32_t offset);
+
+//****************************************************************************
+// Mark the image that has just been staged (complete with its header) at
+// the given offset as ready to be flashed
+void flashCommitReady(uint32_t offset);
+
+//****************************************************************************
+// Returns the offset of the image that is ready to be flashed or 0 if there
+// isn't one
+uint32_t flashCommitPending(void);
+
+//****************************************************************************
+// Returns how long (in microseconds) the image has been ready for
+uint32_t flashCommitWaitingUs(void);
+
+//****************************************************************************
+// Returns the predicted time (in microseconds) from rebooting until the new
+// application is running or 0 if there is no image ready
+uint32_t flashCommitDowntimeUs(void);
+
+//****************************************************************************
+// Reboot into the flashloader to flash the image that is ready.  Only
+// returns if there isn't one.
+void flashCommitNow(void);
+
+//****************************************************************************
+// Make sure the image that is ready is never flashed
+void flashCommitCancel(void);
+
+#endif // __FLASHCOMMIT_INCL__
@@ -0,0 +1,226 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// CRC32 used throughout the update image format: polynomial 0x04C11DB7, no
+// reflection and no final XOR (the same as the RP2040's DMA sniffer
+// calculates).
+//
+// Several implementations are provided so that each target can pick the
+// fastest one it can afford without them drifting apart:
+//   flashCrc32Bitwise  - no table, smallest but slowest
+//   flashCrc32Table    - one 1k table, a byte at a time
+//   flashCrc32Slice4   - four tables, four bytes at a time
+//   flashCrc32Slice8   - eight tables, eight bytes at a time
+// In C, the tables are filled in at runtime by flashCrc32MakeTables (so they
+// can be placed in RAM rather than taking up flash).  In C++, they are
+// generated at compile time and flashCrc32() uses slice-by-8.
+//
+// This header is shared by the flashloader, the application and the host
+// tools so must not depend on the Pico SDK.
+
+#ifndef __FLASHCRC_INCL__
+#define __FLASHCRC_INCL__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLASH_CRC32_POLY    0x04c11db7u
+#define FLASH_CRC32_INIT    0xffffffffu     // Starting value
+#define FLASH_CRC32_CHECK   0x0376e6e7u     // CRC of "123456789"
+
+typedef uint32_t tFlashCrcTable[256];
+
+//****************************************************************************
+// Continue the CRC 'crc' over 'length' bytes of 'data' a bit at a time
+static inline uint32_t flashCrc32Bitwise(const void* data, size_t length, uint32_t crc)
+{
+    const uint8_t* ptr = (const uint8_t*)data;
+
+    while(length--)
+    {
+        crc ^= (uint32_t)*ptr++ << 24;
+
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80000000u) ? ((crc << 1) ^ FLASH_CRC32_POLY) : (crc << 1);
+    }
+
+    return crc;
+}
+
+//****************************************************************************
+// Fill in 'slices' (1, 4 or 8) tables.  Table 'n' gives the CRC of a byte
+// followed by 'n' zero bytes.
+static inline void flashCrc32MakeTables(tFlashCrcTable* tables, unsigned slices)
+{
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        uint8_t byte = (uint8_t)i;
+
+        tables[0][i] = flashCrc32Bitwise(&byte, 1, 0);
+    }
+
+    for(unsigned slice = 1; slice < slices; slice++)
+    {
+        for(uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t prev = tables[slice - 1][i];
+
+            tables[slice][i] = (prev << 8) ^ tables[0][prev >> 24];
+        }
+    }
+}
+
+//****************************************************************************
+// A byte at a time (needs one table)
+static inline uint32_t flashCrc32Table(const tFlashCrcTable* tables,
+                                       const void* data, size_t length, uint32_t crc)
+{
+    const uint8_t* ptr = (const uint8_t*)data;
+
+    while(length--)
+        crc = (crc << 8) ^ tables[0][(crc >> 24) ^ *ptr++];
+
+    return crc;
+}
+
+//****************************************************************************
+// Read four bytes as a big-endian value (the first byte is the most
+// significant as the CRC isn't reflected)
+static inline uint32_t flashCrcLoad32(const uint8_t* ptr)
+{
+    return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) |
+           ((uint32_t)ptr[2] << 8)  | ptr[3];
+}
+
+//****************************************************************************
+// Four bytes at a time (needs four tables)
+static inline uint32_t flashCrc32Slice4(const tFlashCrcTable* tables,
+                                        const void* data, size_t length, uint32_t crc)
+{
+    const uint8_t* ptr = (const uint8_t*)data;
+
+    for(; length >= 4; length -= 4, ptr += 4)
+    {
+        crc ^= flashCrcLoad32(ptr);
+        crc  = tables[3][crc >> 24] ^ tables[2][(crc >> 16) & 0xff] ^
+               tables[1][(crc >> 8) & 0xff] ^ tables[0][crc & 0xff];
+    }
+
+    return flashCrc32Table(tables, ptr, length, crc);
+}
+
+//****************************************************************************
+// Eight bytes at a time (needs eight tables)
+static inline uint32_t flashCrc32Slice8(const tFlashCrcTable* tables,
+                                        const void* data, size_t length, uint32_t crc)
+{
+    const uint8_t* ptr = (const uint8_t*)data;
+
+    for(; length >= 8; length -= 8, ptr += 8)
+    {
+        uint32_t high = crc ^ flashCrcLoad32(ptr);
+        uint32_t low  = flashCrcLoad32(ptr + 4);
+
+        crc = tables[7][high >> 24] ^ tables[6][(high >> 16) & 0xff] ^
+              tables[5][(high >> 8) & 0xff] ^ tables[4][high & 0xff] ^
+              tables[3][low >> 24] ^ tables[2][(low >> 16) & 0xff] ^
+              tables[1][(low >> 8) & 0xff] ^ tables[0][low & 0xff];
+    }
+
+    return flashCrc32Table(tables, ptr, length, crc);
+}
+
+#ifdef __cplusplus
+
+namespace flashcrc
+{
+
+template<unsigned SLICES>
+struct tTables
+{
+    tFlashCrcTable entry[SLICES];
+};
+
+//****************************************************************************
+// The same as flashCrc32MakeTables but at compile time
+template<unsigned SLICES>
+constexpr tTables<SLICES> makeTables()
+{
+    tTables<SLICES> tables {};
+
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i << 24;
+
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80000000u) ? ((crc << 1) ^ FLASH_CRC32_POLY) : (crc << 1);
+
+        tables.entry[0][i] = crc;
+    }
+
+    for(unsigned slice = 1; slice < SLICES; slice++)
+    {
+        for(uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t prev = tables.entry[slice - 1][i];
+
+            tables.entry[slice][i] = (prev << 8) ^ tables.entry[0][prev >> 24];
+        }
+    }
+
+    return tables;
+}
+
+inline constexpr tTables<8> TABLES = makeTables<8>();
+
+//****************************************************************************
+// Byte at a time using the compile-time table (to check it)
+constexpr uint32_t crc32(const char* data, size_t length, uint32_t crc)
+{
+    for(size_t i = 0; i < length; i++)
+        crc = (crc << 8) ^ TABLES.entry[0][(crc >> 24) ^ uint8_t(data[i])];
+
+    return crc;
+}
+
+//****************************************************************************
+// Eight bytes, then a byte at a time (to check the other tables)
+constexpr uint32_t crc32Slice8(const char* data, size_t length, uint32_t crc)
+{
+    for(; length >= 8; length -= 8, data += 8)
+    {
+        for(unsigned i = 0; i < 8; i++)
+            crc ^= (i < 4) ? (uint32_t(uint8_t(data[i])) << (24 - 8 * i)) : 0;
+
+        uint32_t value = crc;
+
+        crc = 0;
+        for(unsigned i = 0; i < 8; i++)
+        {
+            uint8_t byte = (i < 4) ? uint8_t(value >> (24 - 8 * i)) : uint8_t(data[i]);
+
+            crc ^= TABLES.entry[7 - i][byte];
+        }
+    }
+
+    return crc32(data, length, crc);
+}
+
+static_assert(TABLES.entry[0][1] == FLASH_CRC32_POLY, "CRC table doesn't match the polynomial");
+static_assert(crc32("123456789", 9, FLASH_CRC32_INIT) == FLASH_CRC32_CHECK, "CRC check value is wrong");
+static_assert(crc32Slice8("123456789", 9, FLASH_CRC32_INIT) == FLASH_CRC32_CHECK, "Slice-by-8 tables are wrong");
+
+} // namespace flashcrc
+
+//****************************************************************************
+// Fastest portable implementation for the host tools
+inline uint32_t flashCrc32(const void* data, size_t length, uint32_t crc)
+{
+    return flashCrc32Slice8(flashcrc::TABLES.entry, data, length, crc);
+}
+
+#endif // __cplusplus
+
+#endif // __FLASHCRC_INCL__
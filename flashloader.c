@@ -12,7 +12,9 @@
 //
 // If the watchdog scratch registers are correctly set, the flashloader will
 // replace the existing application with the new one stored in the location
-// provided and then reboot the processor.
+// provided and then jump straight into it (there is no need for a second
+// reset as only the DMA, timer and flash have been touched, which are
+// tidied up before jumping).
 //
 // If the existing application is invalid, the flashloader will check
 // each erase block for a valid update image and flash that if successful.
@@ -24,6 +26,8 @@
 #include "hardware/regs/addressmap.h"
 #include "hardware/regs/m0plus.h"
 #include "hardware/structs/watchdog.h"
+#include "hardware/structs/timer.h"
+#include "hardware/structs/xip_ctrl.h"
 #include "hardware/clocks.h"
 #include "hardware/pll.h"
 #include "hardware/xosc.h"
@@ -34,13 +38,69 @@
 #include "pico/bootrom.h"
 #include "pico/binary_info.h"
 #include "flashloader.h"
+#include "flashlayout.h"
+#include "flashpartition.h"
+#include "flashwear.h"
+#include "flashlz.h"
+
+#if FLASHLOADER_PROGRESS
+#include "hardware/structs/iobank0.h"
+#include "hardware/structs/uart.h"
+#endif
+
+#if FLASHLOADER_ENCRYPTION
+#include "hardware/structs/scb.h"
+#include "pico/multicore.h"
+
+// The keystream is generated by core1 while core0 is programming the flash
+// so it has to run from RAM
+#define FLASH_AES_FUNC(name) __not_in_flash_func(name)
+#include "flashaes.h"
+#endif
 
-bi_decl(bi_program_version_string("1.10"));
+bi_decl(bi_program_version_string("2.00"));
 
 #if !PICO_FLASH_SIZE_BYTES
     #error PICO_FLASH_SIZE_BYTES not defined!
 #endif
 
+#if FLASH_LAYOUT_SIZE > PICO_FLASH_SIZE_BYTES
+    #error The flash layout (flashlayout.txt) is larger than the flash!
+#endif
+
+// Settings fixed by the board/flash profile the flashloader is built for
+// (see flashprofiles.txt).  The defaults suit any flash but only ever erase
+// one sector at a time.
+#ifndef FLASHLOADER_ERASE_SIZE
+    #define FLASHLOADER_ERASE_SIZE  FLASH_SECTOR_SIZE
+#endif
+
+#ifndef FLASHLOADER_WATCHDOG_MS
+    #define FLASHLOADER_WATCHDOG_MS 500
+#endif
+
+#ifndef FLASHLOADER_SYS_MHZ
+    #define FLASHLOADER_SYS_MHZ     125
+    #define FLASHLOADER_VCO_MHZ     1500
+    #define FLASHLOADER_POSTDIV1    6
+    #define FLASHLOADER_POSTDIV2    2
+#endif
+
+// The SDK's flash_range_erase only uses the block erase command for 64k
+// blocks
+#if (FLASHLOADER_ERASE_SIZE != FLASH_SECTOR_SIZE) && (FLASHLOADER_ERASE_SIZE != FLASH_BLOCK_SIZE)
+    #error FLASHLOADER_ERASE_SIZE must be a sector or a 64k block!
+#endif
+
+#if FLASHLOADER_APP_CHECK && !defined(FLASH_BOOTSTATE_OFFSET)
+    #error FLASHLOADER_APP_CHECK needs a 'bootstate' partition in flashlayout.txt!
+#endif
+
+// Only one sector is erased when the boot state records are full
+#if FLASHLOADER_APP_CHECK && (FLASH_BOOTSTATE_LENGTH != FLASH_SECTOR_SIZE)
+    #error The 'bootstate' partition in flashlayout.txt must be one sector!
+#endif
+
 extern void* __APPLICATION_START;
 
 //****************************************************************************
@@ -58,6 +118,15 @@ extern void* __APPLICATION_START;
 
 static const uint32_t  sStart = XIP_BASE + (uint32_t)&__APPLICATION_START;
 
+// Update images are only looked for in the staging area
+static const uint32_t  sStagingStart = XIP_BASE + FLASH_STAGING_OFFSET;
+static const uint32_t  sStagingEnd   = XIP_BASE + FLASH_STAGING_OFFSET + FLASH_STAGING_LENGTH;
+
+// Partition table describing the layout we were built with.  Placed at the
+// end of the flashloader's area of flash by memmap_flashloader.ld.
+static const uint32_t  sPartitionTable[] __attribute__((section(".partition_table"), used)) =
+    FLASH_PARTITION_TABLE_WORDS;
+
 // The maximum number of times the flashloader will try to flash an image
 // before it gives up and boots in the bootrom bootloader
 static const uint32_t  sMaxRetries = 3;
@@ -70,6 +139,68 @@ static const uint8_t sDMAChannel = 0;
 // Must be aligned to a 256 byte boundary to allow use as a DMA ring buffer
 static uint8_t sPageBuffer[256] __attribute__ ((aligned(256)));
 
+#if FLASHLOADER_COMPRESSION
+// Compression details of the image found by checkImage (null if the image
+// is not compressed)
+static const tFlashCompression* sCompression;
+
+// Buffer to decompress a block of the image into
+static uint8_t sBlockBuffer[1 << FLASH_COMPRESSION_SHIFT] __attribute__ ((aligned(4)));
+#endif
+
+#if FLASHLOADER_ENCRYPTION
+// Key the images are encrypted with (FLASHLOADER_AES_KEY in CMakeLists.txt)
+static const uint8_t sAesKey[FLASH_AES_KEY_LENGTH] = { FLASHLOADER_AES_KEY };
+
+// Encryption details of the image found by checkImage (null if the image
+// is not encrypted)
+static const tFlashEncryption* sEncryption;
+
+// Everything core1 needs to generate the keystream is in RAM as it runs
+// while the flash can't be read
+static tFlashAes sAes;
+static uint8_t   sNonce[FLASH_AES_NONCE_LENGTH];
+static uint8_t   sKeystream[256] __attribute__ ((aligned(4)));
+static uint32_t  sCore1Stack[64];
+#endif
+
+#if FLASHLOADER_APP_CHECK
+// Boot state records (see tFlashBootState), filling the partition in order
+static const tFlashBootState* const sBootState =
+    (const tFlashBootState*)(XIP_BASE + FLASH_BOOTSTATE_OFFSET);
+static const uint32_t sBootStateCount = FLASH_BOOTSTATE_LENGTH / sizeof(tFlashBootState);
+#endif
+
+#if FLASHLOADER_PROGRESS
+// Progress records are written to a RAM ring buffer and sent to the UART by
+// DMA so they don't hold up the flash work (and still go out while the flash
+// is busy).  A record is 17 bytes and they're at least a few milliseconds
+// apart, so the buffer only fills up if the UART isn't keeping up at all,
+// in which case records are dropped rather than waiting.
+#if PICO_DEFAULT_UART == 1
+    #define PROGRESS_UART   uart1_hw
+    #define PROGRESS_RESET  RESETS_RESET_UART1_BITS
+    #define PROGRESS_DREQ   DREQ_UART1_TX
+#else
+    #define PROGRESS_UART   uart0_hw
+    #define PROGRESS_RESET  RESETS_RESET_UART0_BITS
+    #define PROGRESS_DREQ   DREQ_UART0_TX
+#endif
+
+// clk_peri runs from clk_sys (see initClock).  The UART divisor is in 64ths.
+#define PROGRESS_DIVISOR    ((((FLASHLOADER_SYS_MHZ * 1000000u * 8) / FLASHLOADER_PROGRESS_BAUD) + 1) / 2)
+
+#define PROGRESS_BUFFER_LENGTH  128
+#define PROGRESS_RECORD_LENGTH  17
+
+static const uint8_t sProgressChannel = 1;
+
+static uint8_t  sProgressBuffer[PROGRESS_BUFFER_LENGTH]
+                    __attribute__ ((aligned(PROGRESS_BUFFER_LENGTH)));
+static uint32_t sProgressHead;      // Total bytes written to the buffer
+static uint32_t sProgressSent;      // Total bytes handed to the DMA channel
+#endif
+
 
 #ifndef USE_PICO_STDLIB
 //****************************************************************************
@@ -121,13 +252,18 @@ void __assert_func(const char *filename,
 // not really a huge issue as most of the time we just need to check the
 // boot2 image is valid (252 bytes) but using DMA ought to be faster than
 // looping over the data without a lookup table and is certainly a lot smaller
-// than the lookup table.
+// than the lookup table.  flashcrc.h has the software equivalents.
+// Whole words are transferred if the data is aligned (the sniffer still
+// sees the bytes in the same order) so checking a whole application is
+// four times quicker.
 uint32_t crc32(const void *data, size_t len, uint32_t crc)
 {
-    uint8_t dummy;
+    uint32_t dummy;
+    enum dma_channel_transfer_size size =
+        (((uint32_t)data | len) & 3) ? DMA_SIZE_8 : DMA_SIZE_32;
 
     dma_channel_config c = dma_channel_get_default_config(sDMAChannel);
-    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_transfer_data_size(&c, size);
     channel_config_set_read_increment(&c, true);
     channel_config_set_write_increment(&c, false);
     channel_config_set_sniff_enable(&c, true);
@@ -141,7 +277,7 @@ uint32_t crc32(const void *data, size_t len, uint32_t crc)
         &c,
         &dummy,
         data,
-        len,
+        len >> size,
         true    // Start immediately
     );
 
@@ -186,12 +322,203 @@ uint32_t copyPage()
     return(dma_hw->sniff_data);
 }
 
+#if FLASHLOADER_PROGRESS
 //****************************************************************************
-// Start the main application if its boot2 image is valid.
+// Set up the UART (transmit only) and a DMA channel to feed it
+void progressInit(void)
+{
+    unreset_block_wait(PROGRESS_RESET | RESETS_RESET_IO_BANK0_BITS | RESETS_RESET_PADS_BANK0_BITS);
+
+    // clk_peri from clk_sys
+    clocks_hw->clk[clk_peri].ctrl = CLOCKS_CLK_PERI_CTRL_ENABLE_BITS;
+
+    PROGRESS_UART->ibrd  = PROGRESS_DIVISOR >> 6;
+    PROGRESS_UART->fbrd  = PROGRESS_DIVISOR & 0x3f;
+    PROGRESS_UART->lcr_h = (3 << UART_UARTLCR_H_WLEN_LSB) | UART_UARTLCR_H_FEN_BITS;
+    PROGRESS_UART->cr    = UART_UARTCR_UARTEN_BITS | UART_UARTCR_TXE_BITS;
+    PROGRESS_UART->dmacr = UART_UARTDMACR_TXDMAE_BITS;
+
+    iobank0_hw->io[PICO_DEFAULT_UART_TX_PIN].ctrl = GPIO_FUNC_UART;
+
+    dma_channel_config c = dma_channel_get_default_config(sProgressChannel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_ring(&c, false, 7); // (log2(PROGRESS_BUFFER_LENGTH) == 7)
+    channel_config_set_dreq(&c, PROGRESS_DREQ);
+
+    dma_channel_configure(sProgressChannel, &c, &PROGRESS_UART->dr, sProgressBuffer, 0, false);
+}
+
+//****************************************************************************
+// Add a value to the buffer as 'digits' hex digits
+static void progressHex(uint32_t value, uint32_t digits)
+{
+    while(digits--)
+    {
+        uint32_t nibble = (value >> (digits * 4)) & 0xf;
+
+        sProgressBuffer[sProgressHead++ % PROGRESS_BUFFER_LENGTH] =
+            (uint8_t)((nibble < 10) ? ('0' + nibble) : ('a' - 10 + nibble));
+    }
+}
+
+//****************************************************************************
+// Start sending whatever hasn't been sent yet if the UART is idle
+static void progressSend(void)
+{
+    if(!dma_channel_is_busy(sProgressChannel) && (sProgressHead != sProgressSent))
+    {
+        dma_channel_transfer_from_buffer_now(sProgressChannel,
+                                             &sProgressBuffer[sProgressSent % PROGRESS_BUFFER_LENGTH],
+                                             sProgressHead - sProgressSent);
+        sProgressSent = sProgressHead;
+    }
+}
+
+//****************************************************************************
+// Queue a progress record and send it if the UART is idle.  Each record is
+// one line:
+//   <phase><sector> <elapsed> <retries>
+// with the sector (relative to the start of the application), microseconds
+// since reset and retry count in hex.  The phases are:
+//   S  starting (the sector is the number of sectors to erase)
+//   E  sector erased
+//   P  sector programmed
+//   D  done (the new application has been verified)
+//   F  failed (the flashloader will reboot and try again)
+void progress(char phase, uint32_t sector)
+{
+    uint32_t pending = (sProgressHead - sProgressSent) +
+                       dma_hw->ch[sProgressChannel].transfer_count;
+
+    if((pending + PROGRESS_RECORD_LENGTH) <= PROGRESS_BUFFER_LENGTH)
+    {
+        sProgressBuffer[sProgressHead++ % PROGRESS_BUFFER_LENGTH] = phase;
+        progressHex(sector, 3);
+        sProgressBuffer[sProgressHead++ % PROGRESS_BUFFER_LENGTH] = ' ';
+        progressHex(timer_hw->timerawl, 8);
+        sProgressBuffer[sProgressHead++ % PROGRESS_BUFFER_LENGTH] = ' ';
+        progressHex(watchdog_hw->scratch[2], 1);
+        sProgressBuffer[sProgressHead++ % PROGRESS_BUFFER_LENGTH] = '\r';
+        sProgressBuffer[sProgressHead++ % PROGRESS_BUFFER_LENGTH] = '\n';
+    }
+
+    progressSend();
+}
+
+//****************************************************************************
+// Wait until every record has gone out of the UART (before the DMA and UART
+// are reset)
+void progressFlush(void)
+{
+    while(sProgressHead != sProgressSent)
+    {
+        dma_channel_wait_for_finish_blocking(sProgressChannel);
+        progressSend();
+    }
+
+    dma_channel_wait_for_finish_blocking(sProgressChannel);
+
+    while(PROGRESS_UART->fr & UART_UARTFR_BUSY_BITS)
+        tight_loop_contents();
+}
+#endif
+
+#if FLASHLOADER_APP_CHECK
+//****************************************************************************
+// Returns the index of the first unused boot state record (records are only
+// ever added so the used ones are all at the start of the partition)
+static uint32_t bootStateFree(void)
+{
+    uint32_t low = 0;
+    uint32_t high = sBootStateCount;
+
+    while(low < high)
+    {
+        uint32_t mid = (low + high) / 2;
+
+        if(sBootState[mid].magic == 0xffffffff)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+
+    return low;
+}
+
+//****************************************************************************
+// Add a record to the boot state partition, erasing it first if it's full
+void bootStateAppend(const tFlashBootState* state)
+{
+    uint32_t index = bootStateFree();
+    uint32_t offset;
+
+    if(index == sBootStateCount)
+    {
+        flashWearRecord(FLASH_BOOTSTATE_OFFSET, FLASH_SECTOR_SIZE);
+        flash_range_erase(FLASH_BOOTSTATE_OFFSET, FLASH_SECTOR_SIZE);
+        index = 0;
+    }
+
+    // Programming can only clear bits so the rest of the page is left alone
+    for(offset = 0; offset < sizeof(sPageBuffer); offset += 4)
+        *(uint32_t*)&sPageBuffer[offset] = 0xffffffff;
+
+    offset = index * sizeof(tFlashBootState);
+    *(tFlashBootState*)&sPageBuffer[offset & 0xff] = *state;
+
+    flash_range_program(FLASH_BOOTSTATE_OFFSET + (offset & ~0xff), sPageBuffer, 256);
+}
+
+//****************************************************************************
+// Check the whole application against the last boot state record, unless
+// that has already been done.  An application without a record (e.g. one
+// that was loaded by the bootrom) is only checked by its boot2 CRC, as
+// before.
+// Returns non-zero if the application can be started
+int checkApplication(void)
+{
+    uint32_t index = bootStateFree();
+    tFlashBootState state;
+    uint32_t crc;
+
+    if(index == 0)
+        return 1;
+
+    state = sBootState[index - 1];
+
+    if((state.magic != FLASH_BOOT_MAGIC) || (state.length > FLASH_APPLICATION_LENGTH))
+        return 1;
+
+    if(state.stamp == ~state.crc32)
+        return 1;
+
+    crc = crc32((const void*)sStart, state.length & ~3, 0xffffffff);
+    crc = crc32((const void*)(sStart + (state.length & ~3)), state.length & 3, crc);
+
+    if(crc != state.crc32)
+        return 0;
+
+    // Don't check it again
+    state.stamp = ~state.crc32;
+    bootStateAppend(&state);
+
+    return 1;
+}
+#endif
+
+//****************************************************************************
+// Start the main application if its boot2 image is valid (and, if built with
+// FLASHLOADER_APP_CHECK, the whole application matches its boot state).
 // Will not return unless the image is invalid
 int startMainApplication()
 {
-    if(crc32((const void*)sStart, 252, 0xffffffff) == bl2crc(sStart))
+    if((crc32((const void*)sStart, 252, 0xffffffff) == bl2crc(sStart))
+#if FLASHLOADER_APP_CHECK
+       && checkApplication()
+#endif
+      )
     {
         // Main application appears to be OK so we can map the application's
         // vector table and jump to the start of its code
@@ -203,9 +530,19 @@ int startMainApplication()
             watchdog_hw->scratch[0] = 0;
         }
 
-        // Hold DMA block in reset again (in case the application doesn't
-        // need DMA and doesn't want to waste power)
-        reset_block(RESETS_RESET_DMA_BITS);
+        // Hold DMA and timer blocks in reset again (in case the application
+        // doesn't need them and doesn't want to waste power)
+        reset_block(RESETS_RESET_DMA_BITS | RESETS_RESET_TIMER_BITS);
+
+#if FLASHLOADER_PROGRESS
+        reset_block(PROGRESS_RESET);
+#endif
+
+        // Clear the XIP cache counters so the application's statistics
+        // aren't skewed by anything we've done (writing any value clears
+        // them)
+        xip_ctrl_hw->ctr_hit = 0;
+        xip_ctrl_hw->ctr_acc = 0;
 
         asm volatile (
         "mov r0, %[start]\n"
@@ -225,37 +562,200 @@ int startMainApplication()
 }
 
 //****************************************************************************
-// Flash the main application using the provided image.
-void flashFirmware(const tFlashHeader* header, uint32_t eraseLength)
+// Check that the header at the given address describes a complete, valid
+// update image (see flashImageCheck in flashloader.h, which the application
+// uses too) and that the image data matches its CRC.
+// Returns the length of the application (once decompressed, if necessary)
+// if the image is valid or zero if not.
+uint32_t checkImage(const tFlashHeader* header)
 {
-    uint32_t crc = 0;
-    uint32_t offset = 256;
+    const tFlashCompression* compression;
+    const tFlashEncryption* encryption;
+    uint32_t length;
 
-    // Start the watchdog and give us 500ms for each erase/write cycle.
-    // This should be more than enough time but in case anything happens,
-    // we'll reset and try again.
-    watchdog_reboot(0, 0, 500);
+    length = flashImageCheck(header, sStagingEnd - (uint32_t)header,
+                             FLASH_APPLICATION_LENGTH, crc32,
+                             &compression, &encryption);
 
-    // Erase the target memory area
-    uint32_t start = flashoffset(sStart);
+#if FLASHLOADER_COMPRESSION
+    sCompression = compression;
+#endif
+
+#if FLASHLOADER_ENCRYPTION
+    sEncryption = encryption;
+#endif
 
-    for(uint32_t sectors = eraseLength / FLASH_SECTOR_SIZE; sectors > 0; sectors--)
+    if(!length ||
+       (crc32(flashHeaderData(header), header->length, 0xffffffff) != header->crc32))
+        return 0;
+
+    return length;
+}
+
+#if FLASHLOADER_COMPRESSION
+//****************************************************************************
+// Decompress each block of a compressed image and write it to flash, except
+// for the first page, which is left in the page buffer to be written last.
+// Returns non-zero if everything was written correctly
+int programCompressed(const uint8_t* data)
+{
+    const uint32_t blockSize = 1 << FLASH_COMPRESSION_SHIFT;
+    uint32_t offset = 0;
+    uint32_t block = 0;
+    uint32_t expected;
+    uint32_t length;
+    uint32_t size;
+    uint32_t page;
+
+    while(offset < sCompression->rawLength)
     {
-        flash_range_erase(start, FLASH_SECTOR_SIZE);
-        start += FLASH_SECTOR_SIZE;
+        // Reset the watchdog counter
         watchdog_update();
+
+        size     = sCompression->offset[block + 1] - sCompression->offset[block];
+        expected = sCompression->rawLength - offset;
+
+        if(expected > blockSize)
+            expected = blockSize;
+
+        if(size > expected)
+            return 0;
+
+        if(size == expected)
+        {
+            // Block wasn't compressible so was stored as-is
+            for(length = 0; length < size; length++)
+                sBlockBuffer[length] = data[sCompression->offset[block] + length];
+        }
+        else
+        if(flashLzDecode(&data[sCompression->offset[block]], size,
+                         sBlockBuffer, expected) != expected)
+            return 0;
+
+        // Fill the rest of the last page
+        for(length = expected; length & 0xff; length++)
+            sBlockBuffer[length] = 0xff;
+
+        page = 0;
+        if(offset == 0)
+        {
+            // Save the first page for later
+            for(page = 0; page < 256; page++)
+                sPageBuffer[page] = sBlockBuffer[page];
+        }
+
+        if(page < length)
+            flash_range_program(flashoffset(sStart) + offset + page,
+                                &sBlockBuffer[page],
+                                length - page);
+
+#if FLASHLOADER_PROGRESS
+        progress('P', block);
+#endif
+
+        offset += blockSize;
+        block++;
     }
 
-    // Write everything except the first page.  If there's any kind
-    // of power failure during writing, this will prevent anything
-    // trying to boot the partially flashed image
+    // Reset the watchdog counter
+    watchdog_update();
+
+    // Check that what's in flash (plus the first page) matches what was
+    // originally compressed
+    return crc32((const void*)(sStart + 256), sCompression->rawLength - 256,
+                 crc32(sPageBuffer, 256, 0xffffffff)) == sCompression->rawCrc32;
+}
+#endif
+
+#if FLASHLOADER_ENCRYPTION
+//****************************************************************************
+// Runs on core1, entirely from RAM.  Each offset core0 sends is a page of
+// the application: the keystream for it is written to sKeystream and the
+// offset is sent back once it's ready.  This happens while core0 is busy
+// programming the previous page so decrypting takes almost no extra time.
+static void __not_in_flash_func(keystreamTask)(void)
+{
+    uint32_t offset;
+
+    while(true)
+    {
+        while(!multicore_fifo_rvalid())
+            __wfe();
+
+        offset = sio_hw->fifo_rd;
+        flashAesKeystream(&sAes, sNonce, offset / FLASH_AES_BLOCK_LENGTH,
+                          sKeystream, sizeof(sKeystream));
+
+        while(!multicore_fifo_wready())
+            tight_loop_contents();
+
+        sio_hw->fifo_wr = offset;
+        __sev();
+    }
+}
+
+//****************************************************************************
+// Set up the cipher and start core1 on the keystream for the page at
+// 'offset'
+void keystreamStart(uint32_t offset)
+{
+    flashAesInit(&sAes, sAesKey);
+
+    for(uint32_t i = 0; i < FLASH_AES_NONCE_LENGTH; i++)
+        sNonce[i] = sEncryption->nonce[i];
+
+    multicore_reset_core1();
+    multicore_launch_core1_raw(keystreamTask,
+                               &sCore1Stack[sizeof(sCore1Stack) / sizeof(sCore1Stack[0])],
+                               scb_hw->vtor);
+    multicore_fifo_push_blocking(offset);
+}
+
+//****************************************************************************
+// Decrypt the page at 'offset' in the page buffer once core1 has its
+// keystream ready.  Anything after the end of the application is left as
+// it is so the last sector matches what it would be unencrypted.
+void decryptPage(uint32_t offset, uint32_t length)
+{
+    uint32_t* page = (uint32_t*)sPageBuffer;
+    const uint32_t* keystream = (const uint32_t*)sKeystream;
+    uint32_t count = length - offset;
+    uint32_t i;
+
+    if(count > sizeof(sPageBuffer))
+        count = sizeof(sPageBuffer);
+
+    multicore_fifo_pop_blocking();
+
+    // This is all core0 has to do for each page so a word at a time
+    for(i = 0; i < (count / 4); i++)
+        page[i] ^= keystream[i];
+
+    for(i *= 4; i < count; i++)
+        sPageBuffer[i] ^= sKeystream[i];
+}
+#endif
+
+//****************************************************************************
+// Copy the image (apart from the first page) to flash.
+// Returns non-zero if everything was written correctly
+int programPages(const uint8_t* data, uint32_t length)
+{
+    uint32_t crc = 0;
+    uint32_t offset = 256;
+    int success;
 
     // Get total number of pages - 1 (because we're flashing the first page
     // separately)
-    uint32_t pages = ((header->length - 1) >> 8);
+    uint32_t pages = ((length - 1) >> 8);
 
     // Prepare the DMA channel for copying
-    copyPageInit(header->data + offset);
+    copyPageInit(data + offset);
+
+#if FLASHLOADER_ENCRYPTION
+    if(sEncryption)
+        keystreamStart(pages ? offset : 0);
+#endif
 
     while(pages > 0)
     {
@@ -265,9 +765,26 @@ void flashFirmware(const tFlashHeader* header, uint32_t eraseLength)
         // Copy the page to a RAM buffer so we're not trying to read from
         // flash whilst writing to it
         crc = copyPage();
+
+#if FLASHLOADER_ENCRYPTION
+        // Decrypt the page then let core1 get on with the next one (or the
+        // first page, which is written last) while this one is programmed
+        if(sEncryption)
+        {
+            decryptPage(offset, length);
+            multicore_fifo_push_blocking((pages > 1) ? (offset + 256) : 0);
+        }
+#endif
+
         flash_range_program(flashoffset(sStart + offset),
                             sPageBuffer,
                             256);
+
+#if FLASHLOADER_PROGRESS
+        if(((offset + 256) % FLASH_SECTOR_SIZE) == 0)
+            progress('P', offset / FLASH_SECTOR_SIZE);
+#endif
+
         offset += 256;
         pages--;
     }
@@ -276,12 +793,112 @@ void flashFirmware(const tFlashHeader* header, uint32_t eraseLength)
     watchdog_update();
 
     // Check that everything so far has been written correctly
-    if(crc == crc32(&header->data[256], offset - 256, 0xffffffff))
+    success = (crc == crc32(&data[256], offset - 256, 0xffffffff));
+
+    // Copy the first page to the page buffer ready to be written
+    copyPageInit(data);
+    copyPage();
+
+#if FLASHLOADER_ENCRYPTION
+    if(sEncryption)
     {
-        // Now flash the first page which is the boot2 image with CRC.
-        copyPageInit(header->data);
-        crc = copyPage();
+        decryptPage(0, length);
+        multicore_reset_core1();
+
+        // Check what's in flash (plus the first page) is what was
+        // originally encrypted
+        success = success &&
+                  (crc32((const void*)(sStart + 256), length - 256,
+                         crc32(sPageBuffer, 256, 0xffffffff)) == sEncryption->plainCrc32);
+    }
+#endif
+
+    return success;
+}
+
+//****************************************************************************
+// Flash the main application using the provided image.
+// Returns non-zero if the application was flashed successfully
+int flashFirmware(const tFlashHeader* header, uint32_t eraseLength)
+{
+    const uint8_t* data = flashHeaderData(header);
+    uint32_t offset;
+    int success;
+
+    // Start the watchdog and give us 500ms (or however long the profile
+    // says the slowest erase can take) for each erase/write cycle.
+    // This should be more than enough time but in case anything happens,
+    // we'll reset and try again.
+    watchdog_reboot(0, 0, FLASHLOADER_WATCHDOG_MS);
+
+#if FLASHLOADER_PROGRESS
+    progressInit();
+    progress('S', eraseLength / FLASH_SECTOR_SIZE);
+#endif
+
+#if FLASHLOADER_APP_CHECK
+    // Record what the application should be before touching it so that it
+    // gets checked in full the next time it's started
+    tFlashBootState state = { FLASH_BOOT_MAGIC, header->length, header->crc32, 0xffffffff };
+
+#if FLASHLOADER_COMPRESSION
+    if(sCompression)
+    {
+        state.length = sCompression->rawLength;
+        state.crc32  = sCompression->rawCrc32;
+    }
+#endif
+#if FLASHLOADER_ENCRYPTION
+    if(sEncryption)
+        state.crc32 = sEncryption->plainCrc32;
+#endif
+
+    bootStateAppend(&state);
+#endif
 
+    // Erase the target memory area (counting the erases first so they
+    // can't be missed if the power fails part way through)
+    uint32_t start = flashoffset(sStart);
+
+    flashWearRecord(start, eraseLength);
+
+    for(uint32_t end = start + eraseLength; start < end; )
+    {
+        uint32_t size = FLASH_SECTOR_SIZE;
+
+#if FLASHLOADER_ERASE_SIZE > FLASH_SECTOR_SIZE
+        // A whole block is erased by a single command, which is much
+        // quicker than erasing its sectors one at a time
+        if(((start % FLASHLOADER_ERASE_SIZE) == 0) && ((end - start) >= FLASHLOADER_ERASE_SIZE))
+            size = FLASHLOADER_ERASE_SIZE;
+#endif
+
+        flash_range_erase(start, size);
+
+        start += size;
+
+#if FLASHLOADER_PROGRESS
+        progress('E', ((start - flashoffset(sStart)) / FLASH_SECTOR_SIZE) - 1);
+#endif
+
+        watchdog_update();
+    }
+
+    // Write everything except the first page.  If there's any kind
+    // of power failure during writing, this will prevent anything
+    // trying to boot the partially flashed image
+#if FLASHLOADER_COMPRESSION
+    if(sCompression)
+        success = programCompressed(data);
+    else
+#endif
+        success = programPages(data, header->length);
+
+    // Now flash the first page which is the boot2 image with CRC (as long
+    // as it really is a boot2 image, which we haven't been able to check
+    // yet if the image was compressed)
+    if(success && (crc32(sPageBuffer, 252, 0xffffffff) == bl2crc(sPageBuffer)))
+    {
         flash_range_program(flashoffset(sStart),
                             sPageBuffer,
                             256);
@@ -289,19 +906,34 @@ void flashFirmware(const tFlashHeader* header, uint32_t eraseLength)
         // Reset the watchdog counter
         watchdog_update();
 
-        if(crc == crc32(header->data, 256, 0xffffffff))
+        if(crc32((const void*)sStart, 256, 0xffffffff) == crc32(sPageBuffer, 256, 0xffffffff))
         {
-            // Invalidate the start of the flash image to prevent it being
-            // picked up again (prevents cyclic flashing if the image is bad)
-            flash_range_erase(flashoffset(header), 4096);
+            // Invalidate the flash image to prevent it being picked up again
+            // (prevents cyclic flashing if the image is bad).  Programming
+            // can only clear bits so writing 0xff over the rest of the page
+            // leaves it untouched and saves wearing out the staging sector
+            // with another erase.
+            for(offset = 0; offset < sizeof(sPageBuffer); offset += 4)
+                *(uint32_t*)&sPageBuffer[offset] = 0xffffffff;
+
+            *(uint32_t*)sPageBuffer = FLASH_MAGIC1_CONSUMED;
+            flash_range_program(flashoffset(header), sPageBuffer, 256);
 
             // Indicate to the application that it has been updated
             watchdog_hw->scratch[0] = FLASH_APP_UPDATED;
         }
     }
 
+#if FLASHLOADER_PROGRESS
+    progress((watchdog_hw->scratch[0] == FLASH_APP_UPDATED) ? 'D' : 'F',
+             eraseLength / FLASH_SECTOR_SIZE);
+    progressFlush();
+#endif
+
     // Disable the watchdog
     hw_clear_bits(&watchdog_hw->ctrl, WATCHDOG_CTRL_ENABLE_BITS);
+
+    return (watchdog_hw->scratch[0] == FLASH_APP_UPDATED);
 }
 
 //****************************************************************************
@@ -353,7 +985,7 @@ void initClock()
     while (clocks_hw->clk[clk_ref].selected != 0x1)
         tight_loop_contents();
 
-    pll_init(pll_sys, 1, 1500 * MHZ, 6, 2);
+    pll_init(pll_sys, 1, FLASHLOADER_VCO_MHZ * MHZ, FLASHLOADER_POSTDIV1, FLASHLOADER_POSTDIV2);
 
     configClock(clk_ref,
                 CLOCKS_CLK_REF_CTRL_SRC_VALUE_XOSC_CLKSRC,
@@ -376,10 +1008,13 @@ int main(void)
     // Use xosc, which will give us a speed boost
     initClock();
 
-    // Take DMA block out of reset so we can use it to calculate CRCs
-    unreset_block_wait(RESETS_RESET_DMA_BITS);
+    // Take DMA block out of reset so we can use it to calculate CRCs and the
+    // timer so we can report how long an update took.  The timer counts
+    // microseconds using the tick started in initClock.
+    unreset_block_wait(RESETS_RESET_DMA_BITS | RESETS_RESET_TIMER_BITS);
 
-    if((scratch == FLASH_MAGIC1) && ((image & 0xfff) == 0) && (image > sStart))
+    if((scratch == FLASH_MAGIC1) && ((image & 0xfff) == 0) &&
+       (image >= sStagingStart) && (image < sStagingEnd))
     {
         // Invert the magic number (so we know we've been here) and
         // initialise the retry counter
@@ -394,7 +1029,7 @@ int main(void)
     {
         // Tried and failed to start the main application so try to find
         // an update image
-        image = sStart + 0x1000;
+        image = sStagingStart;
 
         // In case there are any problems during flashing, make it look like
         // an update was requested so that the retry mechanism is correctly
@@ -404,25 +1039,20 @@ int main(void)
         watchdog_hw->scratch[2] = 0;
     }
 
-    while(image < (XIP_BASE + PICO_FLASH_SIZE_BYTES))
+    while(image < sStagingEnd)
     {
         header = (const tFlashHeader*)image;
 
-        if((header->magic1 == FLASH_MAGIC1) &&
-           (header->magic2 == FLASH_MAGIC2) &&
-           (crc32(header->data, header->length, 0xffffffff) == header->crc32) &&
-           (crc32(header->data, 252, 0xffffffff) == bl2crc(header->data)))
+        uint32_t length = checkImage(header);
+
+        // A valid image always fits in the application's partition (so we
+        // are sure that it won't clobber the staging area when we erase the
+        // flash before programming)
+        if(length)
         {
             // Round up erase length to next 4k boundary
-            eraseLength = (header->length + 4095) & 0xfffff000;
-
-            // Looks like we've found a valid image but only use it if we
-            // are sure that it won't get clobbered when we erase the flash
-            // before programming.
-            if((sStart + eraseLength) < (uint32_t)header)
-                break;
-            else
-                eraseLength = 0;
+            eraseLength = (length + 4095) & 0xfffff000;
+            break;
         }
 
         image += 0x1000;
@@ -431,9 +1061,18 @@ int main(void)
     // If we've found a new, valid image, go ahead and flash it!
     if((eraseLength != 0) && (watchdog_hw->scratch[2] < sMaxRetries))
     {
-        flashFirmware(header, eraseLength);
+        if(flashFirmware(header, eraseLength))
+        {
+            // Let the application know how long it was down for (at least,
+            // how long we spent in the flashloader)
+            watchdog_hw->scratch[3] = timer_hw->timerawl;
 
-        // Reboot into the new image
+            // No need to go through another reset: the new image has
+            // been verified so jump straight into it
+            startMainApplication();
+        }
+
+        // Reboot and try again (until we run out of retries)
         watchdog_reboot(0, 0, 50);
 
         while(true)
@@ -444,9 +1083,14 @@ int main(void)
     // there was a problem with the update image (or it couldn't be found).
 
     // If we were originally explicitly triggered by a watchdog reset, try
-    // to start the normal application since we didn't before
+    // to start the normal application since we didn't before.  Let it know
+    // the image wasn't flashed (startMainApplication leaves this alone) so
+    // it doesn't just ask for it again.
     if((scratch == FLASH_MAGIC1) || (scratch == ~FLASH_MAGIC1))
+    {
+        watchdog_hw->scratch[0] = FLASH_APP_REJECTED;
         startMainApplication();
+    }
 
     // Otherwise go to the bootrom bootloader as a last resort
     reset_usb_boot(0, 0);
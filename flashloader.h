@@ -4,24 +4,346 @@
 // SPDX-License-Identifier: BSD-3-Clause
 //
 // Flashloader for the RP2040
+//
+// This header defines the update image format shared between the
+// flashloader, the application and any host tooling so it must not depend
+// on anything from the Pico SDK.
 
 #ifndef __FLASHLOADER_INCL__
 #define __FLASHLOADER_INCL__
 
+#include <stddef.h>
 #include <stdint.h>
 
+#ifndef __packed
+    #define __packed __attribute__((packed))
+#endif
+
+#ifndef __aligned
+    #define __aligned(x) __attribute__((aligned(x)))
+#endif
+
+#ifdef __cplusplus
+    #define FLASH_STATIC_ASSERT(x, msg) static_assert(x, msg)
+#else
+    #define FLASH_STATIC_ASSERT(x, msg) _Static_assert(x, msg)
+#endif
+
 static const uint32_t FLASH_MAGIC1 = 0x8ecd5efb; // Randomly picked numbers
 static const uint32_t FLASH_MAGIC2 = 0xc5ae52a9;
 
 static const uint32_t FLASH_APP_UPDATED = 0xe3fa4ef2; // App has been updated
 
+// Left by the flashloader when it was asked to flash an image but didn't and
+// started the existing application instead.  The second scratch register
+// still holds the address of the image that was asked for.
+static const uint32_t FLASH_APP_REJECTED = 0x5a3c91d6;
+
+// Once an image has been flashed, the flashloader clears its first magic
+// number (by programming rather than erasing) so it won't be flashed again
+// but the rest of the header can still be found by the application.
+static const uint32_t FLASH_MAGIC1_CONSUMED = 0;
+
+//****************************************************************************
+// Update image header format version.
+// The major version (upper byte) is only changed if the fixed part of the
+// header changes in a way older flashloaders cannot cope with.  New
+// capabilities should be added as TLV extensions, which do not require
+// the version to be changed at all.
+#define FLASH_HEADER_VERSION_MAJOR  1
+#define FLASH_HEADER_VERSION_MINOR  0
+#define FLASH_HEADER_VERSION        ((FLASH_HEADER_VERSION_MAJOR << 8) | \
+                                      FLASH_HEADER_VERSION_MINOR)
+
+//****************************************************************************
+// Update image header.
+// The fixed part is followed by an extension area made up of TLV
+// (type-length-value) records and then the application data itself, which
+// starts 'headerLength' bytes after the start of the header.
 typedef struct __packed __aligned(4)
 {
     uint32_t magic1;
     uint32_t magic2;
-    uint32_t length;
-    uint32_t crc32;
-    uint8_t  data[];
+    uint16_t version;       // FLASH_HEADER_VERSION
+    uint16_t headerLength;  // Fixed header plus extension area (multiple of 4)
+    uint32_t length;        // Length of application data
+    uint32_t crc32;         // CRC32 of application data
+    uint32_t tlvCrc32;      // CRC32 of the extension area (if any)
+    uint8_t  tlv[];
 }tFlashHeader;
 
+//****************************************************************************
+// Extension record.  Each record is padded so that the next one starts on a
+// 4-byte boundary.  Records with the FLASH_TLV_CRITICAL bit set in their type
+// must be understood by the flashloader or the image will be rejected.
+// Anything else that is not recognised is simply skipped.
+typedef struct __packed __aligned(4)
+{
+    uint16_t type;
+    uint16_t length;        // Length of value (excluding this record header)
+    uint8_t  value[];
+}tFlashTlv;
+
+#define FLASH_TLV_CRITICAL      0x8000
+
+// Extension record types
+#define FLASH_TLV_PADDING       0x0000  // Ignored
+#define FLASH_TLV_APP_VERSION   0x0001  // uint32_t application version
+#define FLASH_TLV_SEQUENCE      0x0002  // uint32_t staging sequence number
+#define FLASH_TLV_COMPRESSION   (FLASH_TLV_CRITICAL | 0x0003) // tFlashCompression
+#define FLASH_TLV_ENCRYPTION    (FLASH_TLV_CRITICAL | 0x0004) // tFlashEncryption
+
+#define FLASH_TLV_ALIGN(x)      (((x) + 3) & ~3u)
+
+//****************************************************************************
+// Compression extension record.
+// The application is split into fixed-size blocks which are compressed
+// independently so they can be decompressed in any order (or in parallel).
+// The compressed blocks follow each other in the image data and
+// 'offset[n]' gives the start of block 'n' within the data.  There is one
+// more offset than there are blocks, giving the end of the last block.
+// A block that is the same size as the uncompressed block is stored as-is.
+typedef struct __packed __aligned(4)
+{
+    uint8_t  algorithm;     // FLASH_COMPRESSION_xxx
+    uint8_t  blockShift;    // log2 of the (uncompressed) block size
+    uint16_t reserved;
+    uint32_t rawLength;     // Length of the decompressed application
+    uint32_t rawCrc32;      // CRC32 of the decompressed application
+    uint32_t offset[];
+}tFlashCompression;
+
+#define FLASH_COMPRESSION_LZ4       1   // LZ4 block format (see flashlz.h)
+#define FLASH_COMPRESSION_SHIFT     12  // 4k blocks (one flash sector)
+
+//****************************************************************************
+// Encryption extension record.
+// The application data is encrypted with AES-128 in counter mode (see
+// flashaes.h) using a key built into the flashloader.  Byte 'n' of the data
+// is in counter block 'n / 16', so each page can be decrypted on its own.
+// The header's CRC is of the encrypted data (so it can be checked on the way
+// in without the key) and 'plainCrc32' is of the decrypted application.
+// An image can't be both compressed and encrypted.
+typedef struct __packed __aligned(4)
+{
+    uint8_t  algorithm;     // FLASH_ENCRYPTION_xxx
+    uint8_t  reserved[3];
+    uint32_t plainCrc32;    // CRC32 of the decrypted application
+    uint8_t  nonce[12];     // Start of each counter block
+}tFlashEncryption;
+
+#define FLASH_ENCRYPTION_AES128_CTR 1
+
+//****************************************************************************
+// Boot state record, kept in the 'bootstate' partition by a flashloader
+// built with FLASHLOADER_APP_CHECK.
+// Records are only ever added to the partition (it's erased when full) and
+// the last one describes the current application.  The flashloader adds a
+// record without a stamp before it flashes an application.  The next time
+// the application is started, the whole of it is checked against the
+// record and, if it matches, a copy with the stamp is added.  After that,
+// only the boot2 CRC is checked when starting the application.
+typedef struct __packed __aligned(4)
+{
+    uint32_t magic;         // FLASH_BOOT_MAGIC
+    uint32_t length;        // Length of the application
+    uint32_t crc32;         // CRC32 of the whole application
+    uint32_t stamp;         // ~crc32 once checked (0xffffffff until then)
+}tFlashBootState;
+
+static const uint32_t FLASH_BOOT_MAGIC = 0xb0075a7e;
+
+// The layout is fixed by images already out there so make sure nothing
+// (e.g. a different compiler's idea of packing) changes it
+FLASH_STATIC_ASSERT(sizeof(tFlashHeader) == 24, "tFlashHeader layout has changed");
+FLASH_STATIC_ASSERT(offsetof(tFlashHeader, headerLength) == 10, "tFlashHeader layout has changed");
+FLASH_STATIC_ASSERT(offsetof(tFlashHeader, tlvCrc32) == 20, "tFlashHeader layout has changed");
+FLASH_STATIC_ASSERT(sizeof(tFlashTlv) == 4, "tFlashTlv layout has changed");
+FLASH_STATIC_ASSERT(sizeof(tFlashCompression) == 12, "tFlashCompression layout has changed");
+FLASH_STATIC_ASSERT(sizeof(tFlashEncryption) == 20, "tFlashEncryption layout has changed");
+FLASH_STATIC_ASSERT(sizeof(tFlashBootState) == 16, "tFlashBootState layout has changed");
+
+//****************************************************************************
+// Fill in the fixed part of a header apart from the lengths and CRCs
+static inline void flashHeaderInit(tFlashHeader* header, uint16_t headerLength)
+{
+    header->magic1       = FLASH_MAGIC1;
+    header->magic2       = FLASH_MAGIC2;
+    header->version      = FLASH_HEADER_VERSION;
+    header->headerLength = headerLength;
+}
+
+//****************************************************************************
+// Returns non-zero if the fixed part of the header is one we understand and
+// the header is no longer than 'maxLength'.  The CRCs still have to be
+// checked.
+static inline int flashHeaderValid(const tFlashHeader* header, uint32_t maxLength)
+{
+    return (header->magic1 == FLASH_MAGIC1) &&
+           (header->magic2 == FLASH_MAGIC2) &&
+           ((header->version >> 8) == FLASH_HEADER_VERSION_MAJOR) &&
+           (header->headerLength >= sizeof(tFlashHeader)) &&
+           (header->headerLength <= maxLength) &&
+           ((header->headerLength & 3) == 0);
+}
+
+//****************************************************************************
+// Length of the extension area
+static inline uint32_t flashHeaderTlvLength(const tFlashHeader* header)
+{
+    return header->headerLength - sizeof(tFlashHeader);
+}
+
+//****************************************************************************
+// Returns a pointer to the application data following the header
+static inline const uint8_t* flashHeaderData(const tFlashHeader* header)
+{
+    return (const uint8_t*)header + header->headerLength;
+}
+
+//****************************************************************************
+// Returns the first extension record, or null if there are none
+static inline const tFlashTlv* flashTlvFirst(const tFlashHeader* header)
+{
+    if(header->headerLength < sizeof(tFlashHeader) + sizeof(tFlashTlv))
+        return 0;
+
+    return (const tFlashTlv*)header->tlv;
+}
+
+//****************************************************************************
+// Returns the extension record following 'tlv', or null if 'tlv' was the
+// last one.  Records that would extend past the end of the extension area
+// also end the list (use flashTlvValid to catch that).
+static inline const tFlashTlv* flashTlvNext(const tFlashHeader* header,
+                                            const tFlashTlv* tlv)
+{
+    const uint8_t* end  = (const uint8_t*)header + header->headerLength;
+    const uint8_t* next = tlv->value + FLASH_TLV_ALIGN(tlv->length);
+
+    if((next + sizeof(tFlashTlv)) > end)
+        return 0;
+
+    return (const tFlashTlv*)next;
+}
+
+//****************************************************************************
+// Returns non-zero if the record lies entirely within the extension area
+static inline int flashTlvValid(const tFlashHeader* header,
+                                const tFlashTlv* tlv)
+{
+    const uint8_t* end = (const uint8_t*)header + header->headerLength;
+
+    return (tlv->value + FLASH_TLV_ALIGN(tlv->length)) <= end;
+}
+
+//****************************************************************************
+// CRC32 function used by flashImageCheck (see flashcrc.h for the algorithm)
+typedef uint32_t (*tFlashCrc32)(const void* data, size_t length, uint32_t crc);
+
+//****************************************************************************
+// Check an update image the way the flashloader does before flashing it.
+// This is shared by the flashloader and the application (so the application
+// never stages an image the flashloader would refuse) and must be built with
+// the same FLASHLOADER_COMPRESSION and FLASHLOADER_ENCRYPTION settings.
+// 'maxLength' is how much flash there is from the start of the header and
+// 'appLength' the size of the application partition.  The fixed header, the
+// extension area's CRC and records and, if the application is neither
+// compressed nor encrypted, its boot2 CRC are checked.  The CRC of the
+// image data isn't.
+// Returns the length of the application (once decompressed, if necessary)
+// or zero if the image won't be flashed.  'compression' and 'encryption'
+// are set to the matching records (null if there aren't any).
+static inline uint32_t flashImageCheck(const tFlashHeader* header,
+                                       uint32_t maxLength, uint32_t appLength,
+                                       tFlashCrc32 crc,
+                                       const tFlashCompression** compression,
+                                       const tFlashEncryption** encryption)
+{
+    const uint8_t* data = flashHeaderData(header);
+    const tFlashTlv* tlv;
+    uint32_t tlvLength;
+    uint32_t length = header->length;
+
+    *compression = 0;
+    *encryption  = 0;
+
+    if(!flashHeaderValid(header, maxLength) ||
+       (header->length < 256) ||
+       (header->length > (maxLength - header->headerLength)))
+        return 0;
+
+    tlvLength = flashHeaderTlvLength(header);
+    if((tlvLength ? crc(header->tlv, tlvLength, 0xffffffff) : 0xffffffff) !=
+       header->tlvCrc32)
+        return 0;
+
+    // The extension area is parsed in a single pass: unknown records are
+    // skipped unless they are marked as critical, in which case the image
+    // cannot be handled by this flashloader and is rejected
+    for(tlv = flashTlvFirst(header); tlv; tlv = flashTlvNext(header, tlv))
+    {
+        if(!flashTlvValid(header, tlv))
+            return 0;
+
+        switch(tlv->type)
+        {
+#if FLASHLOADER_COMPRESSION
+            case FLASH_TLV_COMPRESSION:
+            {
+                const tFlashCompression* record = (const tFlashCompression*)tlv->value;
+                uint32_t blocks = (record->rawLength + (1 << FLASH_COMPRESSION_SHIFT) - 1) >>
+                                  FLASH_COMPRESSION_SHIFT;
+
+                if((record->algorithm != FLASH_COMPRESSION_LZ4) ||
+                   (record->blockShift != FLASH_COMPRESSION_SHIFT) ||
+                   (record->rawLength < 256) ||
+                   (record->rawLength > appLength) ||
+                   (tlv->length < (sizeof(tFlashCompression) + ((blocks + 1) * sizeof(uint32_t)))) ||
+                   (record->offset[blocks] != header->length))
+                    return 0;
+
+                *compression = record;
+                length = record->rawLength;
+                break;
+            }
+#endif
+
+#if FLASHLOADER_ENCRYPTION
+            case FLASH_TLV_ENCRYPTION:
+                if((tlv->length < sizeof(tFlashEncryption)) ||
+                   (((const tFlashEncryption*)tlv->value)->algorithm != FLASH_ENCRYPTION_AES128_CTR))
+                    return 0;
+
+                *encryption = (const tFlashEncryption*)tlv->value;
+                break;
+#endif
+
+            default:
+                // Not something we know about.  Fine as long as it's not
+                // something we're required to handle.
+                if(tlv->type & FLASH_TLV_CRITICAL)
+                    return 0;
+                break;
+        }
+    }
+
+    // The blocks are decompressed straight out of the staged image so can't
+    // be encrypted as well
+    if(*compression && *encryption)
+        return 0;
+
+    // Erased (and so programmed) a whole 4k sector at a time
+    if(((length + 0xfff) & ~0xfffu) > appLength)
+        return 0;
+
+    // The boot2 image of a compressed or encrypted application can only be
+    // checked once it has been decompressed or decrypted
+    if(!*compression && !*encryption &&
+       (crc(data, 252, 0xffffffff) != *(const uint32_t*)(data + 252)))
+        return 0;
+
+    return length;
+}
+
 #endif // __FLASHLOADER_INCL__
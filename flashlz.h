@@ -0,0 +1,104 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Decompressor for blocks in the LZ4 block format, used for compressed
+// update images (see tFlashCompression in flashloader.h).
+//
+// This is shared by the flashloader and the host tools (which use it to
+// check what they've compressed) so must not depend on the Pico SDK.  It's
+// deliberately simple and small rather than fast: it runs from flash in the
+// flashloader and only needs to keep up with programming the flash.
+//
+// Each sequence is a token byte (literal length in the upper nibble, match
+// length - 4 in the lower), optional extra literal length bytes, the
+// literals, a 16-bit little-endian match offset and optional extra match
+// length bytes.  A nibble of 15 means more length bytes follow, each added
+// to the length until one is less than 255.  The last sequence has no match.
+
+#ifndef __FLASHLZ_INCL__
+#define __FLASHLZ_INCL__
+
+#include <stdint.h>
+
+//****************************************************************************
+// Read an extended length (following a nibble of 15)
+static inline const uint8_t* flashLzLength(const uint8_t* src,
+                                           const uint8_t* end,
+                                           uint32_t* length)
+{
+    uint8_t value;
+
+    do
+    {
+        if(src >= end)
+            return 0;
+
+        value = *src++;
+        *length += value;
+    }while(value == 255);
+
+    return src;
+}
+
+//****************************************************************************
+// Decompress a block of 'srcLength' bytes into 'dst', which can hold
+// 'dstLength' bytes.
+// Returns the number of bytes written to 'dst' or 0 if the data is invalid
+static inline uint32_t flashLzDecode(const uint8_t* src, uint32_t srcLength,
+                                     uint8_t* dst, uint32_t dstLength)
+{
+    const uint8_t* end = src + srcLength;
+    uint8_t*       out = dst;
+    uint8_t*       outEnd = dst + dstLength;
+    uint32_t       length;
+    uint32_t       offset;
+    uint8_t        token;
+
+    while(src < end)
+    {
+        token  = *src++;
+        length = token >> 4;
+
+        if((length == 15) && !(src = flashLzLength(src, end, &length)))
+            return 0;
+
+        if((length > (uint32_t)(end - src)) || (length > (uint32_t)(outEnd - out)))
+            return 0;
+
+        while(length--)
+            *out++ = *src++;
+
+        // The last sequence only has literals
+        if(src == end)
+            break;
+
+        if((end - src) < 2)
+            return 0;
+
+        offset = src[0] | (src[1] << 8);
+        src += 2;
+
+        length = (token & 0xf);
+        if((length == 15) && !(src = flashLzLength(src, end, &length)))
+            return 0;
+
+        length += 4;
+
+        if((offset == 0) || (offset > (uint32_t)(out - dst)) ||
+           (length > (uint32_t)(outEnd - out)))
+            return 0;
+
+        // Byte by byte as the match may overlap what we're writing
+        while(length--)
+        {
+            *out = *(out - offset);
+            out++;
+        }
+    }
+
+    return (uint32_t)(out - dst);
+}
+
+#endif // __FLASHLZ_INCL__
@@ -0,0 +1,73 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Flash partition table for the RP2040 flashloader.
+//
+// The layout of the flash is described once in flashlayout.txt, from which
+// layouttool.py generates the linker script defines, the partition
+// constants in flashlayout.h and the contents of this table.  The table is
+// stored at the end of the flashloader's area of flash so the application
+// (and anything reading the flash from outside) can check where everything
+// is without having been built with the same layout.
+//
+// This header is shared with the host tools so must not depend on the SDK.
+// layouttool.py reads the partition types from it.
+
+#ifndef __FLASHPARTITION_INCL__
+#define __FLASHPARTITION_INCL__
+
+#include <stdint.h>
+
+#ifndef __packed
+    #define __packed __attribute__((packed))
+#endif
+
+#ifndef __aligned
+    #define __aligned(x) __attribute__((aligned(x)))
+#endif
+
+static const uint32_t FLASH_PARTITION_MAGIC = 0x7a3c61d4;
+
+#define FLASH_PARTITION_VERSION         1
+
+// Partition types
+#define FLASH_PARTITION_FLASHLOADER     1
+#define FLASH_PARTITION_APPLICATION     2
+#define FLASH_PARTITION_STAGING         3
+#define FLASH_PARTITION_WEAR            4
+#define FLASH_PARTITION_DATA            5
+#define FLASH_PARTITION_BOOTSTATE       6
+
+typedef struct __packed __aligned(4)
+{
+    uint32_t type;          // FLASH_PARTITION_xxx
+    uint32_t offset;        // Offset from the start of flash
+    uint32_t length;
+}tFlashPartition;
+
+typedef struct __packed __aligned(4)
+{
+    uint32_t        magic;
+    uint16_t        version;    // FLASH_PARTITION_VERSION
+    uint16_t        count;      // Number of entries
+    uint32_t        crc32;      // CRC32 of the entries
+    tFlashPartition entry[];
+}tFlashPartitionTable;
+
+//****************************************************************************
+// Returns the first partition of the given type, or null if there is none
+static inline const tFlashPartition* flashPartitionFind(const tFlashPartitionTable* table,
+                                                        uint32_t type)
+{
+    for(uint32_t i = 0; i < table->count; i++)
+    {
+        if(table->entry[i].type == type)
+            return &table->entry[i];
+    }
+
+    return 0;
+}
+
+#endif // __FLASHPARTITION_INCL__
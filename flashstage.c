@@ -0,0 +1,312 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Staging area for update images.  See flashstage.h for details.
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "hardware/flash.h"
+#include "flashloader.h"
+#include "flashlayout.h"
+#include "flashstage.h"
+#include "flashwear.h"
+#include "crc32.h"
+
+#define STAGING_SECTORS (FLASH_STAGING_LENGTH / FLASH_SECTOR_SIZE)
+
+// CRC32 of an erased (all 0xff) sector
+#define ERASED_SECTOR_CRC32 0xaf19d570
+
+// Most space the next image can need: the largest application plus a sector
+// for the header
+#if (FLASH_APPLICATION_LENGTH + FLASH_SECTOR_SIZE) < FLASH_STAGING_LENGTH
+    #define PRE_ERASE_LENGTH (FLASH_APPLICATION_LENGTH + FLASH_SECTOR_SIZE)
+#else
+    #define PRE_ERASE_LENGTH FLASH_STAGING_LENGTH
+#endif
+
+// One bit per staging sector, set once the sector has been found to be
+// blank (and cleared when it's handed out to be written)
+static uint32_t sBlank[(STAGING_SECTORS + 31) / 32];
+
+// Progress through the sectors to erase in the background.  The next image
+// goes straight after the newest one or, if it doesn't fit there, at the
+// start of the staging area so both places are prepared.
+typedef enum
+{
+    PRE_ERASE_START,        // Work out what to erase
+    PRE_ERASE_AFTER,        // After the newest image
+    PRE_ERASE_WRAPPED,      // From the start of the staging area
+    PRE_ERASE_DONE
+}tPreEraseState;
+
+static tPreEraseState     sPreEraseState;
+static uint32_t           sPreEraseOffset;
+static uint32_t           sPreEraseEnd;
+static uint32_t           sPreEraseWrapEnd;
+
+// Average time taken to erase a sector (0 until one has been erased)
+static uint32_t           sEraseUs;
+
+//****************************************************************************
+// Returns non-zero (and the sequence number) if there is a staged image
+// header at the given offset, whether or not it has been flashed yet.
+int getStagedSequence(uint32_t offset, uint32_t* sequence)
+{
+    const tFlashHeader* header = (const tFlashHeader*)(XIP_BASE + offset);
+    const tFlashTlv*    tlv;
+
+    if((header->magic2 != FLASH_MAGIC2) ||
+       ((header->magic1 != FLASH_MAGIC1) &&
+        (header->magic1 != FLASH_MAGIC1_CONSUMED)) ||
+       (header->headerLength > FLASH_SECTOR_SIZE) ||
+       (header->length > FLASH_STAGING_LENGTH))
+        return 0;
+
+    for(tlv = flashTlvFirst(header); tlv; tlv = flashTlvNext(header, tlv))
+    {
+        if((tlv->type == FLASH_TLV_SEQUENCE) &&
+           (tlv->length == sizeof(uint32_t)) &&
+           flashTlvValid(header, tlv))
+        {
+            memcpy(sequence, tlv->value, sizeof(uint32_t));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//****************************************************************************
+// Clear the first magic number of a staged image that hasn't been flashed
+// (in the same way the flashloader does) so there is only ever one image
+// waiting to be flashed.
+void invalidateStagedImage(uint32_t offset)
+{
+    uint8_t  page[FLASH_PAGE_SIZE];
+    uint32_t status;
+
+    memset(page, 0xff, sizeof(page));
+    memcpy(page, &FLASH_MAGIC1_CONSUMED, sizeof(uint32_t));
+
+    status = save_and_disable_interrupts();
+    flash_range_program(offset, page, sizeof(page));
+    restore_interrupts(status);
+
+    sBlank[((offset - FLASH_STAGING_OFFSET) / FLASH_SECTOR_SIZE) / 32] &=
+        ~(1u << (((offset - FLASH_STAGING_OFFSET) / FLASH_SECTOR_SIZE) % 32));
+}
+
+//****************************************************************************
+// Work out where to stage an image needing 'eraseLength' bytes of flash
+// and which sequence number it should have.
+// The image goes immediately after the most recently staged one (i.e. the
+// one with the highest sequence number) unless that would run off the end
+// of the staging region.
+uint32_t nextStagingOffset(uint32_t eraseLength, uint32_t* sequence)
+{
+    const uint32_t end = FLASH_STAGING_OFFSET + FLASH_STAGING_LENGTH;
+    uint32_t next = FLASH_STAGING_OFFSET;
+    uint32_t newest = 0;
+    uint32_t found = 0;
+    uint32_t offset;
+    uint32_t seq;
+
+    for(offset = FLASH_STAGING_OFFSET; offset < end; offset += FLASH_SECTOR_SIZE)
+    {
+        if(getStagedSequence(offset, &seq))
+        {
+            const tFlashHeader* header = (const tFlashHeader*)(XIP_BASE + offset);
+
+            if(header->magic1 == FLASH_MAGIC1)
+                invalidateStagedImage(offset);
+
+            if(!found || ((int32_t)(seq - newest) > 0))
+            {
+                newest = seq;
+                next = offset + ((header->headerLength + header->length +
+                                  FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1));
+                found = 1;
+            }
+        }
+    }
+
+    if((next + eraseLength) > end)
+        next = FLASH_STAGING_OFFSET;
+
+    *sequence = newest + 1;
+    return next;
+}
+
+//****************************************************************************
+// Returns non-zero if the sector at the given offset in the staging area is
+// blank.  The sector is read through the uncached XIP alias so checking
+// doesn't throw the application's code out of the cache.  A CRC match
+// could in theory be a coincidence but anything staged is checked against
+// its own CRC before it's used.
+static int sectorBlank(uint32_t offset)
+{
+    uint32_t sector = (offset - FLASH_STAGING_OFFSET) / FLASH_SECTOR_SIZE;
+
+    if(crc32Dma((const uint8_t*)(XIP_NOCACHE_NOALLOC_BASE + offset), FLASH_SECTOR_SIZE,
+                FLASH_CRC32_INIT) == ERASED_SECTOR_CRC32)
+    {
+        sBlank[sector / 32] |= (1u << (sector % 32));
+        return 1;
+    }
+
+    sBlank[sector / 32] &= ~(1u << (sector % 32));
+    return 0;
+}
+
+//****************************************************************************
+// Erase one sector of the staging area (recording it first)
+static void eraseSector(uint32_t offset)
+{
+    uint32_t status;
+    uint32_t start;
+    uint32_t elapsed;
+
+    flashWearRecord(offset, FLASH_SECTOR_SIZE);
+
+    status = save_and_disable_interrupts();
+    start = time_us_32();
+    flash_range_erase(offset, FLASH_SECTOR_SIZE);
+    elapsed = time_us_32() - start;
+    restore_interrupts(status);
+
+    sEraseUs = sEraseUs ? ((sEraseUs * 7) + elapsed) / 8 : elapsed;
+}
+
+//****************************************************************************
+// Erase 'length' bytes of the staging area from 'offset' (both multiples of
+// the sector size) ready for an image to be written, skipping any sectors
+// that are already blank.  Disables interrupts while each sector is erased.
+void eraseStagingArea(uint32_t offset, uint32_t length)
+{
+    uint32_t sector;
+
+    for(; length > 0; offset += FLASH_SECTOR_SIZE, length -= FLASH_SECTOR_SIZE)
+    {
+        sector = (offset - FLASH_STAGING_OFFSET) / FLASH_SECTOR_SIZE;
+
+        if(!sectorBlank(offset))
+            eraseSector(offset);
+
+        // About to be written so no longer blank
+        sBlank[sector / 32] &= ~(1u << (sector % 32));
+    }
+
+    // There'll be a new newest image so start again once it's staged
+    sPreEraseState = PRE_ERASE_START;
+}
+
+//****************************************************************************
+// Find the most recently staged image.  Returns its sequence number (0 if
+// there isn't one), offset and the offset of the sector following it.
+static uint32_t findNewestImage(uint32_t* newestOffset, uint32_t* next)
+{
+    uint32_t newest = 0;
+    uint32_t offset;
+    uint32_t seq;
+
+    *newestOffset = FLASH_STAGING_OFFSET + FLASH_STAGING_LENGTH;
+    *next = FLASH_STAGING_OFFSET;
+
+    for(offset = FLASH_STAGING_OFFSET;
+        offset < (FLASH_STAGING_OFFSET + FLASH_STAGING_LENGTH);
+        offset += FLASH_SECTOR_SIZE)
+    {
+        if(getStagedSequence(offset, &seq) && (!newest || ((int32_t)(seq - newest) > 0)))
+        {
+            const tFlashHeader* header = (const tFlashHeader*)(XIP_BASE + offset);
+
+            newest = seq;
+            *newestOffset = offset;
+            *next = offset + ((header->headerLength + header->length +
+                               FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1));
+        }
+    }
+
+    return newest;
+}
+
+//****************************************************************************
+// Do the next step of getting the staging area ready for the next image:
+// check whether a sector is blank and erase it if not.
+// Returns non-zero if there is still more to do.
+int stagePreErase(void)
+{
+    const uint32_t end = FLASH_STAGING_OFFSET + FLASH_STAGING_LENGTH;
+    uint32_t newestOffset;
+    uint32_t sector;
+
+    switch(sPreEraseState)
+    {
+        case PRE_ERASE_START:
+            findNewestImage(&newestOffset, &sPreEraseOffset);
+
+            sPreEraseEnd = (sPreEraseOffset < (end - PRE_ERASE_LENGTH)) ?
+                           (sPreEraseOffset + PRE_ERASE_LENGTH) : end;
+
+            // A large image would have to go at the start instead (as long
+            // as the newest image isn't in the way)
+            sPreEraseWrapEnd = FLASH_STAGING_OFFSET;
+            if((sPreEraseEnd - sPreEraseOffset) < PRE_ERASE_LENGTH)
+                sPreEraseWrapEnd = (newestOffset < (FLASH_STAGING_OFFSET + PRE_ERASE_LENGTH)) ?
+                                   newestOffset : (FLASH_STAGING_OFFSET + PRE_ERASE_LENGTH);
+
+            sPreEraseState = PRE_ERASE_AFTER;
+            return 1;
+
+        case PRE_ERASE_AFTER:
+        case PRE_ERASE_WRAPPED:
+            if(sPreEraseOffset < sPreEraseEnd)
+            {
+                sector = (sPreEraseOffset - FLASH_STAGING_OFFSET) / FLASH_SECTOR_SIZE;
+
+                if(!(sBlank[sector / 32] & (1u << (sector % 32))) &&
+                   !sectorBlank(sPreEraseOffset))
+                {
+                    eraseSector(sPreEraseOffset);
+                    sBlank[sector / 32] |= (1u << (sector % 32));
+                }
+
+                sPreEraseOffset += FLASH_SECTOR_SIZE;
+            }
+            else
+            if(sPreEraseState == PRE_ERASE_AFTER)
+            {
+                sPreEraseState  = PRE_ERASE_WRAPPED;
+                sPreEraseOffset = FLASH_STAGING_OFFSET;
+                sPreEraseEnd    = sPreEraseWrapEnd;
+            }
+            else
+                sPreEraseState = PRE_ERASE_DONE;
+
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+//****************************************************************************
+// Returns the sequence number of the most recently staged image (which is
+// also the number of updates that have been staged, or 0 if none have)
+uint32_t newestStagedSequence(void)
+{
+    uint32_t offset;
+    uint32_t next;
+
+    return findNewestImage(&offset, &next);
+}
+
+//****************************************************************************
+uint32_t stageEraseUs(void)
+{
+    return sEraseUs;
+}
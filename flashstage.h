@@ -0,0 +1,71 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Staging area for update images.
+//
+// The region of flash used to stage new app images to be flashed by the
+// flashloader is the 'staging' partition (FLASH_STAGING_OFFSET and
+// FLASH_STAGING_LENGTH, see flashlayout.txt).  Rather than always using the
+// same location (and wearing out those sectors long before the rest of the
+// flash), images are written one after the other around this region like a
+// ring buffer, wrapping back to the start when there isn't enough room left.
+// The sectors following the most recently staged image are always the least
+// recently erased so every sector in the region is worn evenly.
+//
+// Each staged image carries a sequence number (in a FLASH_TLV_SEQUENCE
+// record) so the most recent one can be found.
+//
+// Erasing takes far longer than programming, so while the application is
+// idle the sectors the next image is likely to go in are erased in the
+// background (one at a time, see stagePreErase).  Staging an image then
+// only has to erase whatever isn't already blank.  Which sectors are blank
+// is remembered in RAM but always checked again (a CRC of the sector by the
+// DMA sniffer, which is much quicker than erasing) before it's relied on.
+
+#ifndef __FLASHSTAGE_INCL__
+#define __FLASHSTAGE_INCL__
+
+#include <stdint.h>
+
+//****************************************************************************
+// Returns non-zero (and the sequence number) if there is a staged image
+// header at the given offset, whether or not it has been flashed yet.
+int getStagedSequence(uint32_t offset, uint32_t* sequence);
+
+//****************************************************************************
+// Clear the first magic number of a staged image that hasn't been flashed
+// yet so the flashloader won't pick it up
+void invalidateStagedImage(uint32_t offset);
+
+//****************************************************************************
+// Work out where to stage an image needing 'eraseLength' bytes of flash
+// and which sequence number it should have
+uint32_t nextStagingOffset(uint32_t eraseLength, uint32_t* sequence);
+
+//****************************************************************************
+// Erase 'length' bytes of the staging area from 'offset' (both multiples of
+// the sector size) ready for an image to be written, skipping any sectors
+// that are already blank.  Disables interrupts while each sector is erased.
+void eraseStagingArea(uint32_t offset, uint32_t length);
+
+//****************************************************************************
+// Do the next step of getting the staging area ready for the next image:
+// check whether a sector is blank and erase it if not.  Each call takes up
+// to one sector erase (with interrupts disabled) so should only be made
+// when nothing else is happening.
+// Returns non-zero if there is still more to do.
+int stagePreErase(void);
+
+//****************************************************************************
+// Returns the average time (in microseconds) it has taken to erase a sector
+// of the staging area or 0 if none has been erased yet
+uint32_t stageEraseUs(void);
+
+//****************************************************************************
+// Returns the sequence number of the most recently staged image (which is
+// also the number of updates that have been staged, or 0 if none have)
+uint32_t newestStagedSequence(void);
+
+#endif // __FLASHSTAGE_INCL__
@@ -0,0 +1,282 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Read-back verification of staged update images.  See flashverify.h for
+// details.
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#include "hardware/flash.h"
+#include "flashloader.h"
+#include "flashcrc.h"
+#include "flashstage.h"
+#include "flashverify.h"
+
+// Core1 mustn't call anything in flash (including the divider routines)
+#if (FLASH_VERIFY_SLOTS & (FLASH_VERIFY_SLOTS - 1)) != 0
+    #error FLASH_VERIFY_SLOTS must be a power of two
+#endif
+
+typedef enum
+{
+    SLOT_FREE,
+    SLOT_QUEUED,            // Programmed, waiting for core1
+    SLOT_GOOD,              // Checked by core1, waiting for core0
+    SLOT_BAD
+}tSlotState;
+
+typedef struct
+{
+    volatile uint32_t state;
+    uint32_t          offset;
+    uint8_t           data[FLASH_PAGE_SIZE] __attribute__ ((aligned(4)));
+}tVerifySlot;
+
+// The slots are filled and emptied in order.  'sHead' and 'sTail' count the
+// pages queued and dealt with by core0, 'sNext' the pages checked by core1.
+static tVerifySlot sSlots[FLASH_VERIFY_SLOTS];
+static uint32_t    sHead;
+static uint32_t    sTail;
+static uint32_t    sNext;
+
+// Core1 doesn't share crc32() (which normally uses the DMA sniffer) with
+// core0 so it has its own table
+static tFlashCrcTable sTable[1];
+
+// Set by core0 while it's programming or erasing the flash and by core1
+// while it's reading it.  Each sets its own flag before checking the other
+// one, so they can never both be using the flash.
+static volatile uint32_t sFlashBusy;
+static volatile uint32_t sReading;
+
+// Pages put right since the last flashVerifyWait (-1 if any couldn't be)
+static int sRepaired;
+
+// Average time taken to program a page (0 until one has been programmed)
+static uint32_t sPageUs;
+
+// Copy of a sector being erased and programmed again
+static uint8_t sSector[FLASH_SECTOR_SIZE] __attribute__ ((aligned(4)));
+
+//****************************************************************************
+static uint32_t __not_in_flash_func(pageCrc)(const uint8_t* data)
+{
+    uint32_t crc = FLASH_CRC32_INIT;
+
+    for(uint32_t i = 0; i < FLASH_PAGE_SIZE; i++)
+        crc = (crc << 8) ^ sTable[0][(crc >> 24) ^ data[i]];
+
+    return crc;
+}
+
+//****************************************************************************
+// Runs on core1, entirely from RAM.  Checks each page as it's queued.
+static void __not_in_flash_func(verifyTask)(void)
+{
+    tVerifySlot* slot;
+    uint32_t crc;
+
+    while(true)
+    {
+        slot = &sSlots[sNext % FLASH_VERIFY_SLOTS];
+
+        if(slot->state != SLOT_QUEUED)
+        {
+            __wfe();
+            continue;
+        }
+
+        sReading = 1;
+        __dmb();
+
+        if(sFlashBusy)
+        {
+            // Core0 will send an event once it has finished
+            sReading = 0;
+            __wfe();
+            continue;
+        }
+
+        crc = pageCrc((const uint8_t*)(XIP_NOCACHE_NOALLOC_BASE + slot->offset));
+
+        __dmb();
+        sReading = 0;
+
+        slot->state = (crc == pageCrc(slot->data)) ? SLOT_GOOD : SLOT_BAD;
+        sNext++;
+        __sev();
+    }
+}
+
+//****************************************************************************
+// Keep core1 off the flash while we use it
+static void pauseVerify(void)
+{
+    sFlashBusy = 1;
+    __dmb();
+
+    while(sReading)
+        tight_loop_contents();
+}
+
+//****************************************************************************
+static void resumeVerify(void)
+{
+    __dmb();
+    sFlashBusy = 0;
+    __sev();
+}
+
+//****************************************************************************
+static void programPage(uint32_t offset, const uint8_t* data)
+{
+    uint32_t status = save_and_disable_interrupts();
+    uint32_t start = time_us_32();
+    uint32_t elapsed;
+
+    flash_range_program(offset, data, FLASH_PAGE_SIZE);
+    elapsed = time_us_32() - start;
+    restore_interrupts(status);
+
+    sPageUs = sPageUs ? ((sPageUs * 7) + elapsed) / 8 : elapsed;
+}
+
+//****************************************************************************
+// Put right a page that doesn't hold what was programmed.  If none of the
+// bits that should be set have been cleared, programming the page again
+// may be enough.  Otherwise its sector has to be erased and programmed
+// again from a copy (the other pages are taken from the flash and, if any
+// of those are bad too, they'll be put right when their turn comes).
+static void repairPage(const tVerifySlot* slot)
+{
+    const uint32_t* expected = (const uint32_t*)slot->data;
+    const uint32_t* actual = (const uint32_t*)(XIP_NOCACHE_NOALLOC_BASE + slot->offset);
+    uint32_t sector = slot->offset & ~(FLASH_SECTOR_SIZE - 1);
+    int erase;
+
+    for(int attempt = 0; attempt < FLASH_VERIFY_RETRIES; attempt++)
+    {
+        erase = 0;
+        for(uint32_t i = 0; i < (FLASH_PAGE_SIZE / 4); i++)
+        {
+            if((actual[i] & expected[i]) != expected[i])
+                erase = 1;
+        }
+
+        pauseVerify();
+
+        if(erase)
+        {
+            memcpy(sSector, (const void*)(XIP_NOCACHE_NOALLOC_BASE + sector), sizeof(sSector));
+            memcpy(&sSector[slot->offset - sector], slot->data, FLASH_PAGE_SIZE);
+
+            eraseStagingArea(sector, FLASH_SECTOR_SIZE);
+
+            for(uint32_t page = 0; page < sizeof(sSector); page += FLASH_PAGE_SIZE)
+            {
+                const uint32_t* words = (const uint32_t*)&sSector[page];
+                uint32_t i;
+
+                // Nothing to do for a blank page
+                for(i = 0; (i < (FLASH_PAGE_SIZE / 4)) && (words[i] == 0xffffffff); i++)
+                    ;
+
+                if(i < (FLASH_PAGE_SIZE / 4))
+                    programPage(sector + page, &sSector[page]);
+            }
+        }
+        else
+            programPage(slot->offset, slot->data);
+
+        resumeVerify();
+
+        if(memcmp(actual, expected, FLASH_PAGE_SIZE) == 0)
+        {
+            if(sRepaired >= 0)
+                sRepaired++;
+            return;
+        }
+    }
+
+    sRepaired = -1;
+}
+
+//****************************************************************************
+// Deal with the pages core1 has checked, waiting until no more than
+// 'maxQueued' are left
+static void collect(uint32_t maxQueued)
+{
+    tVerifySlot* slot;
+
+    while(sTail != sHead)
+    {
+        slot = &sSlots[sTail % FLASH_VERIFY_SLOTS];
+
+        if(slot->state == SLOT_QUEUED)
+        {
+            if((sHead - sTail) <= maxQueued)
+                break;
+
+            __wfe();
+            continue;
+        }
+
+        if(slot->state == SLOT_BAD)
+            repairPage(slot);
+
+        slot->state = SLOT_FREE;
+        sTail++;
+    }
+}
+
+//****************************************************************************
+void flashVerifyInit(void)
+{
+    flashCrc32MakeTables(sTable, 1);
+    multicore_launch_core1(verifyTask);
+}
+
+//****************************************************************************
+void flashVerifyProgram(uint32_t offset, const uint8_t* page)
+{
+    tVerifySlot* slot;
+
+    collect(FLASH_VERIFY_SLOTS - 1);
+
+    slot = &sSlots[sHead % FLASH_VERIFY_SLOTS];
+    slot->offset = offset;
+    memcpy(slot->data, page, FLASH_PAGE_SIZE);
+
+    pauseVerify();
+    programPage(offset, slot->data);
+    resumeVerify();
+
+    // Everything has to be in place before core1 sees the page
+    __dmb();
+    slot->state = SLOT_QUEUED;
+    sHead++;
+    __sev();
+}
+
+//****************************************************************************
+int flashVerifyWait(void)
+{
+    int repaired;
+
+    collect(0);
+
+    repaired = sRepaired;
+    sRepaired = 0;
+
+    return repaired;
+}
+
+//****************************************************************************
+uint32_t flashVerifyPageUs(void)
+{
+    return sPageUs;
+}
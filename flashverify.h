@@ -0,0 +1,64 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Read-back verification of staged update images on core1.
+//
+// Without it, nothing checks that the staging area actually holds what was
+// written until the flashloader checks the image's CRC after the reboot, so
+// a bad page costs a whole reboot cycle and a retransfer.  Instead, each
+// page of the staging area is programmed through flashVerifyProgram, which
+// keeps a copy in a small queue in RAM.  Core1 reads each queued page back
+// through the uncached XIP alias (so the application's code stays in the
+// cache), calculates its CRC and compares it with the CRC of the copy, all
+// while core0 gets on with receiving the next page.  Core1 runs entirely
+// from RAM and keeps off the flash while core0 is programming it.
+//
+// A page that doesn't match is put right by core0 before anything relies
+// on it: programmed again if that can fix it (programming can only clear
+// bits) or otherwise by erasing its sector and programming it again from a
+// copy in RAM.
+//
+// Anything else that writes to the flash must call flashVerifyWait first so
+// core1 isn't reading it at the time.
+
+#ifndef __FLASHVERIFY_INCL__
+#define __FLASHVERIFY_INCL__
+
+#include <stdint.h>
+
+// Number of pages that can be waiting to be checked (a power of two).
+// Each one takes a page of RAM.
+#ifndef FLASH_VERIFY_SLOTS
+    #define FLASH_VERIFY_SLOTS 8
+#endif
+
+// Number of times a bad page is programmed (or its sector rewritten) before
+// giving up on it
+#ifndef FLASH_VERIFY_RETRIES
+    #define FLASH_VERIFY_RETRIES 2
+#endif
+
+//****************************************************************************
+// Start core1 checking the pages as they are queued
+void flashVerifyInit(void);
+
+//****************************************************************************
+// Program a page (at the given offset in flash) with interrupts disabled
+// and queue it to be checked.  Waits if the queue is full, putting right
+// any page that turned out to be bad.
+void flashVerifyProgram(uint32_t offset, const uint8_t* page);
+
+//****************************************************************************
+// Wait until every queued page has been checked (and any bad ones put
+// right).  Returns the number of pages that had to be put right since the
+// last call, or -1 if any of them couldn't be.
+int flashVerifyWait(void);
+
+//****************************************************************************
+// Returns the average time (in microseconds) it has taken to program a page
+// or 0 if none has been programmed yet
+uint32_t flashVerifyPageUs(void);
+
+#endif // __FLASHVERIFY_INCL__
@@ -0,0 +1,228 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Per-sector erase counters for the RP2040 flashloader and application.
+// See flashwear.h for a description of how the counters are stored.
+
+#include <string.h>
+#include "hardware/sync.h"
+#include "hardware/flash.h"
+#include "hardware/regs/addressmap.h"
+#include "flashwear.h"
+
+#define wearTable(x) ((const tFlashWearTable*)(XIP_BASE + FLASH_WEAR_OFFSET + \
+                                               ((x) * FLASH_WEAR_TABLE_LENGTH)))
+
+// Number of bits left in an entry below which the table gets compacted.
+// Anything below a whole update's worth would do: each update erases a
+// sector at most once before the application gets the chance to compact.
+static const uint32_t sCompactThreshold = 8;
+
+// Buffer used to update one page of the table at a time
+static uint8_t sWearPage[FLASH_PAGE_SIZE] __attribute__ ((aligned(4)));
+
+//****************************************************************************
+// Returns non-zero if the given copy of the table looks usable
+static int tableValid(const tFlashWearTable* table)
+{
+    return (table->magic == FLASH_WEAR_MAGIC) &&
+           (table->firstOffset == FLASH_WEAR_FIRST_OFFSET) &&
+           (table->sectors == FLASH_WEAR_SECTORS);
+}
+
+//****************************************************************************
+// Returns the index (0 or 1) of the active copy of the table or -1 if
+// neither copy is valid
+static int activeTable(void)
+{
+    int valid0 = tableValid(wearTable(0));
+    int valid1 = tableValid(wearTable(1));
+
+    if(valid0 && valid1)
+        return ((int32_t)(wearTable(1)->generation - wearTable(0)->generation) > 0);
+
+    return valid1 ? 1 : (valid0 ? 0 : -1);
+}
+
+//****************************************************************************
+static uint32_t entryCount(const tFlashWearEntry* entry)
+{
+    return entry->base + (32 - __builtin_popcount(entry->ticks));
+}
+
+//****************************************************************************
+static void programPage(uint32_t offset, const uint8_t* data)
+{
+    uint32_t status = save_and_disable_interrupts();
+    flash_range_program(offset, data, FLASH_PAGE_SIZE);
+    restore_interrupts(status);
+}
+
+//****************************************************************************
+void flashWearRecord(uint32_t offset, uint32_t length)
+{
+    int      active = activeTable();
+    uint32_t page = 0;
+    uint32_t entryOffset;
+    uint32_t first;
+    uint32_t last;
+
+    if((active < 0) || (offset < FLASH_WEAR_FIRST_OFFSET))
+        return;
+
+    first = (offset - FLASH_WEAR_FIRST_OFFSET) / FLASH_SECTOR_SIZE;
+    last  = first + (length / FLASH_SECTOR_SIZE);
+
+    if(last > FLASH_WEAR_SECTORS)
+        last = FLASH_WEAR_SECTORS;
+
+    for(; first < last; first++)
+    {
+        entryOffset = FLASH_WEAR_OFFSET + (active * FLASH_WEAR_TABLE_LENGTH) +
+                      sizeof(tFlashWearTable) + (first * sizeof(tFlashWearEntry));
+
+        // Entries are sequential so only write the page back to flash once
+        // we've updated all the entries in it
+        if((entryOffset & ~(FLASH_PAGE_SIZE - 1)) != page)
+        {
+            if(page)
+                programPage(page, sWearPage);
+
+            page = entryOffset & ~(FLASH_PAGE_SIZE - 1);
+            memcpy(sWearPage, (const void*)(XIP_BASE + page), FLASH_PAGE_SIZE);
+        }
+
+        // Clear the lowest set bit.  If they're all clear already, the count
+        // will stick until the application compacts the table.
+        tFlashWearEntry* entry = (tFlashWearEntry*)&sWearPage[entryOffset & (FLASH_PAGE_SIZE - 1)];
+        entry->ticks &= entry->ticks - 1;
+    }
+
+    if(page)
+        programPage(page, sWearPage);
+}
+
+//****************************************************************************
+int flashWearCompact(void)
+{
+    static union
+    {
+        tFlashWearTable table;
+        uint8_t         buffer[FLASH_WEAR_TABLE_LENGTH];
+    } newTable;
+
+    int      active = activeTable();
+    uint32_t target = (active == 0) ? 1 : 0;
+    uint32_t offset = FLASH_WEAR_OFFSET + (target * FLASH_WEAR_TABLE_LENGTH);
+    uint32_t needed = (active < 0);
+    uint32_t status;
+    uint32_t sector;
+    uint32_t page;
+
+    memset(newTable.buffer, 0xff, sizeof(newTable.buffer));
+
+    newTable.table.magic       = FLASH_WEAR_MAGIC;
+    newTable.table.generation  = (active < 0) ? 0 : (wearTable(active)->generation + 1);
+    newTable.table.firstOffset = FLASH_WEAR_FIRST_OFFSET;
+    newTable.table.sectors     = FLASH_WEAR_SECTORS;
+
+    for(sector = 0; sector < FLASH_WEAR_SECTORS; sector++)
+    {
+        if(active < 0)
+            newTable.table.entry[sector].base = 0;
+        else
+        {
+            const tFlashWearEntry* entry = &wearTable(active)->entry[sector];
+
+            if(__builtin_popcount(entry->ticks) < sCompactThreshold)
+                needed = 1;
+
+            newTable.table.entry[sector].base = entryCount(entry);
+        }
+    }
+
+    if(!needed)
+        return 0;
+
+    status = save_and_disable_interrupts();
+    flash_range_erase(offset, FLASH_WEAR_TABLE_LENGTH);
+    restore_interrupts(status);
+
+    // Write the first page (with the magic number) last so the new copy
+    // isn't used unless it has been completely written
+    for(page = FLASH_PAGE_SIZE; page < FLASH_WEAR_TABLE_LENGTH; page += FLASH_PAGE_SIZE)
+        programPage(offset + page, &newTable.buffer[page]);
+
+    programPage(offset, newTable.buffer);
+
+    return 1;
+}
+
+//****************************************************************************
+uint32_t flashWearCount(uint32_t offset)
+{
+    int active = activeTable();
+
+    if((active < 0) || (offset < FLASH_WEAR_FIRST_OFFSET) ||
+       (offset >= FLASH_WEAR_OFFSET))
+        return 0;
+
+    return entryCount(&wearTable(active)->entry[(offset - FLASH_WEAR_FIRST_OFFSET) /
+                                                FLASH_SECTOR_SIZE]);
+}
+
+//****************************************************************************
+uint32_t flashWearHottest(tFlashWearSector* hottest, uint32_t max)
+{
+    int      active = activeTable();
+    uint32_t found = 0;
+    uint32_t sector;
+    uint32_t count;
+    uint32_t pos;
+
+    if(active < 0)
+        return 0;
+
+    for(sector = 0; sector < FLASH_WEAR_SECTORS; sector++)
+    {
+        count = entryCount(&wearTable(active)->entry[sector]);
+
+        // Simple insertion into the (short) sorted list
+        for(pos = found; (pos > 0) && (hottest[pos - 1].count < count); pos--)
+        {
+            if(pos < max)
+                hottest[pos] = hottest[pos - 1];
+        }
+
+        if(pos < max)
+        {
+            hottest[pos].offset = FLASH_WEAR_FIRST_OFFSET + (sector * FLASH_SECTOR_SIZE);
+            hottest[pos].count  = count;
+
+            if(found < max)
+                found++;
+        }
+    }
+
+    return found;
+}
+
+//****************************************************************************
+uint32_t flashWearUpdatesRemaining(uint32_t updates)
+{
+    tFlashWearSector worst;
+    uint64_t remaining;
+
+    if(!flashWearHottest(&worst, 1) || (worst.count == 0))
+        return 0xffffffff;
+
+    if(worst.count >= FLASH_WEAR_ENDURANCE)
+        return 0;
+
+    // Assume the most worn sector carries on being erased at the same rate
+    remaining = ((uint64_t)(FLASH_WEAR_ENDURANCE - worst.count) * updates) / worst.count;
+
+    return (remaining > 0xffffffff) ? 0xffffffff : (uint32_t)remaining;
+}
@@ -0,0 +1,96 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Per-sector erase counters for the RP2040 flashloader and application.
+//
+// Each sector of flash following the flashloader has an entry in a table
+// stored in its own area of flash.  An entry holds a base count plus a
+// word in which one bit is cleared each time the sector is erased, so an
+// erase can be recorded just by programming the table (no erase needed).
+// When a sector runs low on bits, the application compacts the table by
+// writing a new copy (with the bits folded into the base counts) into the
+// second table area.  The copy with the highest generation number is the
+// active one so a power failure while compacting loses nothing.
+
+#ifndef __FLASHWEAR_INCL__
+#define __FLASHWEAR_INCL__
+
+#include <stdint.h>
+#include "hardware/flash.h"
+#include "flashlayout.h"
+
+// The two copies of the table share the 'wear' partition (FLASH_WEAR_OFFSET
+// and FLASH_WEAR_LENGTH, see flashlayout.txt)
+#ifndef FLASH_WEAR_TABLE_LENGTH
+    #define FLASH_WEAR_TABLE_LENGTH (FLASH_WEAR_LENGTH / 2)
+#endif
+
+// Everything from the end of the flashloader up to the table is tracked
+#ifndef FLASH_WEAR_FIRST_OFFSET
+    #define FLASH_WEAR_FIRST_OFFSET FLASH_APPLICATION_OFFSET
+#endif
+
+#define FLASH_WEAR_SECTORS ((FLASH_WEAR_OFFSET - FLASH_WEAR_FIRST_OFFSET) / FLASH_SECTOR_SIZE)
+
+// Typical endurance of the flash (erase cycles per sector)
+#ifndef FLASH_WEAR_ENDURANCE
+    #define FLASH_WEAR_ENDURANCE 100000
+#endif
+
+static const uint32_t FLASH_WEAR_MAGIC = 0x5e7c0a11;
+
+typedef struct __packed __aligned(4)
+{
+    uint32_t base;          // Erase count when the table was compacted
+    uint32_t ticks;         // One bit cleared (from the bottom) per erase
+}tFlashWearEntry;
+
+typedef struct __packed __aligned(4)
+{
+    uint32_t        magic;
+    uint32_t        generation;
+    uint32_t        firstOffset;    // Flash offset of first tracked sector
+    uint32_t        sectors;        // Number of entries
+    tFlashWearEntry entry[];
+}tFlashWearTable;
+
+_Static_assert(sizeof(tFlashWearTable) + (FLASH_WEAR_SECTORS * sizeof(tFlashWearEntry)) <=
+               FLASH_WEAR_TABLE_LENGTH, "Erase counter table is too small");
+
+typedef struct
+{
+    uint32_t offset;        // Flash offset of sector
+    uint32_t count;         // Number of times it has been erased
+}tFlashWearSector;
+
+//****************************************************************************
+// Record that 'length' bytes of flash starting at 'offset' (both multiples
+// of the sector size) are about to be erased.  Does nothing if there is
+// no valid table or the sectors aren't tracked.
+void flashWearRecord(uint32_t offset, uint32_t length);
+
+//****************************************************************************
+// Create the table if there isn't one or fold the counters into a new copy
+// if any sector is running out of bits.  Must not be called from the
+// flashloader (it needs a sector-sized buffer).
+// Returns non-zero if a table had to be written
+int flashWearCompact(void);
+
+//****************************************************************************
+// Returns the number of times the sector at the given offset has been erased
+uint32_t flashWearCount(uint32_t offset);
+
+//****************************************************************************
+// Fills in up to 'max' of the most erased sectors (most erased first).
+// Returns the number of entries filled in
+uint32_t flashWearHottest(tFlashWearSector* hottest, uint32_t max);
+
+//****************************************************************************
+// Estimates how many more updates can be performed before the most worn
+// sector reaches the flash's rated endurance, given how many updates have
+// been performed so far.  Returns 0xffffffff if nothing has been erased yet.
+uint32_t flashWearUpdatesRemaining(uint32_t updates);
+
+#endif // __FLASHWEAR_INCL__
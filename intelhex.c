@@ -0,0 +1,89 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Intel hex record parsing (see intelhex.h)
+
+#include <string.h>
+#include "intelhex.h"
+
+//****************************************************************************
+// Converts an ASCII hex character into its binary representation.
+// The existing value is shifted across one nibble before the new value is
+// stored in the lower nibble.
+// Returns non-zero if the character could be converted
+int hex2nibble(char c, uint8_t* value)
+{
+    int success = 0;
+
+    if(c >= '0' && c <= '9')
+    {
+        *value <<= 4;
+        *value |= (uint8_t)(c - '0');
+        success = 1;
+    }
+    else
+    {
+        c |= 32;
+        if(c >= 'a' && c <= 'z')
+        {
+            *value <<= 4;
+            *value |= (uint8_t)(c - 'a') + 10;
+            success = 1;
+        }
+    }
+
+    return success;
+}
+
+//****************************************************************************
+// Converts two ASCII hex characters to an 8-bit binary value.
+// Returns non-zero if valid hex characters were found
+int parseHex(const char* str, uint8_t* value)
+{
+    int success;
+
+    *value = 0;
+    success = hex2nibble(*str++, value) && hex2nibble(*str, value);
+
+    return success;
+}
+
+//****************************************************************************
+// Converts an Intel hex record in text form to a binary representation.
+// Returns non-zero if the text could be parsed successfully
+int processRecord(const char* line, tRecord* record)
+{
+    int      success = 0;
+    uint32_t offset = 0;
+    uint8_t  value;
+    uint8_t  data[256 + 5]; // Max payload 256 bytes plus 5 for fields
+    uint8_t  checksum = 0;
+
+    while(*line && (*line != ':'))
+        line++;
+
+    if(*line++ == ':')
+    {
+        while(parseHex(line, &value) && (offset < sizeof(data)))
+        {
+            data[offset++] = value;
+            checksum += value;
+            line += 2;
+        }
+    }
+
+    // Checksum is two's-complement of the sum of the previous bytes so
+    // final checksum should be zero if everything was OK.
+    if((offset > 0) && (checksum == 0))
+    {
+        record->count = data[0];
+        record->addr  = data[2] | (data[1] << 8);
+        record->type  = data[3];
+        memcpy(record->data, &data[4], data[0]);
+        success = 1;
+    }
+
+    return success;
+}
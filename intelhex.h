@@ -0,0 +1,49 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Intel hex record parsing used by the application when receiving a new
+// image as text.  This doesn't depend on the Pico SDK so the host benchmark
+// (tools/updatebench.cpp) can run exactly the same code.
+
+#ifndef __INTELHEX_INCL__
+#define __INTELHEX_INCL__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Intel HEX record
+typedef struct
+{
+    uint8_t  count;
+    uint16_t addr;
+    uint8_t  type;
+    uint8_t  data[256];
+}tRecord;
+
+//****************************************************************************
+// Converts an ASCII hex character into its binary representation.
+// The existing value is shifted across one nibble before the new value is
+// stored in the lower nibble.
+// Returns non-zero if the character could be converted
+int hex2nibble(char c, uint8_t* value);
+
+//****************************************************************************
+// Converts two ASCII hex characters to an 8-bit binary value.
+// Returns non-zero if valid hex characters were found
+int parseHex(const char* str, uint8_t* value);
+
+//****************************************************************************
+// Converts an Intel hex record in text form to a binary representation.
+// Returns non-zero if the text could be parsed successfully
+int processRecord(const char* line, tRecord* record);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __INTELHEX_INCL__
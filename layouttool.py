@@ -0,0 +1,271 @@
+#!/usr/bin/env python3
+#
+# Copyright 2021 Richard Hulme
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Script to generate everything that depends on the layout of the flash from
+# a single description (see flashlayout.txt):
+#   memmap_defines.ld  - symbols for the linker scripts
+#   flashlayout.h      - partition constants for the flashloader and
+#                        application, including the contents of the
+#                        partition table stored at the end of the flashloader
+#   flashlayout.cmake  - the same constants for the build
+#
+# The layout is checked before anything is written so that overlapping or
+# misaligned partitions are caught at build time rather than by the
+# flashloader refusing an update image at runtime.
+#
+
+import argparse
+import os
+import re
+import struct
+
+SECTOR_SIZE = 4096
+
+# Partitions that must be present (exactly once)
+REQUIRED = ['flashloader', 'application', 'staging', 'wear']
+
+def auto_size(text):
+    match = re.match(r"^(-?)(0x[0-9a-fA-F]+|\d+)([kKM]?)$", text)
+    if not match:
+        raise ValueError(f"invalid size '{text}'")
+
+    value = int(match.group(2), 0) * {'': 1, 'k': 1024, 'K': 1024, 'M': 1024 * 1024}[match.group(3)]
+    return -value if match.group(1) else value
+
+# CRC32 as calculated by the RP2040's DMA sniffer (polynomial 0x04C11DB7,
+# not reflected, no final XOR)
+def crc32(data, crc=0xffffffff):
+    for byte in data:
+        crc ^= byte << 24
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x04c11db7) if (crc & 0x80000000) else (crc << 1)
+            crc &= 0xffffffff
+
+    return crc
+
+# Read the FLASH_PARTITION_xxx types (and the table's magic number and
+# version) from flashpartition.h so they can't get out of step with the code
+def read_types(header):
+    types = {}
+    magic = None
+    version = None
+
+    with open(header) as f:
+        for line in f:
+            define = re.match(r"^#define\s+FLASH_PARTITION_(\w+)\s+(\d+)", line)
+            constant = re.match(r"^static const uint32_t FLASH_PARTITION_MAGIC\s*=\s*(0x[0-9a-fA-F]+);", line)
+
+            if constant:
+                magic = int(constant.group(1), 16)
+            elif define and (define.group(1) == 'VERSION'):
+                version = int(define.group(2))
+            elif define:
+                types[define.group(1).lower()] = int(define.group(2))
+
+    if (magic is None) or (version is None):
+        raise SystemExit(f"{header}: partition table magic number or version not found")
+
+    return types, magic, version
+
+class Partition:
+    def __init__(self, name, type, offset, length, line):
+        self.name   = name
+        self.type   = type
+        self.offset = offset
+        self.length = length
+        self.line   = line
+
+def read_layout(filename, types):
+    flash = None
+    partitions = []
+
+    with open(filename) as f:
+        for number, line in enumerate(f, 1):
+            fields = line.split('#')[0].split()
+
+            try:
+                if not fields:
+                    continue
+                elif (fields[0] == 'flash') and (len(fields) == 2):
+                    flash = auto_size(fields[1])
+                elif len(fields) == 4:
+                    if not re.match(r"^[a-zA-Z_]\w*$", fields[0]):
+                        raise ValueError(f"invalid partition name '{fields[0]}'")
+
+                    if fields[1] not in types:
+                        raise ValueError(f"unknown partition type '{fields[1]}'")
+
+                    length = None if fields[3] == '*' else auto_size(fields[3])
+                    partitions.append(Partition(fields[0], fields[1], auto_size(fields[2]), length, number))
+                else:
+                    raise ValueError("expected 'flash <size>' or '<name> <type> <offset> <length>'")
+            except ValueError as e:
+                raise SystemExit(f"{filename}:{number}: {e}")
+
+    if flash is None:
+        raise SystemExit(f"{filename}: flash size not given")
+
+    return flash, partitions
+
+def check_layout(filename, flash, partitions):
+    def error(partition, message):
+        raise SystemExit(f"{filename}:{partition.line}: {partition.name}: {message}")
+
+    for partition in partitions:
+        if partition.offset < 0:
+            partition.offset += flash
+
+    partitions.sort(key=lambda p: p.offset)
+
+    # Fill in the lengths left to us
+    for pos, partition in enumerate(partitions):
+        if partition.length is None:
+            end = partitions[pos + 1].offset if (pos + 1) < len(partitions) else flash
+            partition.length = end - partition.offset
+
+    names = set()
+    end = 0
+
+    for partition in partitions:
+        if partition.name in names:
+            error(partition, "duplicate partition name")
+        names.add(partition.name)
+
+        if (partition.offset % SECTOR_SIZE) or (partition.length % SECTOR_SIZE):
+            error(partition, f"offset and length must be multiples of {SECTOR_SIZE}")
+
+        if partition.length <= 0:
+            error(partition, "partition is empty")
+
+        if partition.offset < end:
+            error(partition, f"overlaps the previous partition (which ends at 0x{end:x})")
+
+        end = partition.offset + partition.length
+        if end > flash:
+            error(partition, f"extends past the end of flash (0x{flash:x})")
+
+    by_type = {}
+    for partition in partitions:
+        by_type.setdefault(partition.type, []).append(partition)
+
+    for required in REQUIRED:
+        if len(by_type.get(required, [])) != 1:
+            raise SystemExit(f"{filename}: there must be exactly one '{required}' partition")
+
+    flashloader = by_type['flashloader'][0]
+    application = by_type['application'][0]
+    wear = by_type['wear'][0]
+
+    if flashloader.offset != 0:
+        error(flashloader, "must be at the start of flash")
+
+    if application.offset != (flashloader.offset + flashloader.length):
+        error(application, "must follow the flashloader")
+
+    if wear.length % (2 * SECTOR_SIZE):
+        error(wear, "must be an even number of sectors (there are two copies of the table)")
+
+    if len(by_type.get('bootstate', [])) > 1:
+        raise SystemExit(f"{filename}: there can only be one 'bootstate' partition")
+
+    # The flashloader erases the boot state records a sector at a time
+    for bootstate in by_type.get('bootstate', []):
+        if bootstate.length != SECTOR_SIZE:
+            error(bootstate, "must be exactly one sector")
+
+    return {p.type: p for p in partitions if p.type in REQUIRED}
+
+# Contents of the partition table as 32-bit words
+def partition_table(partitions, types, magic, version):
+    entries = []
+    for partition in partitions:
+        entries.extend([types[partition.type], partition.offset, partition.length])
+
+    crc = crc32(struct.pack(f"<{len(entries)}I", *entries))
+    return [magic, (len(partitions) << 16) | version, crc] + entries, crc
+
+# Only touch the file if it has changed so everything isn't rebuilt each
+# time the project is configured
+def write(filename, text):
+    if os.path.exists(filename):
+        with open(filename) as f:
+            if f.read() == text:
+                return
+
+    with open(filename, mode='w') as f:
+        f.write(text)
+
+def main():
+    parser = argparse.ArgumentParser()
+
+    parser.add_argument('--types', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "flashpartition.h"),
+                        help="header defining the partition types")
+    parser.add_argument('-d', dest='outdir', default='.', help="directory to write the generated files to")
+    parser.add_argument('layout')
+
+    args = parser.parse_args()
+
+    types, magic, version = read_types(args.types)
+    flash, partitions = read_layout(args.layout, types)
+    required = check_layout(args.layout, flash, partitions)
+
+    # The table goes at the very end of the flashloader's area
+    table, crc = partition_table(partitions, types, magic, version)
+    table_length = (len(table) * 4 + 15) & ~15
+    table_offset = required['flashloader'].offset + required['flashloader'].length - table_length
+
+    if table_length >= required['flashloader'].length:
+        raise SystemExit(f"{args.layout}: too many partitions to fit in the flashloader")
+
+    # Constants for each partition
+    constants = [("FLASH_LAYOUT_SIZE", flash)]
+    for partition in partitions:
+        constants.append((f"FLASH_{partition.name.upper()}_OFFSET", partition.offset))
+        constants.append((f"FLASH_{partition.name.upper()}_LENGTH", partition.length))
+
+    constants.append(("FLASH_PARTITION_TABLE_OFFSET", table_offset))
+    constants.append(("FLASH_PARTITION_TABLE_LENGTH", table_length))
+    constants.append(("FLASH_PARTITION_COUNT", len(partitions)))
+    constants.append(("FLASH_PARTITION_TABLE_CRC32", crc))
+
+    banner = f"Generated by layouttool.py from {os.path.basename(args.layout)} - do not edit"
+
+    ld = [f"/* {banner} */",
+          f"__FLASHLOADER_START = 0x{required['flashloader'].offset:x};",
+          f"__FLASHLOADER_LENGTH = 0x{required['flashloader'].length:x};",
+          f"__APPLICATION_START = 0x{required['application'].offset:x};",
+          f"__APPLICATION_LENGTH = 0x{required['application'].length:x};",
+          f"__PARTITION_TABLE_OFFSET = 0x{table_offset:x};",
+          f"__PARTITION_TABLE_LENGTH = 0x{table_length:x};"]
+
+    header = [f"// {banner}",
+              "",
+              "#ifndef __FLASHLAYOUT_INCL__",
+              "#define __FLASHLAYOUT_INCL__",
+              ""]
+    header.extend(f"#define {name:<32} 0x{value:08x}" for name, value in constants)
+    header.append("")
+    header.append("// Contents of the partition table (see tFlashPartitionTable)")
+    header.append("#define FLASH_PARTITION_TABLE_WORDS { \\")
+    for pos in range(0, len(table), 3):
+        header.append("    " + ", ".join(f"0x{word:08x}" for word in table[pos:pos + 3]) + ", \\")
+    header.append("}")
+    header.append("")
+    header.append("#endif // __FLASHLAYOUT_INCL__")
+
+    cmake = [f"# {banner}"]
+    cmake.extend(f"set({name} 0x{value:08x})" for name, value in constants)
+
+    os.makedirs(args.outdir, exist_ok=True)
+    write(os.path.join(args.outdir, "memmap_defines.ld"), "\n".join(ld) + "\n")
+    write(os.path.join(args.outdir, "flashlayout.h"), "\n".join(header) + "\n")
+    write(os.path.join(args.outdir, "flashlayout.cmake"), "\n".join(cmake) + "\n")
+
+    for partition in partitions:
+        print(f"{partition.name:<16} 0x{partition.offset:08x} - 0x{partition.offset + partition.length - 1:08x} "
+              f"({partition.length // 1024}k)")
+
+main()
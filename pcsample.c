@@ -0,0 +1,86 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Very simple statistical profiler for the application.
+// See pcsample.h for details.
+
+#include "pico/stdlib.h"
+#include "hardware/irq.h"
+#include "hardware/timer.h"
+#include "hardware/structs/timer.h"
+#include "pcsample.h"
+
+#define PC_SAMPLE_IRQ (TIMER_IRQ_0 + PC_SAMPLE_ALARM)
+
+static uint32_t          sSamples[PC_SAMPLE_MAX];
+static volatile uint32_t sCount;
+static uint32_t          sPeriod;
+
+void pcSampleRecord(uint32_t pc);
+
+//****************************************************************************
+// Interrupt handler.  This has to be 'naked' so that the stack pointer still
+// points at the exception frame pushed by the hardware when we read the
+// interrupted PC (the seventh word) from it.  Control is then passed on to
+// pcSampleRecord, which returns from the exception.
+static void __attribute__((naked)) sampleHandler(void)
+{
+    asm volatile (
+    "mov r0, sp\n"
+    "ldr r0, [r0, #24]\n"
+    "ldr r1, =pcSampleRecord\n"
+    "bx r1\n"
+    );
+}
+
+//****************************************************************************
+// Record the interrupted address and schedule the next sample.
+// Only called from sampleHandler.
+void pcSampleRecord(uint32_t pc)
+{
+    // Acknowledge the interrupt
+    timer_hw->intr = 1u << PC_SAMPLE_ALARM;
+
+    if(sCount < PC_SAMPLE_MAX)
+    {
+        sSamples[sCount++] = pc;
+        timer_hw->alarm[PC_SAMPLE_ALARM] = timer_hw->timerawl + sPeriod;
+    }
+}
+
+//****************************************************************************
+void pcSampleStart(uint32_t periodUs)
+{
+    sPeriod = periodUs;
+    sCount  = 0;
+
+    // Panics if something else is already using the alarm
+    hardware_alarm_claim(PC_SAMPLE_ALARM);
+
+    irq_set_exclusive_handler(PC_SAMPLE_IRQ, sampleHandler);
+    hw_set_bits(&timer_hw->inte, 1u << PC_SAMPLE_ALARM);
+    irq_set_enabled(PC_SAMPLE_IRQ, true);
+
+    timer_hw->alarm[PC_SAMPLE_ALARM] = timer_hw->timerawl + sPeriod;
+}
+
+//****************************************************************************
+void pcSampleStop(void)
+{
+    irq_set_enabled(PC_SAMPLE_IRQ, false);
+    hw_clear_bits(&timer_hw->inte, 1u << PC_SAMPLE_ALARM);
+
+    // Disarm the alarm and let something else have it
+    timer_hw->armed = 1u << PC_SAMPLE_ALARM;
+    irq_remove_handler(PC_SAMPLE_IRQ, sampleHandler);
+    hardware_alarm_unclaim(PC_SAMPLE_ALARM);
+}
+
+//****************************************************************************
+const uint32_t* pcSamples(uint32_t* count)
+{
+    *count = sCount;
+    return sSamples;
+}
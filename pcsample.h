@@ -0,0 +1,43 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Very simple statistical profiler for the application.
+//
+// A spare hardware timer alarm periodically interrupts the application and
+// records the address that was interrupted.  The samples can then be
+// written out (one "0x<address>" per line) and passed to profiletool.py
+// together with the application's ELF file to generate a function order
+// for the linker.
+
+#ifndef __PCSAMPLE_INCL__
+#define __PCSAMPLE_INCL__
+
+#include <stdint.h>
+
+// The SDK's default alarm pool uses alarm 3.  The alarm is claimed (through
+// the SDK) while samples are being recorded.
+#ifndef PC_SAMPLE_ALARM
+    #define PC_SAMPLE_ALARM 2
+#endif
+
+// Maximum number of samples recorded
+#ifndef PC_SAMPLE_MAX
+    #define PC_SAMPLE_MAX 4096
+#endif
+
+//****************************************************************************
+// Start recording a sample every 'periodUs' microseconds until the buffer
+// is full
+void pcSampleStart(uint32_t periodUs);
+
+//****************************************************************************
+// Stop recording samples
+void pcSampleStop(void);
+
+//****************************************************************************
+// Returns the samples recorded so far
+const uint32_t* pcSamples(uint32_t* count);
+
+#endif // __PCSAMPLE_INCL__
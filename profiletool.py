@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+#
+# Copyright 2021 Richard Hulme
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Script to turn a function-level profile into linker script fragments.
+#
+# The profile is a text file where each line is either:
+#   <count> <function name>
+#   <count> <address>
+#   <address>                   (a single PC sample, e.g. from pcsample.c)
+# where addresses are in hex with a leading "0x".
+# Anything else (such as other output captured from a terminal) is ignored.
+# Addresses are mapped to functions using the symbol table of the ELF file
+# that was running when the profile was taken.
+#
+# The 'order' command writes a list of input sections for the .text output
+# section (see memmap_text_order.ld) so that the hottest functions are
+# packed together at the start of the application instead of being
+# scattered through flash, which makes much better use of the XIP cache.
+#
+# The 'ram' command moves the hottest functions that fit within a RAM
+# budget into RAM, without having to annotate the source.  It is run just
+# before linking and renames the functions' sections in the object files
+# from '.text.<name>' to '.time_critical.profile.<name>', which the
+# '.data' section in memmap_default.ld places in RAM (copying them from
+# flash at start-up).  Functions moved by a previous run that are no longer
+# selected are renamed back, so the result only depends on the profile.
+#
+
+import argparse
+import bisect
+import collections
+import re
+import subprocess
+
+# The same libraries memmap_default.ld excludes from .text (so that they end
+# up in RAM).  They must be excluded here as well or they'd be pulled back
+# into flash.
+EXCLUDE = "EXCLUDE_FILE(*libgcc.a: *libc.a:*lib_a-mem*.o *libm.a:)"
+
+ADDRESS = re.compile(r"^0x[0-9a-fA-F]+$")
+
+# Prefix for sections of functions moved to RAM.  This must be matched by
+# '.time_critical*' in the .data section of memmap_default.ld
+RAM_PREFIX = ".time_critical.profile."
+
+# Read the symbol table of the given ELF file and return a sorted list of
+# (address, size, name) tuples for all functions
+def read_symbols(nm, elf):
+    output = subprocess.run([nm, "--defined-only", "--print-size", elf],
+                            check=True, capture_output=True, text=True).stdout
+    symbols = []
+
+    for line in output.splitlines():
+        fields = line.split()
+
+        if (len(fields) == 4) and (fields[2] in "tTwW"):
+            # Clear the Thumb bit
+            address = int(fields[0], 16) & ~1
+            symbols.append((address, int(fields[1], 16), fields[3]))
+
+    symbols.sort()
+    return symbols
+
+# Find the function containing the given address
+def lookup(symbols, starts, address):
+    pos = bisect.bisect_right(starts, address) - 1
+
+    if pos >= 0:
+        start, size, name = symbols[pos]
+        if address < start + max(size, 1):
+            return name
+
+    return None
+
+# Read the profile and return a Counter of samples per function
+def read_profile(filename, symbols):
+    counts = collections.Counter()
+    starts = [s[0] for s in symbols]
+    unknown = 0
+
+    with open(filename) as f:
+        for line in f:
+            fields = line.split()
+
+            if (len(fields) == 1) and ADDRESS.match(fields[0]):
+                count, key = 1, fields[0]
+            elif (len(fields) == 2) and fields[0].isdigit():
+                count, key = int(fields[0]), fields[1]
+            else:
+                continue
+
+            if ADDRESS.match(key):
+                if not symbols:
+                    raise SystemExit(f"{filename} contains addresses: an ELF file is needed to map them to functions")
+
+                key = lookup(symbols, starts, int(key, 16))
+                if key is None:
+                    unknown += count
+                    continue
+
+            counts[key] += count
+
+    if unknown:
+        print(f"{unknown} samples could not be mapped to a function")
+
+    return counts
+
+# Pick the hottest functions until we've covered the given proportion of
+# the samples (or reached the maximum number of functions)
+def hottest(counts, coverage, maximum):
+    total = sum(counts.values())
+    selected = []
+    covered = 0
+
+    for name, count in counts.most_common():
+        if (covered >= total * coverage) or (maximum and len(selected) >= maximum):
+            break
+
+        selected.append(name)
+        covered += count
+
+    return selected, covered, total
+
+def order(args, counts):
+    selected, covered, total = hottest(counts, args.coverage, args.max)
+
+    with open(args.outfile, mode='w') as output:
+        output.write(f"/* Generated by profiletool.py from {args.profile} - do not edit */\n")
+
+        for name in selected:
+            output.write(f"*({EXCLUDE} .text.{name} .text.{name}.*)\n")
+
+    print(f"Written {args.outfile}: {len(selected)} functions covering {covered} of {total} samples")
+
+# List the sections in an object file
+def read_sections(objdump, obj):
+    output = subprocess.run([objdump, "-h", obj],
+                            check=True, capture_output=True, text=True).stdout
+    sections = []
+
+    for line in output.splitlines():
+        fields = line.split()
+
+        if (len(fields) >= 7) and fields[0].isdigit():
+            sections.append(fields[1])
+
+    return sections
+
+def ram(args, counts, symbols):
+    sizes = {name: size for address, size, name in symbols}
+    selected = set()
+    used = 0
+
+    if not symbols:
+        raise SystemExit("An ELF file is needed to find the size of each function")
+
+    candidates, covered, total = hottest(counts, args.coverage, 0)
+
+    for name in candidates:
+        if args.max and (len(selected) >= args.max):
+            break
+
+        # Skip anything we don't know the size of (or that can't fit) but
+        # keep looking for something smaller that can
+        size = (sizes.get(name, 0) + 3) & ~3
+        if (size == 0) or (used + size > args.budget):
+            continue
+
+        selected.add(name)
+        used += size
+
+    moved = 0
+    for obj in args.objects:
+        renames = []
+
+        for section in read_sections(args.objdump, obj):
+            if section.startswith(RAM_PREFIX):
+                name = section[len(RAM_PREFIX):]
+                if name not in selected:
+                    renames.append(f"{section}=.text.{name}")
+            elif section.startswith(".text."):
+                name = section[len(".text."):]
+                if name in selected:
+                    renames.append(f"{section}={RAM_PREFIX}{name}")
+                    moved += 1
+
+        if renames:
+            command = [args.objcopy]
+            for rename in renames:
+                command.extend(["--rename-section", rename])
+            command.append(obj)
+            subprocess.run(command, check=True)
+
+    print(f"Placing {len(selected)} functions ({used} of {args.budget} bytes) in RAM")
+
+def main():
+    parser = argparse.ArgumentParser()
+
+    parser.add_argument('--elf', help="ELF file the profile was taken with (needed for addresses)")
+    parser.add_argument('--nm', default="arm-none-eabi-nm")
+    parser.add_argument('--coverage', type=float, default=0.99,
+                        help="proportion of samples the selected functions should cover")
+    parser.add_argument('--max', type=int, default=0, help="maximum number of functions")
+    parser.add_argument('--budget', type=int, default=4096, help="RAM budget in bytes (ram)")
+    parser.add_argument('--objcopy', default="arm-none-eabi-objcopy")
+    parser.add_argument('--objdump', default="arm-none-eabi-objdump")
+    parser.add_argument('-o', dest='outfile')
+    parser.add_argument('command', choices=['order', 'ram'])
+    parser.add_argument('profile')
+    parser.add_argument('objects', nargs='*', help="object files to modify (ram)")
+
+    args = parser.parse_args()
+
+    symbols = read_symbols(args.nm, args.elf) if args.elf else []
+    counts = read_profile(args.profile, symbols)
+
+    if args.command == 'order':
+        if not args.outfile:
+            parser.error("an output file is required")
+        order(args, counts)
+    else:
+        ram(args, counts, symbols)
+
+main()
@@ -0,0 +1,479 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Host tool to turn an application (binary or ELF file) into an update image
+// that can be staged in flash and handed straight to the flashloader.
+//
+// The image starts with a tFlashHeader (see flashloader.h) containing the
+// length and CRC32 of the data, followed by the application itself or, with
+// '--compress', the application split into 4k blocks that have each been
+// compressed independently (see tFlashCompression).  As the blocks don't
+// depend on each other, they are compressed in parallel using all cores.
+// With '--encrypt', the application is instead encrypted with AES-128 in
+// CTR mode (see tFlashEncryption).  A FLASH_TLV_SEQUENCE record is reserved
+// so the device can fill in the staging sequence number without having to
+// move the data.
+//
+// A manifest is also written listing the CRC32 of each flash sector the
+// application will occupy (so they can be checked on the device after an
+// update) and how long staging and flashing the image is expected to take.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "flashloader.h"
+#include "flashaes.h"
+#include "flashcrc.h"
+#include "hostcrc.h"
+#include "imagepack.h"
+
+namespace
+{
+
+const uint32_t FLASH_PAGE_SIZE   = 256;
+const uint32_t FLASH_SECTOR_SIZE = 4096;
+
+struct tOptions
+{
+    std::string input;
+    std::string output;
+    std::string manifest;
+    bool        compress   = false;
+    bool        encrypt    = false;
+    bool        nonceSet   = false;
+    uint8_t     key[FLASH_AES_KEY_LENGTH];
+    uint8_t     nonce[FLASH_AES_NONCE_LENGTH];
+    bool        appVersion = false;
+    uint32_t    version    = 0;
+    uint32_t    address    = 0x10001000;  // XIP_BASE + __FLASHLOADER_LENGTH
+    uint32_t    maxLength  = 0;           // Size of the application partition
+    double      eraseMs    = 45.0;        // Typical 4k sector erase time
+    double      pageUs     = 400.0;       // Typical 256 byte page program time
+    unsigned    jobs       = std::thread::hardware_concurrency();
+    std::vector<uint32_t> links = { 115200, 460800, 921600 };  // Baud rates
+};
+
+//****************************************************************************
+// Build the update image for the given application
+std::vector<uint8_t> buildImage(const tOptions& options, const std::vector<uint8_t>& app)
+{
+    std::vector<uint8_t> tlv;
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> value;
+
+    // Reserved for the device to fill in when the image is staged
+    put32(value, 0);
+    putTlv(tlv, FLASH_TLV_SEQUENCE, value);
+
+    if(options.appVersion)
+    {
+        value.clear();
+        put32(value, options.version);
+        putTlv(tlv, FLASH_TLV_APP_VERSION, value);
+    }
+
+    data = app;
+
+    if(options.compress)
+    {
+        std::vector<uint8_t> compressed;
+        std::vector<uint8_t> record = compressImage(app, compressed, options.jobs);
+
+        if(record.empty())
+            exit(1);
+
+        // The flashloader won't accept less than a page of data and there's
+        // no point compressing if nothing is saved
+        if((compressed.size() >= FLASH_PAGE_SIZE) &&
+           ((compressed.size() + record.size() + sizeof(tFlashTlv)) < app.size()))
+        {
+            putTlv(tlv, FLASH_TLV_COMPRESSION, record);
+            data = compressed;
+
+            std::printf("Compressed %zu bytes to %zu (%.1f%%) in %zu blocks\n",
+                        app.size(), data.size(), (100.0 * data.size()) / app.size(),
+                        (app.size() + FLASH_COMPRESSION_BLOCK - 1) / FLASH_COMPRESSION_BLOCK);
+        }
+        else
+            std::cout << "Application does not compress: storing uncompressed\n";
+    }
+
+    if(options.encrypt)
+    {
+        tFlashEncryption encryption = {};
+        tFlashAes aes;
+
+        encryption.algorithm  = FLASH_ENCRYPTION_AES128_CTR;
+        encryption.plainCrc32 = hostCrc32(app.data(), app.size(), FLASH_CRC32_INIT);
+        std::memcpy(encryption.nonce, options.nonce, sizeof(encryption.nonce));
+
+        value.assign(reinterpret_cast<const uint8_t*>(&encryption),
+                     reinterpret_cast<const uint8_t*>(&encryption) + sizeof(encryption));
+        putTlv(tlv, FLASH_TLV_ENCRYPTION, value);
+
+        flashAesInit(&aes, options.key);
+        flashAesCtr(&aes, options.nonce, 0, data.data(), data.size());
+    }
+
+    tFlashHeader header;
+
+    flashHeaderInit(&header, sizeof(tFlashHeader) + tlv.size());
+    header.length   = data.size();
+    header.crc32    = hostCrc32(data.data(), data.size(), FLASH_CRC32_INIT);
+    header.tlvCrc32 = flashCrc32(tlv.data(), tlv.size(), FLASH_CRC32_INIT);
+
+    const uint8_t* raw = reinterpret_cast<const uint8_t*>(&header);
+    std::vector<uint8_t> image(raw, raw + sizeof(header));
+
+    image.insert(image.end(), tlv.begin(), tlv.end());
+    image.insert(image.end(), data.begin(), data.end());
+    return image;
+}
+
+//****************************************************************************
+uint16_t get16(const std::vector<uint8_t>& buf, size_t offset)
+{
+    return buf[offset] | (buf[offset + 1] << 8);
+}
+
+//****************************************************************************
+uint32_t get32(const std::vector<uint8_t>& buf, size_t offset)
+{
+    return get16(buf, offset) | ((uint32_t)get16(buf, offset + 2) << 16);
+}
+
+//****************************************************************************
+// Returns true if the file is an ELF file rather than a binary
+bool isElf(const std::vector<uint8_t>& file)
+{
+    return (file.size() >= 4) && !memcmp(file.data(), "\x7f" "ELF", 4);
+}
+
+//****************************************************************************
+// Turn the loadable segments of an ELF file into a binary image starting at
+// 'address', the same as 'objcopy -O binary' would (including filling any
+// gaps with zeros)
+std::vector<uint8_t> readElf(const std::string& filename, const std::vector<uint8_t>& elf,
+                             uint32_t address)
+{
+    const uint32_t PT_LOAD  = 1;
+    const uint32_t XIP_END  = 0x11000000;
+    std::vector<uint8_t> app;
+
+    // Only 32-bit little-endian files (as produced for the RP2040)
+    if((elf.size() < 52) || (elf[4] != 1) || (elf[5] != 1))
+    {
+        std::cerr << filename << " is not a 32-bit little-endian ELF file\n";
+        exit(1);
+    }
+
+    uint32_t phoff     = get32(elf, 28);
+    uint16_t phentsize = get16(elf, 42);
+    uint16_t phnum     = get16(elf, 44);
+
+    for(uint16_t i = 0; i < phnum; i++)
+    {
+        size_t header = phoff + (i * phentsize);
+
+        if((header + 32) > elf.size())
+        {
+            std::cerr << filename << " is truncated\n";
+            exit(1);
+        }
+
+        uint32_t type   = get32(elf, header);
+        uint32_t offset = get32(elf, header + 4);
+        uint32_t paddr  = get32(elf, header + 12);
+        uint32_t filesz = get32(elf, header + 16);
+
+        // Segments that only exist in RAM (e.g. .bss) have nothing to store
+        if((type != PT_LOAD) || (filesz == 0))
+            continue;
+
+        // Everything else must be loaded from flash following 'address'
+        if((paddr < address) || ((paddr + filesz) > XIP_END) ||
+           ((uint64_t)offset + filesz > elf.size()))
+        {
+            std::fprintf(stderr, "%s: segment at 0x%08x isn't in the application's flash\n",
+                         filename.c_str(), paddr);
+            exit(1);
+        }
+
+        if(app.size() < (paddr - address + filesz))
+            app.resize(paddr - address + filesz, 0);
+
+        std::copy(elf.begin() + offset, elf.begin() + offset + filesz, app.begin() + (paddr - address));
+    }
+
+    return app;
+}
+
+//****************************************************************************
+// Time taken to erase and program 'length' bytes of flash (in microseconds)
+uint64_t predictUs(const tOptions& options, size_t length)
+{
+    size_t sectors = (length + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+    size_t pages   = (length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+
+    return (uint64_t)((sectors * options.eraseMs * 1000.0) + (pages * options.pageUs));
+}
+
+//****************************************************************************
+void writeManifest(const tOptions& options, const std::vector<uint8_t>& app,
+                   const std::vector<uint8_t>& image)
+{
+    const tFlashHeader* header = (const tFlashHeader*)image.data();
+    std::FILE* file = std::fopen(options.manifest.c_str(), "w");
+
+    if(!file)
+    {
+        std::perror(options.manifest.c_str());
+        exit(1);
+    }
+
+    // The flashloader programs the whole application plus one page to mark
+    // the staged image as consumed
+    uint64_t stageUs = predictUs(options, image.size());
+    uint64_t flashUs = predictUs(options, app.size()) + (uint64_t)options.pageUs;
+
+    std::fprintf(file, "# Generated by flashpack from %s - do not edit\n", options.input.c_str());
+    std::fprintf(file, "image %s\n", options.output.c_str());
+    std::fprintf(file, "image-length %zu\n", image.size());
+    std::fprintf(file, "header-length %u\n", header->headerLength);
+    std::fprintf(file, "data-crc32 0x%08x\n", header->crc32);
+    std::fprintf(file, "app-address 0x%08x\n", options.address);
+    std::fprintf(file, "app-length %zu\n", app.size());
+    std::fprintf(file, "app-crc32 0x%08x\n", hostCrc32(app.data(), app.size(), FLASH_CRC32_INIT));
+    std::fprintf(file, "compression %s\n", (header->length != app.size()) ? "lz4" : "none");
+    std::fprintf(file, "encryption %s\n", options.encrypt ? "aes128-ctr" : "none");
+    std::fprintf(file, "predicted-stage-us %llu\n", (unsigned long long)stageUs);
+    std::fprintf(file, "predicted-flash-us %llu\n", (unsigned long long)flashUs);
+
+    // CRC of each sector as it will be in flash (i.e. padded with the erased
+    // value) so it can be compared with a CRC of the sector on the device
+    for(size_t offset = 0; offset < app.size(); offset += FLASH_SECTOR_SIZE)
+    {
+        std::vector<uint8_t> sector(FLASH_SECTOR_SIZE, 0xff);
+        size_t length = std::min<size_t>(FLASH_SECTOR_SIZE, app.size() - offset);
+
+        std::copy(app.begin() + offset, app.begin() + offset + length, sector.begin());
+        std::fprintf(file, "sector 0x%08zx 0x%08x\n", options.address + offset,
+                     hostCrc32(sector.data(), sector.size(), FLASH_CRC32_INIT));
+    }
+
+    std::fclose(file);
+
+    std::printf("Predicted time: %.1fms staging, %.1fms flashing\n",
+                stageUs / 1000.0, flashUs / 1000.0);
+}
+
+//****************************************************************************
+// Show how long it takes to transfer the image over a UART at each of the
+// given baud rates (8N1, so ten bits per byte)
+void reportTransfer(const tOptions& options, size_t length)
+{
+    for(uint32_t baud : options.links)
+        std::printf("Transfer at %u baud: %.2fs\n", baud, (length * 10.0) / baud);
+}
+
+//****************************************************************************
+// Parse a comma-separated list of numbers
+std::vector<uint32_t> parseList(const char* text)
+{
+    std::vector<uint32_t> values;
+    std::stringstream stream(text);
+    std::string item;
+
+    while(std::getline(stream, item, ','))
+    {
+        if(!item.empty())
+            values.push_back(std::strtoul(item.c_str(), nullptr, 0));
+    }
+
+    return values;
+}
+
+//****************************************************************************
+// Parse a string of hex digits into exactly 'length' bytes
+bool parseHex(const char* text, uint8_t* bytes, size_t length)
+{
+    std::string digits(text);
+
+    if((digits.size() != (length * 2)) ||
+       (digits.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos))
+        return false;
+
+    for(size_t i = 0; i < length; i++)
+        bytes[i] = std::strtoul(digits.substr(i * 2, 2).c_str(), nullptr, 16);
+
+    return true;
+}
+
+//****************************************************************************
+void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [options] <application.bin|application.elf>\n"
+                 "  -o <file>             Update image to write (default <application>.img)\n"
+                 "  -m <file>             Manifest to write (default <image>.manifest)\n"
+                 "  --compress            Compress the application in 4k blocks\n"
+                 "  --encrypt <key>       Encrypt the application with AES-128 (32 hex digits)\n"
+                 "  --nonce <nonce>       Nonce to encrypt with (24 hex digits, default random)\n"
+                 "  --app-version <n>     Add an application version record\n"
+                 "  --address <addr>      Flash address the application runs from\n"
+                 "  --max-length <n>      Size of the application partition\n"
+                 "  --erase-ms <ms>       Time taken to erase a 4k sector\n"
+                 "  --page-us <us>        Time taken to program a 256 byte page\n"
+                 "  --jobs <n>            Number of threads used for compression\n"
+                 "  --links <baud,...>    Baud rates to show the transfer time for\n";
+    exit(1);
+}
+
+//****************************************************************************
+tOptions parseOptions(int argc, char* argv[])
+{
+    tOptions options;
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        // Options that take a value
+        if((arg == "-o") || (arg == "-m") || (arg == "--app-version") ||
+           (arg == "--address") || (arg == "--max-length") ||
+           (arg == "--erase-ms") || (arg == "--page-us") ||
+           (arg == "--jobs") || (arg == "--links") ||
+           (arg == "--encrypt") || (arg == "--nonce"))
+        {
+            if(++i == argc)
+                usage(argv[0]);
+
+            if(arg == "-o")
+                options.output = argv[i];
+            else if(arg == "-m")
+                options.manifest = argv[i];
+            else if(arg == "--app-version")
+            {
+                options.appVersion = true;
+                options.version    = std::strtoul(argv[i], nullptr, 0);
+            }
+            else if(arg == "--address")
+                options.address = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--max-length")
+                options.maxLength = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--erase-ms")
+                options.eraseMs = std::strtod(argv[i], nullptr);
+            else if(arg == "--page-us")
+                options.pageUs = std::strtod(argv[i], nullptr);
+            else if(arg == "--jobs")
+                options.jobs = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--encrypt")
+            {
+                options.encrypt = true;
+
+                if(!parseHex(argv[i], options.key, sizeof(options.key)))
+                    usage(argv[0]);
+            }
+            else if(arg == "--nonce")
+            {
+                options.nonceSet = true;
+
+                if(!parseHex(argv[i], options.nonce, sizeof(options.nonce)))
+                    usage(argv[0]);
+            }
+            else
+                options.links = parseList(argv[i]);
+        }
+        else if(arg == "--compress")
+            options.compress = true;
+        else if((arg[0] == '-') || !options.input.empty())
+            usage(argv[0]);
+        else
+            options.input = arg;
+    }
+
+    // The flashloader decompresses straight out of the staged image so it
+    // can't be encrypted as well
+    if(options.input.empty() || (options.compress && options.encrypt))
+        usage(argv[0]);
+
+    // A nonce must never be used twice with the same key
+    if(options.encrypt && !options.nonceSet)
+    {
+        std::random_device random;
+
+        for(uint8_t& byte : options.nonce)
+            byte = random();
+    }
+
+    if(options.output.empty())
+        options.output = options.input.substr(0, options.input.rfind('.')) + ".img";
+
+    if(options.manifest.empty())
+        options.manifest = options.output + ".manifest";
+
+    return options;
+}
+
+} // namespace
+
+//****************************************************************************
+int main(int argc, char* argv[])
+{
+    tOptions options = parseOptions(argc, argv);
+    std::ifstream input(options.input, std::ios::binary);
+
+    if(!input)
+    {
+        std::perror(options.input.c_str());
+        return 1;
+    }
+
+    std::vector<uint8_t> app((std::istreambuf_iterator<char>(input)),
+                             std::istreambuf_iterator<char>());
+
+    if(isElf(app))
+        app = readElf(options.input, app, options.address);
+
+    if(app.size() < FLASH_PAGE_SIZE)
+    {
+        std::cerr << options.input << " is too small to be an application\n";
+        return 1;
+    }
+
+    // The flashloader would reject it anyway but better to find out now
+    if(options.maxLength && (app.size() > options.maxLength))
+    {
+        std::cerr << options.input << " is too large for the application partition ("
+                  << app.size() << " > " << options.maxLength << " bytes)\n";
+        return 1;
+    }
+
+    std::vector<uint8_t> image = buildImage(options, app);
+    std::ofstream output(options.output, std::ios::binary);
+
+    if(!output.write((const char*)image.data(), image.size()))
+    {
+        std::perror(options.output.c_str());
+        return 1;
+    }
+
+    std::printf("Written %s: %zu bytes (application %zu bytes)\n",
+                options.output.c_str(), image.size(), app.size());
+
+    writeManifest(options, app, image);
+    reportTransfer(options, image.size());
+    return 0;
+}
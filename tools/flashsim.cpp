@@ -0,0 +1,536 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Simulated device for trying out flashupload without any hardware.
+//
+// A pseudo-terminal is opened that behaves like the application's update
+// agent (see updateagent.c): images are checked in the same way and the
+// time taken to erase and program flash, and to send each frame over a UART
+// at the given baud rate, is simulated.  As on the real device, the UART
+// carries on receiving while flash is being programmed.  A percentage of the
+// received frames can be dropped to see how the uploader copes.
+//
+// After an UPDATE_REBOOT, the simulator goes quiet for as long as the
+// flashloader would take to flash the image and then reports the update as
+// the new application would.
+//
+// With '--count', several devices are simulated at once (each with its own
+// pseudo-terminal and thread) to try out updating devices in parallel.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <random>
+#include <string>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "flashloader.h"
+#include "flashcrc.h"
+#include "hostcrc.h"
+#include "updatelink.h"
+
+namespace
+{
+
+typedef std::chrono::steady_clock tClock;
+
+const uint32_t FLASH_PAGE_SIZE   = 256;
+const uint32_t FLASH_SECTOR_SIZE = 4096;
+const uint32_t RING_SIZE         = 4096;    // As UPDATE_AGENT_RING_BITS
+
+struct tOptions
+{
+    std::string link;                       // Symlink to the pseudo-terminal
+    unsigned    count      = 1;             // Number of devices
+    uint32_t    baud       = 115200;        // 0 for no UART delay
+    uint32_t    staging    = 1912 * 1024;   // Size of the staging partition
+    double      eraseMs    = 45.0;          // Typical 4k sector erase time
+    double      pageUs     = 400.0;         // Typical 256 byte page program time
+    double      bootMs     = 5.0;           // Application start-up time
+    double      drop       = 0.0;           // Percentage of frames dropped
+    bool        once       = false;
+};
+
+class tDevice
+{
+public:
+    tDevice(const tOptions& options, const std::string& name, int fd, unsigned seed) :
+        mOptions(options), mName(name), mFd(fd), mLink(fd), mRandom(seed) {}
+
+    // Returns when '--once' is given and an update has been reported
+    void run();
+
+private:
+    uint8_t begin(const tUpdateFrame& frame);
+    uint8_t write(const tUpdateFrame& frame);
+    uint8_t end();
+    double  flashUs() const;
+    void    reboot();
+    void    handle(const tUpdateFrame& frame);
+    void    respond(const tUpdateFrame& request, uint8_t status,
+                    uint32_t value0 = 0, uint32_t value1 = 0, uint32_t value2 = 0);
+    void    busy(double us);
+    void    log(const char* format, ...) const;
+    tClock::duration uartTime(size_t bytes) const;
+
+    const tOptions&      mOptions;
+    std::string          mName;
+    int                  mFd;
+    tUpdateLink          mLink;
+    std::mt19937         mRandom;
+
+    // When the last frame was completely received and when the CPU will
+    // have finished with the current one
+    tClock::time_point   mRxDone;
+    tClock::time_point   mCpuFree;
+
+    std::vector<uint8_t> mImage;
+    std::vector<bool>    mWritten;
+    bool                 mActive    = false;
+    bool                 mStaged    = false;
+    uint32_t             mPagesLeft = 0;
+    uint32_t             mSequence  = 0;
+    uint32_t             mStatus[3] = {};
+    bool                 mReported  = false;
+};
+
+//****************************************************************************
+// Print a message prefixed with the device's name
+void tDevice::log(const char* format, ...) const
+{
+    static std::mutex lock;
+    std::lock_guard<std::mutex> guard(lock);
+    va_list args;
+
+    va_start(args, format);
+    std::printf("%s: ", mName.c_str());
+    std::vprintf(format, args);
+    std::fflush(stdout);
+    va_end(args);
+}
+
+//****************************************************************************
+tClock::duration tDevice::uartTime(size_t bytes) const
+{
+    if(!mOptions.baud)
+        return tClock::duration::zero();
+
+    // 8N1, so ten bits per byte
+    return std::chrono::duration_cast<tClock::duration>(
+               std::chrono::duration<double>(bytes * 10.0 / mOptions.baud));
+}
+
+//****************************************************************************
+// The CPU is busy (programming flash) for the given time
+void tDevice::busy(double us)
+{
+    mCpuFree += std::chrono::duration_cast<tClock::duration>(std::chrono::duration<double, std::micro>(us));
+}
+
+//****************************************************************************
+void tDevice::respond(const tUpdateFrame& request, uint8_t status,
+                      uint32_t value0, uint32_t value1, uint32_t value2)
+{
+    tUpdateResponse response = { request.type, status, 0, { value0, value1, value2 } };
+
+    std::this_thread::sleep_until(mCpuFree);
+    mLink.send(UPDATE_RESPONSE, request.seq, &response, sizeof(response));
+}
+
+//****************************************************************************
+uint8_t tDevice::begin(const tUpdateFrame& frame)
+{
+    uint32_t length;
+
+    if(frame.length != sizeof(length))
+        return UPDATE_ERR_LENGTH;
+
+    std::memcpy(&length, frame.payload, sizeof(length));
+    uint32_t eraseLength = (length + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+
+    if((length < (sizeof(tFlashHeader) + FLASH_PAGE_SIZE)) || (eraseLength > mOptions.staging))
+        return UPDATE_ERR_LENGTH;
+
+    mImage.assign(length, 0xff);
+    mWritten.assign((length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE, false);
+    mPagesLeft = mWritten.size();
+    mActive    = true;
+    mStaged    = false;     // Staging another image replaces it
+    mSequence++;
+
+    busy(eraseLength / FLASH_SECTOR_SIZE * mOptions.eraseMs * 1000.0);
+    log("Receiving %u byte image\n", length);
+    return UPDATE_OK;
+}
+
+//****************************************************************************
+uint8_t tDevice::write(const tUpdateFrame& frame)
+{
+    uint32_t offset;
+
+    if(!mActive)
+        return UPDATE_ERR_STATE;
+
+    if(frame.length <= sizeof(offset))
+        return UPDATE_ERR_LENGTH;
+
+    std::memcpy(&offset, frame.payload, sizeof(offset));
+    uint32_t length = frame.length - sizeof(offset);
+    uint32_t index  = offset / FLASH_PAGE_SIZE;
+
+    // Only the last page may be short
+    if((offset % FLASH_PAGE_SIZE) || (offset >= mImage.size()) ||
+       (length != std::min<uint32_t>(mImage.size() - offset, FLASH_PAGE_SIZE)))
+        return UPDATE_ERR_OFFSET;
+
+    if(mWritten[index])
+        return UPDATE_OK;
+
+    std::memcpy(&mImage[offset], &frame.payload[sizeof(offset)], length);
+    mWritten[index] = true;
+    mPagesLeft--;
+
+    // The first page is only programmed at the end
+    if(index)
+        busy(mOptions.pageUs);
+
+    return UPDATE_OK;
+}
+
+//****************************************************************************
+// The same checks as the update agent
+uint8_t tDevice::end()
+{
+    tFlashHeader* header = reinterpret_cast<tFlashHeader*>(mImage.data());
+    bool found = false;
+
+    // A retry after the response was lost
+    if(!mActive)
+        return mStaged ? UPDATE_OK : UPDATE_ERR_STATE;
+
+    if(mPagesLeft ||
+       !flashHeaderValid(header, FLASH_PAGE_SIZE) ||
+       ((header->headerLength + header->length) != mImage.size()) ||
+       (flashCrc32(header->tlv, flashHeaderTlvLength(header), FLASH_CRC32_INIT) != header->tlvCrc32) ||
+       (hostCrc32(&mImage[header->headerLength], header->length, FLASH_CRC32_INIT) != header->crc32))
+        return UPDATE_ERR_IMAGE;
+
+    for(const tFlashTlv* tlv = flashTlvFirst(header); tlv; tlv = flashTlvNext(header, tlv))
+    {
+        if((tlv->type == FLASH_TLV_SEQUENCE) && (tlv->length == sizeof(uint32_t)) &&
+           flashTlvValid(header, tlv))
+        {
+            std::memcpy(const_cast<uint8_t*>(tlv->value), &mSequence, sizeof(mSequence));
+            found = true;
+        }
+    }
+
+    if(!found)
+        return UPDATE_ERR_IMAGE;
+
+    header->tlvCrc32 = flashCrc32(header->tlv, flashHeaderTlvLength(header), FLASH_CRC32_INIT);
+
+    // Read back for the CRC check, then the first page
+    busy(mImage.size() * 0.05 + mOptions.pageUs);
+
+    mActive = false;
+    mStaged = true;
+    log("Image staged (sequence %u)\n", mSequence);
+    return UPDATE_OK;
+}
+
+//****************************************************************************
+// Time the flashloader takes to copy the staged image over the application
+double tDevice::flashUs() const
+{
+    const tFlashHeader* header = reinterpret_cast<const tFlashHeader*>(mImage.data());
+    uint32_t rawLength = header->length;
+
+    for(const tFlashTlv* tlv = flashTlvFirst(header); tlv; tlv = flashTlvNext(header, tlv))
+    {
+        if((tlv->type == FLASH_TLV_COMPRESSION) && flashTlvValid(header, tlv))
+            rawLength = reinterpret_cast<const tFlashCompression*>(tlv->value)->rawLength;
+    }
+
+    return ((rawLength + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE) * mOptions.eraseMs * 1000.0 +
+           ((rawLength + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE) * mOptions.pageUs;
+}
+
+//****************************************************************************
+// Disappear for as long as the flashloader would take to copy the image
+// over the application, then start again as the new application
+void tDevice::reboot()
+{
+    double us = flashUs();
+
+    log("Rebooting: flashing takes %.3fs\n", us / 1e6);
+
+    busy(us + mOptions.bootMs * 1000.0);
+    std::this_thread::sleep_until(mCpuFree);
+
+    // Anything sent while we were away is lost
+    tcflush(mFd, TCIFLUSH);
+    mLink.flush();
+
+    mActive    = false;
+    mStaged    = false;
+    mStatus[0] = 1;
+    mStatus[1] = static_cast<uint32_t>(us);
+    mStatus[2] = static_cast<uint32_t>(mOptions.bootMs * 1000.0);
+    log("New application running\n");
+}
+
+//****************************************************************************
+void tDevice::handle(const tUpdateFrame& frame)
+{
+    if(std::uniform_real_distribution<double>(0.0, 100.0)(mRandom) < mOptions.drop)
+        return;
+
+    mCpuFree = std::max(mCpuFree, mRxDone);
+
+    switch(frame.type)
+    {
+        case UPDATE_PING:
+            respond(frame, UPDATE_OK, UPDATE_PROTOCOL_VERSION, RING_SIZE);
+            break;
+
+        case UPDATE_BEGIN:
+        {
+            uint8_t status = begin(frame);
+            respond(frame, status);
+            break;
+        }
+
+        case UPDATE_DATA:
+        {
+            uint8_t status = write(frame);
+            respond(frame, status);
+            break;
+        }
+
+        case UPDATE_END:
+        {
+            uint8_t status = end();
+
+            // The device predicts its downtime from the same times
+            respond(frame, status, mSequence,
+                    mStaged ? static_cast<uint32_t>(flashUs() + mOptions.bootMs * 1000.0) : 0);
+            break;
+        }
+
+        case UPDATE_REBOOT:
+            if(!mStaged)
+            {
+                respond(frame, UPDATE_ERR_STATE);
+                break;
+            }
+
+            respond(frame, UPDATE_OK);
+            reboot();
+            break;
+
+        case UPDATE_STATUS:
+            respond(frame, UPDATE_OK, mStatus[0], mStatus[1], mStatus[2]);
+            mReported = mStatus[0];
+            break;
+
+        default:
+            respond(frame, UPDATE_ERR_TYPE);
+            break;
+    }
+}
+
+//****************************************************************************
+void tDevice::run()
+{
+    mRxDone  = tClock::now();
+    mCpuFree = mRxDone;
+
+    while(!(mOptions.once && mReported))
+    {
+        tUpdateFrame frame;
+        struct pollfd pfd = { mFd, POLLIN, 0 };
+
+        // If there's nothing waiting, the next frame is only just being sent
+        // by the host.  Otherwise it was queued up behind the previous one.
+        bool queued = mLink.pending() || (poll(&pfd, 1, 0) > 0);
+
+        if(!mLink.receive(frame, 1000))
+            continue;
+
+        tClock::time_point arrived = queued ? mRxDone : tClock::now();
+
+        mRxDone = std::max(mRxDone, arrived) + uartTime(updateFrameLength(&frame));
+        std::this_thread::sleep_until(mRxDone);
+        handle(frame);
+    }
+}
+
+//****************************************************************************
+void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [options]\n"
+                 "  --link <path>         Create a symlink to the pseudo-terminal (with\n"
+                 "                        the device number appended with --count)\n"
+                 "  --count <n>           Number of devices to simulate\n"
+                 "  --baud <baud>         UART speed to simulate (0 for none)\n"
+                 "  --staging <n>         Size of the staging partition\n"
+                 "  --erase-ms <ms>       Time taken to erase a 4k sector\n"
+                 "  --page-us <us>        Time taken to program a 256 byte page\n"
+                 "  --boot-ms <ms>        Application start-up time\n"
+                 "  --drop <percent>      Percentage of received frames to drop\n"
+                 "  --once                Exit once an update has been reported\n";
+    exit(1);
+}
+
+//****************************************************************************
+tOptions parseOptions(int argc, char* argv[])
+{
+    tOptions options;
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        // Options that take a value
+        if((arg == "--link") || (arg == "--count") || (arg == "--baud") || (arg == "--staging") ||
+           (arg == "--erase-ms") || (arg == "--page-us") ||
+           (arg == "--boot-ms") || (arg == "--drop"))
+        {
+            if(++i == argc)
+                usage(argv[0]);
+
+            if(arg == "--link")
+                options.link = argv[i];
+            else if(arg == "--count")
+                options.count = std::max(1ul, std::strtoul(argv[i], nullptr, 0));
+            else if(arg == "--baud")
+                options.baud = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--staging")
+                options.staging = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--erase-ms")
+                options.eraseMs = std::strtod(argv[i], nullptr);
+            else if(arg == "--page-us")
+                options.pageUs = std::strtod(argv[i], nullptr);
+            else if(arg == "--boot-ms")
+                options.bootMs = std::strtod(argv[i], nullptr);
+            else
+                options.drop = std::strtod(argv[i], nullptr);
+        }
+        else if(arg == "--once")
+            options.once = true;
+        else
+            usage(argv[0]);
+    }
+
+    return options;
+}
+
+//****************************************************************************
+// Open a pseudo-terminal for a device.  Returns false on error.
+bool openPty(const std::string& link, int& master, int& slave, std::string& name)
+{
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0))
+    {
+        std::perror("posix_openpt");
+        return false;
+    }
+
+    name = ptsname(master);
+
+    // Keep the slave open ourselves so the master doesn't see a hang-up
+    // between uploads, and make sure nothing gets translated on the way
+    slave = open(name.c_str(), O_RDWR | O_NOCTTY);
+
+    if((slave < 0) || !setRaw(slave, 115200))
+    {
+        std::perror(name.c_str());
+        return false;
+    }
+
+    if(!link.empty())
+    {
+        unlink(link.c_str());
+
+        if(symlink(name.c_str(), link.c_str()) != 0)
+        {
+            std::perror(link.c_str());
+            return false;
+        }
+
+        name = link;
+    }
+
+    return true;
+}
+
+} // namespace
+
+//****************************************************************************
+int main(int argc, char* argv[])
+{
+    tOptions options = parseOptions(argc, argv);
+    std::vector<std::unique_ptr<tDevice>> devices;
+    std::vector<std::thread> threads;
+    std::vector<int> fds;
+    std::vector<std::string> links;
+
+    for(unsigned i = 0; i < options.count; i++)
+    {
+        std::string link = options.link;
+        std::string name;
+        int master;
+        int slave;
+
+        if(!link.empty() && (options.count > 1))
+            link += std::to_string(i);
+
+        if(!openPty(link, master, slave, name))
+            return 1;
+
+        std::printf("Simulated device on %s\n", name.c_str());
+
+        devices.emplace_back(new tDevice(options, name, master, i + 1));
+        fds.push_back(master);
+        fds.push_back(slave);
+        links.push_back(link);
+    }
+
+    std::fflush(stdout);
+
+    for(auto& device : devices)
+        threads.emplace_back(&tDevice::run, device.get());
+
+    for(std::thread& thread : threads)
+        thread.join();
+
+    // Anything not yet read by the host is lost when the master is closed
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    for(const std::string& link : links)
+    {
+        if(!link.empty())
+            unlink(link.c_str());
+    }
+
+    for(int fd : fds)
+        close(fd);
+
+    return 0;
+}
@@ -0,0 +1,752 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Host tool to send an update image (built by flashpack) to the application's
+// update agent over one or more serial ports and reboot into it.
+//
+// Rather than sending a page and waiting for it to be acknowledged, up to
+// '--window' pages are kept in flight so the link stays busy while the device
+// programs flash.  Each page carries its offset in the image so any page that
+// isn't acknowledged in time is simply sent again.
+//
+// Any number of devices can be updated at once (give '-p' for each port).
+// Every device has its own state machine and they are all driven from a
+// single epoll loop, sharing one read-only mapping of the image.
+//
+// While sending, the combined throughput and number of retries is shown and,
+// at the end, how long each phase of the update took on each device,
+// including the downtime the device predicted once the image was staged and
+// the time it actually spent in the flashloader and starting the new
+// application.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "flashloader.h"
+#include "updatelink.h"
+
+namespace
+{
+
+typedef std::chrono::steady_clock tClock;
+
+struct tOptions
+{
+    std::string              image;
+    std::vector<std::string> ports;
+    uint32_t    baud       = 115200;
+    unsigned    window     = 8;         // Pages in flight
+    int         timeoutMs  = 1000;      // Before a request is sent again
+    unsigned    retries    = 10;        // Per request
+    int         bootMs     = 30000;     // Time allowed for the device to restart
+    double      eraseMs    = 100.0;     // Worst case 4k sector erase time
+    bool        reboot     = true;
+};
+
+// The update image, mapped read-only and shared by all devices
+struct tImage
+{
+    const uint8_t* data = nullptr;
+    size_t         size = 0;
+};
+
+// Phases of an update, in order
+enum ePhase
+{
+    PHASE_CONNECT,
+    PHASE_ERASE,
+    PHASE_TRANSFER,
+    PHASE_STAGE,
+    PHASE_REBOOT,
+    PHASE_DONE,
+    PHASE_FAILED
+};
+
+const char* const PHASE_NAMES[] = { "connect", "erase", "transfer", "stage", "reboot" };
+
+const int PING_MS     = 200;        // Between pings while connecting
+const int PING_TRIES  = 25;
+const int STATUS_MS   = 250;        // Between status requests after a reboot
+
+//****************************************************************************
+int msUntil(tClock::time_point time)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(time - tClock::now()).count();
+}
+
+//****************************************************************************
+const char* statusText(uint8_t status)
+{
+    switch(status)
+    {
+        case UPDATE_OK:         return "OK";
+        case UPDATE_ERR_TYPE:   return "unknown request";
+        case UPDATE_ERR_STATE:  return "not expected now";
+        case UPDATE_ERR_LENGTH: return "bad length";
+        case UPDATE_ERR_OFFSET: return "bad offset";
+        case UPDATE_ERR_IMAGE:  return "image rejected";
+        default:                return "unknown error";
+    }
+}
+
+// Update of a single device.  Nothing here blocks: the event loop calls
+// service() whenever the port is readable or writable or the deadline has
+// passed.
+class tSession
+{
+public:
+    tSession(const tOptions& options, const tImage& image, const std::string& port, int fd);
+
+    void service();
+
+    int                fd() const       { return mFd; }
+    const std::string& port() const     { return mPort; }
+    bool               writing() const  { return mLink.writing(); }
+    bool               finished() const { return mPhase >= PHASE_DONE; }
+    tClock::time_point deadline() const;
+    void               report() const;
+
+    uint64_t           bytesDone() const;
+    unsigned           retries() const  { return mRetries; }
+    bool               failed() const   { return mPhase == PHASE_FAILED; }
+
+private:
+    struct tInFlight
+    {
+        uint32_t           page;
+        tClock::time_point sent;
+    };
+
+    void request(uint8_t type, const void* payload, uint16_t length, int timeoutMs, unsigned tries);
+    void handle(const tUpdateFrame& frame, const tUpdateResponse& response);
+    void timeout();
+    void sendPages();
+    void waitForBoot();
+    void nextPhase(ePhase phase);
+    void fail(const std::string& reason);
+
+    const tOptions&       mOptions;
+    const tImage&         mImage;
+    std::string           mPort;
+    int                   mFd;
+    tUpdateLink           mLink;
+    ePhase                mPhase   = PHASE_CONNECT;
+    uint16_t              mSeq     = 0;
+    unsigned              mRetries = 0;
+    unsigned              mWindow;
+    std::string           mError;
+    tClock::time_point    mPhaseStart;
+    double                mPhaseTime[PHASE_DONE] = {};
+    uint32_t              mDeviceUs[2] = {};   // Flashloader and start-up
+    uint32_t              mPredictedUs = 0;    // Downtime predicted by the device
+
+    // The single outstanding request outside the transfer phase
+    uint8_t               mType    = 0;
+    uint16_t              mReqSeq  = 0;
+    std::vector<uint8_t>  mPayload;
+    int                   mTimeoutMs = 0;
+    unsigned              mTries   = 0;
+    tClock::time_point    mDeadline;
+    tClock::time_point    mBootDeadline;
+
+    // Transfer state
+    uint32_t              mPages   = 0;
+    uint32_t              mLeft    = 0;
+    std::vector<unsigned> mPageTries;
+    std::vector<bool>     mDone;
+    std::deque<uint32_t>  mQueue;
+    std::map<uint16_t, tInFlight> mInFlight;    // By sequence number
+};
+
+//****************************************************************************
+tSession::tSession(const tOptions& options, const tImage& image, const std::string& port, int fd) :
+    mOptions(options), mImage(image), mPort(port), mFd(fd), mLink(fd), mWindow(options.window)
+{
+    mPages = (image.size + UPDATE_PAGE_SIZE - 1) / UPDATE_PAGE_SIZE;
+    mLeft  = mPages;
+    mPageTries.assign(mPages, 0);
+    mDone.assign(mPages, false);
+
+    for(uint32_t page = 0; page < mPages; page++)
+        mQueue.push_back(page);
+
+    mPhaseStart = tClock::now();
+
+    // Keep trying for a while in case the device is still starting up
+    request(UPDATE_PING, nullptr, 0, PING_MS, PING_TRIES);
+}
+
+//****************************************************************************
+void tSession::fail(const std::string& reason)
+{
+    if(!finished())
+    {
+        mError = reason;
+        mPhase = PHASE_FAILED;
+    }
+}
+
+//****************************************************************************
+void tSession::nextPhase(ePhase phase)
+{
+    mPhaseTime[mPhase] = std::chrono::duration<double>(tClock::now() - mPhaseStart).count();
+    mPhaseStart = tClock::now();
+    mPhase = phase;
+}
+
+//****************************************************************************
+uint64_t tSession::bytesDone() const
+{
+    return std::min<uint64_t>(uint64_t(mPages - mLeft) * UPDATE_PAGE_SIZE, mImage.size);
+}
+
+//****************************************************************************
+tClock::time_point tSession::deadline() const
+{
+    if(mPhase != PHASE_TRANSFER)
+        return mDeadline;
+
+    tClock::time_point oldest = tClock::time_point::max();
+
+    for(const auto& entry : mInFlight)
+        oldest = std::min(oldest, entry.second.sent);
+
+    return (oldest == tClock::time_point::max()) ? oldest :
+           oldest + std::chrono::milliseconds(mOptions.timeoutMs);
+}
+
+//****************************************************************************
+// Send a request that is sent again if there's no response in time
+void tSession::request(uint8_t type, const void* payload, uint16_t length, int timeoutMs, unsigned tries)
+{
+    const uint8_t* data = static_cast<const uint8_t*>(payload);
+
+    mType      = type;
+    mPayload.assign(data, data + length);
+    mTimeoutMs = timeoutMs;
+    mTries     = tries;
+    mReqSeq    = mSeq++;
+    mDeadline  = tClock::now() + std::chrono::milliseconds(timeoutMs);
+
+    if(!mLink.send(type, mReqSeq, mPayload.data(), length))
+        fail("link failed");
+}
+
+//****************************************************************************
+// Keep the window full
+void tSession::sendPages()
+{
+    uint8_t payload[UPDATE_MAX_PAYLOAD];
+
+    while((mInFlight.size() < mWindow) && !mQueue.empty())
+    {
+        uint32_t page = mQueue.front();
+        uint32_t offset = page * UPDATE_PAGE_SIZE;
+        uint16_t length = std::min<size_t>(UPDATE_PAGE_SIZE, mImage.size - offset);
+
+        mQueue.pop_front();
+
+        // Might have been acknowledged late after being queued again
+        if(mDone[page])
+            continue;
+
+        if(++mPageTries[page] > mOptions.retries)
+        {
+            fail("page at offset " + std::to_string(offset) + " not acknowledged");
+            return;
+        }
+
+        std::memcpy(payload, &offset, sizeof(offset));
+        std::memcpy(&payload[sizeof(offset)], &mImage.data[offset], length);
+
+        if(!mLink.send(UPDATE_DATA, mSeq, payload, sizeof(offset) + length))
+        {
+            fail("link failed");
+            return;
+        }
+
+        mInFlight[mSeq++] = { page, tClock::now() };
+    }
+}
+
+//****************************************************************************
+// Ask the new application how it got on.  Anything the old one sent before
+// rebooting is of no interest now.
+void tSession::waitForBoot()
+{
+    mLink.flush();
+    mBootDeadline = tClock::now() + std::chrono::milliseconds(mOptions.bootMs);
+    request(UPDATE_STATUS, nullptr, 0, STATUS_MS, 1);
+}
+
+//****************************************************************************
+void tSession::handle(const tUpdateFrame& frame, const tUpdateResponse& response)
+{
+    if(mPhase == PHASE_TRANSFER)
+    {
+        auto pending = mInFlight.find(frame.seq);
+
+        if(pending == mInFlight.end())
+            return;
+
+        if(response.status != UPDATE_OK)
+        {
+            fail("page at offset " + std::to_string(pending->second.page * UPDATE_PAGE_SIZE) +
+                 " refused: " + statusText(response.status));
+            return;
+        }
+
+        if(!mDone[pending->second.page])
+        {
+            mDone[pending->second.page] = true;
+            mLeft--;
+        }
+
+        mInFlight.erase(pending);
+
+        if(mLeft == 0)
+        {
+            nextPhase(PHASE_STAGE);
+            request(UPDATE_END, nullptr, 0, mOptions.timeoutMs + 1000, mOptions.retries);
+        }
+        else
+            sendPages();
+
+        return;
+    }
+
+    // Skip any late responses to earlier requests
+    if((frame.seq != mReqSeq) || (response.request != mType))
+        return;
+
+    switch(mPhase)
+    {
+        case PHASE_CONNECT:
+        {
+            // Don't send more than the device can buffer
+            unsigned window = std::max<unsigned>(1, response.value[1] / (UPDATE_FRAME_OVERHEAD + UPDATE_MAX_PAYLOAD));
+            uint32_t length = mImage.size;
+
+            mWindow = std::min(mWindow, window);
+            nextPhase(PHASE_ERASE);
+
+            // The response only comes once the staging area has been erased
+            request(UPDATE_BEGIN, &length, sizeof(length),
+                    mOptions.timeoutMs + int(mOptions.eraseMs * ((length + 4095) / 4096)), mOptions.retries);
+            break;
+        }
+
+        case PHASE_ERASE:
+            if(response.status != UPDATE_OK)
+                fail(std::string("device refused the image: ") + statusText(response.status));
+            else
+            {
+                nextPhase(PHASE_TRANSFER);
+                sendPages();
+            }
+            break;
+
+        case PHASE_STAGE:
+            mPredictedUs = response.value[1];
+
+            if(response.status != UPDATE_OK)
+                fail(std::string("image not staged: ") + statusText(response.status));
+            else if(!mOptions.reboot)
+                nextPhase(PHASE_DONE);
+            else
+            {
+                nextPhase(PHASE_REBOOT);
+                request(UPDATE_REBOOT, nullptr, 0, mOptions.timeoutMs, mOptions.retries);
+            }
+            break;
+
+        case PHASE_REBOOT:
+            if(response.request == UPDATE_REBOOT)
+            {
+                // If the OK to an earlier attempt was lost, the new
+                // application (with nothing to commit) answers the retry
+                if((response.status != UPDATE_OK) && (response.status != UPDATE_ERR_STATE))
+                {
+                    fail(std::string("device did not reboot: ") + statusText(response.status));
+                    break;
+                }
+
+                waitForBoot();
+            }
+            else if((response.status == UPDATE_OK) && response.value[0])
+            {
+                mDeviceUs[0] = response.value[1];
+                mDeviceUs[1] = response.value[2];
+                nextPhase(PHASE_DONE);
+            }
+            else
+                request(UPDATE_STATUS, nullptr, 0, STATUS_MS, 1);
+            break;
+
+        default:
+            break;
+    }
+}
+
+//****************************************************************************
+void tSession::timeout()
+{
+    tClock::time_point now = tClock::now();
+
+    if(mPhase == PHASE_TRANSFER)
+    {
+        // Anything not acknowledged in time gets sent again ahead of the rest
+        for(auto it = mInFlight.begin(); it != mInFlight.end(); )
+        {
+            if((now - it->second.sent) >= std::chrono::milliseconds(mOptions.timeoutMs))
+            {
+                mRetries++;
+                mQueue.push_front(it->second.page);
+                it = mInFlight.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        sendPages();
+        return;
+    }
+
+    if(now < mDeadline)
+        return;
+
+    // Waiting for the new application to start
+    if((mPhase == PHASE_REBOOT) && (mType == UPDATE_STATUS))
+    {
+        if(now >= mBootDeadline)
+            fail("device did not report a successful update");
+        else
+            request(UPDATE_STATUS, nullptr, 0, STATUS_MS, 1);
+
+        return;
+    }
+
+    // Retries sent while the device is in the flashloader go unanswered
+    // so it may well have rebooted after the first
+    if((mPhase == PHASE_REBOOT) && (mTries == 1))
+    {
+        waitForBoot();
+        return;
+    }
+
+    if(--mTries == 0)
+    {
+        fail((mPhase == PHASE_CONNECT) ? "no response" :
+             std::string("no response in phase ") + PHASE_NAMES[mPhase]);
+        return;
+    }
+
+    mRetries++;
+    mReqSeq   = mSeq++;
+    mDeadline = now + std::chrono::milliseconds(mTimeoutMs);
+
+    if(!mLink.send(mType, mReqSeq, mPayload.data(), mPayload.size()))
+        fail("link failed");
+}
+
+//****************************************************************************
+void tSession::service()
+{
+    tUpdateFrame frame;
+
+    if(finished())
+        return;
+
+    if(!mLink.writeAvailable() || !mLink.readAvailable())
+    {
+        fail("link failed");
+        return;
+    }
+
+    while(!finished() && mLink.next(frame))
+    {
+        tUpdateResponse response;
+
+        if((frame.type != UPDATE_RESPONSE) || (frame.length != sizeof(response)))
+            continue;
+
+        std::memcpy(&response, frame.payload, sizeof(response));
+        handle(frame, response);
+    }
+
+    if(!finished())
+        timeout();
+}
+
+//****************************************************************************
+void tSession::report() const
+{
+    std::printf("%-20s", mPort.c_str());
+
+    for(int phase = PHASE_CONNECT; phase < PHASE_DONE; phase++)
+        std::printf(" %8.3f", mPhaseTime[phase]);
+
+    std::printf(" %9.3f %8.3f %8.3f %7u  %s\n", mPredictedUs / 1e6,
+                mDeviceUs[0] / 1e6, mDeviceUs[1] / 1e6, mRetries,
+                failed() ? mError.c_str() : "OK");
+}
+
+//****************************************************************************
+// Map the image and check it looks like an update image
+bool mapImage(const std::string& filename, tImage& image)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat info;
+
+    if((fd < 0) || (fstat(fd, &info) != 0))
+    {
+        std::perror(filename.c_str());
+        return false;
+    }
+
+    image.size = info.st_size;
+    void* data = (image.size >= sizeof(tFlashHeader)) ?
+                 mmap(nullptr, image.size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+    close(fd);
+
+    tFlashHeader header;
+
+    // Catch the obvious mistake of sending the application instead
+    if((data == MAP_FAILED) ||
+       (std::memcpy(&header, data, sizeof(header)), !flashHeaderValid(&header, image.size)) ||
+       ((header.headerLength + header.length) != image.size))
+    {
+        std::cerr << filename << " is not an update image (see flashpack)\n";
+        return false;
+    }
+
+    image.data = static_cast<const uint8_t*>(data);
+    return true;
+}
+
+//****************************************************************************
+// Update all devices, returning the number that failed
+unsigned run(const tOptions& options, const tImage& image)
+{
+    std::vector<std::unique_ptr<tSession>> sessions;
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    tClock::time_point start = tClock::now();
+    tClock::time_point lastProgress = start;
+    size_t active = 0;
+
+    if(epoll < 0)
+    {
+        std::perror("epoll_create1");
+        return options.ports.size();
+    }
+
+    for(const std::string& port : options.ports)
+    {
+        int fd = openSerial(port, options.baud, true);
+
+        if(fd < 0)
+        {
+            std::perror(port.c_str());
+            continue;
+        }
+
+        struct epoll_event event = {};
+        event.events   = EPOLLIN;
+        event.data.u32 = sessions.size();
+
+        sessions.emplace_back(new tSession(options, image, port, fd));
+        epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+        active++;
+    }
+
+    std::vector<bool> polling(sessions.size(), true);
+    std::vector<bool> writing(sessions.size(), false);
+
+    while(active)
+    {
+        tClock::time_point deadline = tClock::now() + std::chrono::milliseconds(200);
+        struct epoll_event events[64];
+
+        for(const auto& session : sessions)
+        {
+            if(!session->finished())
+                deadline = std::min(deadline, session->deadline());
+        }
+
+        int count = epoll_wait(epoll, events, 64, std::max(0, msUntil(deadline) + 1));
+
+        for(int i = 0; i < count; i++)
+            sessions[events[i].data.u32]->service();
+
+        // Timeouts
+        for(const auto& session : sessions)
+        {
+            if(!session->finished() && (session->deadline() <= tClock::now()))
+                session->service();
+        }
+
+        uint64_t bytes   = 0;
+        unsigned retries = 0;
+
+        for(size_t i = 0; i < sessions.size(); i++)
+        {
+            tSession& session = *sessions[i];
+
+            bytes   += session.bytesDone();
+            retries += session.retries();
+
+            if(session.finished() && polling[i])
+            {
+                epoll_ctl(epoll, EPOLL_CTL_DEL, session.fd(), nullptr);
+                close(session.fd());
+                polling[i] = false;
+                active--;
+            }
+            else if(polling[i] && (session.writing() != writing[i]))
+            {
+                // Only ask to be told about the port being writable while
+                // there's something waiting to be written
+                struct epoll_event event = {};
+                event.events   = session.writing() ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+                event.data.u32 = i;
+
+                epoll_ctl(epoll, EPOLL_CTL_MOD, session.fd(), &event);
+                writing[i] = session.writing();
+            }
+        }
+
+        // Don't spend all our time writing to the terminal
+        double seconds = std::chrono::duration<double>(tClock::now() - start).count();
+
+        if(!active || (std::chrono::duration<double>(tClock::now() - lastProgress).count() >= 0.2))
+        {
+            lastProgress = tClock::now();
+            std::fprintf(stderr, "\r%zu/%zu devices finished  %llu bytes  %7.1f kB/s  %u retries ",
+                         sessions.size() - active, sessions.size(), (unsigned long long)bytes,
+                         (seconds > 0) ? (bytes / seconds / 1024.0) : 0.0, retries);
+        }
+    }
+
+    close(epoll);
+    std::fprintf(stderr, "\n");
+
+    std::printf("\n%-20s", "Port");
+    for(const char* name : PHASE_NAMES)
+        std::printf(" %8s", name);
+    std::printf(" %9s %8s %8s %7s  Result\n", "predicted", "loader", "start-up", "retries");
+
+    unsigned failed = options.ports.size() - sessions.size();
+    uint64_t bytes = 0;
+
+    for(const auto& session : sessions)
+    {
+        session->report();
+        bytes  += session->bytesDone();
+        failed += session->failed();
+    }
+
+    double seconds = std::chrono::duration<double>(tClock::now() - start).count();
+
+    std::printf("\nTimes in seconds (predicted downtime, loader and start-up as reported by the device)\n"
+                "%zu of %zu devices updated in %.3fs, %llu bytes sent at %.1f kB/s overall\n",
+                options.ports.size() - failed, options.ports.size(), seconds,
+                (unsigned long long)bytes, bytes / seconds / 1024.0);
+
+    return failed;
+}
+
+//****************************************************************************
+void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [options] -p <port> [-p <port>...] <image>\n"
+                 "  -p <port>             Serial port (or pseudo-terminal) of a device\n"
+                 "  -b <baud>             Baud rate (default 115200)\n"
+                 "  --window <n>          Number of pages in flight (default 8)\n"
+                 "  --timeout <ms>        Time before a request is sent again\n"
+                 "  --retries <n>         Attempts per request before giving up\n"
+                 "  --erase-ms <ms>       Worst case time to erase a 4k sector\n"
+                 "  --boot-ms <ms>        Time allowed for the device to restart\n"
+                 "  --no-reboot           Stage the image but don't reboot\n";
+    exit(1);
+}
+
+//****************************************************************************
+tOptions parseOptions(int argc, char* argv[])
+{
+    tOptions options;
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        // Options that take a value
+        if((arg == "-p") || (arg == "-b") || (arg == "--window") ||
+           (arg == "--timeout") || (arg == "--retries") ||
+           (arg == "--erase-ms") || (arg == "--boot-ms"))
+        {
+            if(++i == argc)
+                usage(argv[0]);
+
+            if(arg == "-p")
+                options.ports.push_back(argv[i]);
+            else if(arg == "-b")
+                options.baud = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--window")
+                options.window = std::max(1ul, std::strtoul(argv[i], nullptr, 0));
+            else if(arg == "--timeout")
+                options.timeoutMs = std::strtol(argv[i], nullptr, 0);
+            else if(arg == "--retries")
+                options.retries = std::max(1ul, std::strtoul(argv[i], nullptr, 0));
+            else if(arg == "--erase-ms")
+                options.eraseMs = std::strtod(argv[i], nullptr);
+            else
+                options.bootMs = std::strtol(argv[i], nullptr, 0);
+        }
+        else if(arg == "--no-reboot")
+            options.reboot = false;
+        else if((arg[0] == '-') || !options.image.empty())
+            usage(argv[0]);
+        else
+            options.image = arg;
+    }
+
+    if(options.image.empty() || options.ports.empty())
+        usage(argv[0]);
+
+    return options;
+}
+
+} // namespace
+
+//****************************************************************************
+int main(int argc, char* argv[])
+{
+    tOptions options = parseOptions(argc, argv);
+    tImage image;
+
+    if(!mapImage(options.image, image))
+        return 1;
+
+    unsigned failed = run(options, image);
+
+    munmap(const_cast<uint8_t*>(image.data), image.size);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,157 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Fast CRC32 for the host tools.  See hostcrc.h for details.
+//
+// The folding works on the message as a polynomial over GF(2) with the first
+// bit of the first byte as the highest power (as the CRC isn't reflected).
+// Byte-swapping each 16-byte block puts it into a 128-bit register the same
+// way round.  A block A followed 'n' bits later by another is worth
+// A * x^n, so the running value can be moved along by multiplying each half
+// by x^n (mod P) and adding the next block, keeping everything congruent to
+// the message mod P.  Four blocks are folded in parallel to keep the
+// multiplier busy.
+//
+// At the end, the 128-bit value left over is congruent to the data folded so
+// far, and the CRC of that (starting from zero) is the same as the CRC of
+// the data itself, so it's simply run through the table version along with
+// any bytes that didn't fill a block.
+
+#include "hostcrc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define HOSTCRC_CLMUL 1
+#else
+    #define HOSTCRC_CLMUL 0
+#endif
+
+namespace
+{
+
+//****************************************************************************
+// x^n mod P, worked out at compile time
+constexpr uint64_t xPowMod(unsigned n)
+{
+    uint64_t value = 1;
+
+    while(n--)
+    {
+        value <<= 1;
+
+        if(value & 0x100000000ull)
+            value ^= 0x100000000ull | FLASH_CRC32_POLY;
+    }
+
+    return value;
+}
+
+static_assert(xPowMod(32) == FLASH_CRC32_POLY, "x^32 mod P should be the polynomial");
+
+#if HOSTCRC_CLMUL
+
+//****************************************************************************
+// Multiply each half of 'value' by the matching constant and add them
+__attribute__((target("pclmul,ssse3")))
+inline __m128i fold(__m128i value, __m128i constants)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(value, constants, 0x00),
+                         _mm_clmulepi64_si128(value, constants, 0x11));
+}
+
+//****************************************************************************
+__attribute__((target("pclmul,ssse3")))
+inline __m128i load(const uint8_t* data, __m128i swap)
+{
+    return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), swap);
+}
+
+#endif
+
+} // namespace
+
+//****************************************************************************
+bool hostCrc32HasClmul()
+{
+#if HOSTCRC_CLMUL
+    static const bool supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+
+    return supported;
+#else
+    return false;
+#endif
+}
+
+//****************************************************************************
+#if HOSTCRC_CLMUL
+__attribute__((target("pclmul,ssse3")))
+#endif
+uint32_t hostCrc32Clmul(const void* data, size_t length, uint32_t crc)
+{
+#if HOSTCRC_CLMUL
+    const uint8_t* ptr = static_cast<const uint8_t*>(data);
+
+    // Not worth it for less than a couple of rounds
+    if(length < 128)
+        return flashCrc32(data, length, crc);
+
+    // Lower half multiplies the low 64 bits and upper half the high 64 bits
+    // of a block that has to be moved along by 128 or 512 bits
+    const __m128i swap   = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i by128  = _mm_set_epi64x(xPowMod(128 + 64), xPowMod(128));
+    const __m128i by512  = _mm_set_epi64x(xPowMod(512 + 64), xPowMod(512));
+
+    __m128i x0 = load(ptr, swap);
+    __m128i x1 = load(ptr + 16, swap);
+    __m128i x2 = load(ptr + 32, swap);
+    __m128i x3 = load(ptr + 48, swap);
+
+    // Starting from 'crc' is the same as starting from zero with the first
+    // 32 bits of the data inverted by it
+    x0 = _mm_xor_si128(x0, _mm_set_epi32(crc, 0, 0, 0));
+    ptr    += 64;
+    length -= 64;
+
+    while(length >= 64)
+    {
+        x0 = _mm_xor_si128(fold(x0, by512), load(ptr, swap));
+        x1 = _mm_xor_si128(fold(x1, by512), load(ptr + 16, swap));
+        x2 = _mm_xor_si128(fold(x2, by512), load(ptr + 32, swap));
+        x3 = _mm_xor_si128(fold(x3, by512), load(ptr + 48, swap));
+        ptr    += 64;
+        length -= 64;
+    }
+
+    // Down to one block
+    x1 = _mm_xor_si128(fold(x0, by128), x1);
+    x2 = _mm_xor_si128(fold(x1, by128), x2);
+    x3 = _mm_xor_si128(fold(x2, by128), x3);
+
+    while(length >= 16)
+    {
+        x3 = _mm_xor_si128(fold(x3, by128), load(ptr, swap));
+        ptr    += 16;
+        length -= 16;
+    }
+
+    uint8_t rest[16];
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(rest), _mm_shuffle_epi8(x3, swap));
+    crc = flashCrc32(rest, sizeof(rest), 0);
+
+    return flashCrc32(ptr, length, crc);
+#else
+    return flashCrc32(data, length, crc);
+#endif
+}
+
+//****************************************************************************
+uint32_t hostCrc32(const void* data, size_t length, uint32_t crc)
+{
+    if(hostCrc32HasClmul())
+        return hostCrc32Clmul(data, length, crc);
+
+    return flashCrc32(data, length, crc);
+}
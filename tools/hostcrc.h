@@ -0,0 +1,34 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Fast CRC32 for the host tools when handling whole images.  This gives
+// exactly the same result as the RP2040's DMA sniffer and flashcrc.h
+// (polynomial 0x04C11DB7, not reflected, no final XOR) but, on x86 CPUs with
+// carry-less multiply (PCLMULQDQ), folds 64 bytes at a time.  Everything
+// else uses the slice-by-8 tables from flashcrc.h.
+
+#ifndef __TOOLS_HOSTCRC_INCL__
+#define __TOOLS_HOSTCRC_INCL__
+
+#include <cstddef>
+#include <cstdint>
+
+#include "flashcrc.h"
+
+//****************************************************************************
+// Continue the CRC 'crc' over 'length' bytes of 'data' (start with
+// FLASH_CRC32_INIT) using the fastest implementation this CPU supports
+uint32_t hostCrc32(const void* data, size_t length, uint32_t crc);
+
+//****************************************************************************
+// The carry-less multiply version.  Only call this if
+// hostCrc32HasClmul() returns true.
+uint32_t hostCrc32Clmul(const void* data, size_t length, uint32_t crc);
+
+//****************************************************************************
+// True if the CPU supports hostCrc32Clmul
+bool hostCrc32HasClmul();
+
+#endif // __TOOLS_HOSTCRC_INCL__
@@ -0,0 +1,220 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Host benchmark for the CRC32 used by the update image format.  Every
+// implementation the host tools could use (see flashcrc.h and hostcrc.h) is
+// first checked against the bit-at-a-time version, which does exactly what
+// the RP2040's DMA sniffer does, over random lengths, alignments and
+// starting values.  Then each one is timed over a large buffer and its
+// throughput is printed next to the bit-at-a-time loop.
+//
+// Exits with 1 if any implementation gives a different answer.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "flashcrc.h"
+#include "hostcrc.h"
+
+namespace
+{
+
+typedef uint32_t (*tCrcFunction)(const void* data, size_t length, uint32_t crc);
+
+struct tImplementation
+{
+    const char*  name;
+    tCrcFunction function;
+    bool         available;
+};
+
+//****************************************************************************
+uint32_t crcTable(const void* data, size_t length, uint32_t crc)
+{
+    return flashCrc32Table(flashcrc::TABLES.entry, data, length, crc);
+}
+
+//****************************************************************************
+uint32_t crcSlice4(const void* data, size_t length, uint32_t crc)
+{
+    return flashCrc32Slice4(flashcrc::TABLES.entry, data, length, crc);
+}
+
+//****************************************************************************
+uint32_t crcSlice8(const void* data, size_t length, uint32_t crc)
+{
+    return flashCrc32Slice8(flashcrc::TABLES.entry, data, length, crc);
+}
+
+const tImplementation sImplementations[] =
+{
+    { "bitwise", flashCrc32Bitwise, true },
+    { "table",   crcTable,          true },
+    { "slice4",  crcSlice4,         true },
+    { "slice8",  crcSlice8,         true },
+    { "clmul",   hostCrc32Clmul,    hostCrc32HasClmul() },
+};
+
+struct tOptions
+{
+    size_t   size    = 64 << 20;
+    unsigned repeats = 5;
+    unsigned checks  = 20000;
+};
+
+//****************************************************************************
+// Compare the implementation with the bit-at-a-time version over 'checks'
+// random pieces of 'data'.  Returns false if any of them is different.
+bool validate(const tImplementation& impl, const std::vector<uint8_t>& data,
+              unsigned checks, std::mt19937& random)
+{
+    if(impl.function("123456789", 9, FLASH_CRC32_INIT) != FLASH_CRC32_CHECK)
+    {
+        std::printf("%s: wrong check value\n", impl.name);
+        return false;
+    }
+
+    for(unsigned i = 0; i < checks; i++)
+    {
+        // Mostly short lengths, where all the edge cases are
+        size_t maxLength = (i % 4) ? 512 : 8192;
+        size_t offset    = random() % 64;
+        size_t length    = random() % (maxLength + 1);
+        uint32_t crc     = (i % 2) ? random() : FLASH_CRC32_INIT;
+        uint32_t expect  = flashCrc32Bitwise(&data[offset], length, crc);
+        uint32_t actual  = impl.function(&data[offset], length, crc);
+
+        if(actual != expect)
+        {
+            std::printf("%s: offset %zu length %zu crc 0x%08x gave 0x%08x (expected 0x%08x)\n",
+                        impl.name, offset, length, crc, actual, expect);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//****************************************************************************
+// Returns the best time over 'repeats' runs in seconds
+double measure(const tImplementation& impl, const std::vector<uint8_t>& data,
+               size_t length, unsigned repeats)
+{
+    double best = 0;
+    volatile uint32_t sink;
+
+    for(unsigned i = 0; i < repeats; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        sink = impl.function(data.data(), length, FLASH_CRC32_INIT);
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        if((i == 0) || (elapsed.count() < best))
+            best = elapsed.count();
+    }
+
+    (void)sink;
+    return best;
+}
+
+//****************************************************************************
+void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [options]\n"
+                 "  --size <n>            Bytes to run each implementation over (default 64M)\n"
+                 "  --repeats <n>         Number of runs to take the best time from\n"
+                 "  --checks <n>          Number of random pieces to check each one with\n";
+    exit(1);
+}
+
+//****************************************************************************
+tOptions parseOptions(int argc, char* argv[])
+{
+    tOptions options;
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        // Options that take a value
+        if((arg == "--size") || (arg == "--repeats") || (arg == "--checks"))
+        {
+            if(++i == argc)
+                usage(argv[0]);
+
+            if(arg == "--size")
+                options.size = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--repeats")
+                options.repeats = std::strtoul(argv[i], nullptr, 0);
+            else
+                options.checks = std::strtoul(argv[i], nullptr, 0);
+        }
+        else
+            usage(argv[0]);
+    }
+
+    if((options.size == 0) || (options.repeats == 0))
+        usage(argv[0]);
+
+    return options;
+}
+
+} // namespace
+
+//****************************************************************************
+int main(int argc, char* argv[])
+{
+    tOptions options = parseOptions(argc, argv);
+    std::vector<uint8_t> data(std::max<size_t>(options.size, 8192 + 64));
+    std::mt19937 random(1);
+    bool passed = true;
+
+    for(auto& byte : data)
+        byte = uint8_t(random());
+
+    for(const auto& impl : sImplementations)
+    {
+        if(impl.available)
+            passed &= validate(impl, data, options.checks, random);
+    }
+
+    if(!passed)
+        return 1;
+
+    std::printf("All implementations match the DMA sniffer (%u random checks each)\n\n",
+                options.checks);
+
+    // The bit-at-a-time version is far too slow for the whole buffer
+    size_t bitwiseLength = std::min<size_t>(options.size, 4 << 20);
+    double bitwiseRate   = bitwiseLength / measure(sImplementations[0], data, bitwiseLength, 1);
+
+    std::printf("%-8s %12s %10s\n", "", "GB/s", "vs bitwise");
+
+    for(const auto& impl : sImplementations)
+    {
+        if(!impl.available)
+        {
+            std::printf("%-8s %12s\n", impl.name, "unsupported");
+            continue;
+        }
+
+        bool bitwise  = (&impl == &sImplementations[0]);
+        size_t length = bitwise ? bitwiseLength : options.size;
+        double rate   = length / measure(impl, data, length, bitwise ? 1 : options.repeats);
+
+        std::printf("%-8s %12.3f %9.1fx\n", impl.name, rate / 1e9, rate / bitwiseRate);
+    }
+
+    return 0;
+}
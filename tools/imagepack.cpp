@@ -0,0 +1,209 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Building blocks for update images (see imagepack.h)
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include "flashlz.h"
+#include "hostcrc.h"
+#include "imagepack.h"
+
+namespace
+{
+
+//****************************************************************************
+uint32_t read32(const uint8_t* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+//****************************************************************************
+// Write an LZ4 length extension (for a nibble of 15)
+void putLength(std::vector<uint8_t>& out, size_t length)
+{
+    for(length -= 15; length >= 255; length -= 255)
+        out.push_back(255);
+
+    out.push_back(length);
+}
+
+//****************************************************************************
+// Write one LZ4 sequence.  A match length of zero writes the final
+// sequence, which only has literals.
+void putSequence(std::vector<uint8_t>& out, const uint8_t* literals, size_t literalLength,
+                 size_t offset, size_t matchLength)
+{
+    size_t  match = matchLength ? (matchLength - 4) : 0;
+    uint8_t token = ((literalLength < 15 ? literalLength : 15) << 4) |
+                    (match < 15 ? match : 15);
+
+    out.push_back(token);
+    if(literalLength >= 15)
+        putLength(out, literalLength);
+
+    out.insert(out.end(), literals, literals + literalLength);
+
+    if(matchLength)
+    {
+        put16(out, offset);
+        if(match >= 15)
+            putLength(out, match);
+    }
+}
+
+} // namespace
+
+//****************************************************************************
+void put16(std::vector<uint8_t>& buf, uint16_t value)
+{
+    buf.push_back(value & 0xff);
+    buf.push_back(value >> 8);
+}
+
+//****************************************************************************
+void put32(std::vector<uint8_t>& buf, uint32_t value)
+{
+    put16(buf, value & 0xffff);
+    put16(buf, value >> 16);
+}
+
+//****************************************************************************
+// Append an extension record (padded to a multiple of 4 bytes)
+void putTlv(std::vector<uint8_t>& buf, uint16_t type, const std::vector<uint8_t>& value)
+{
+    put16(buf, type);
+    put16(buf, value.size());
+    buf.insert(buf.end(), value.begin(), value.end());
+    buf.resize(FLASH_TLV_ALIGN(buf.size()), 0);
+}
+
+//****************************************************************************
+// Simple greedy LZ4 block compressor.  Follows the LZ4 rules for the end of
+// a block (no match starting in the last 12 bytes, the last 5 bytes are
+// always literals) so the output can also be decoded by the reference
+// implementation.
+std::vector<uint8_t> lz4Compress(const uint8_t* src, size_t length)
+{
+    const size_t MF_LIMIT      = 12;
+    const size_t LAST_LITERALS = 5;
+    const int    HASH_BITS     = 12;
+
+    std::vector<uint8_t> out;
+    std::vector<int32_t> table(1 << HASH_BITS, -1);
+    size_t anchor = 0;
+    size_t pos    = 0;
+
+    while((pos + MF_LIMIT) <= length)
+    {
+        uint32_t sequence  = read32(&src[pos]);
+        uint32_t hash      = (sequence * 2654435761u) >> (32 - HASH_BITS);
+        int32_t  candidate = table[hash];
+
+        table[hash] = pos;
+
+        if((candidate >= 0) && ((pos - candidate) <= 0xffff) &&
+           (read32(&src[candidate]) == sequence))
+        {
+            size_t end = pos + 4;
+
+            while((end < (length - LAST_LITERALS)) && (src[end] == src[candidate + end - pos]))
+                end++;
+
+            putSequence(out, &src[anchor], pos - anchor, pos - candidate, end - pos);
+            pos    = end;
+            anchor = pos;
+        }
+        else
+            pos++;
+    }
+
+    putSequence(out, &src[anchor], length - anchor, 0, 0);
+    return out;
+}
+
+//****************************************************************************
+// Compress a single block of the application.
+// Returns false if it doesn't decompress to what we started with.
+bool compressBlock(const uint8_t* src, size_t length, std::vector<uint8_t>& block)
+{
+    std::vector<uint8_t> check(length);
+
+    block = lz4Compress(src, length);
+
+    // Blocks that don't get any smaller are stored as they are (which
+    // is how the flashloader tells them apart)
+    if(block.size() >= length)
+    {
+        block.assign(src, src + length);
+        return true;
+    }
+
+    // Make sure the flashloader will get back what we started with
+    return (flashLzDecode(block.data(), block.size(), check.data(), length) == length) &&
+           !memcmp(check.data(), src, length);
+}
+
+//****************************************************************************
+// Compress each block of the application independently (and in parallel).
+// Returns the compression extension record and fills in 'data' with the
+// compressed blocks.  Returns an empty record if any block failed.
+std::vector<uint8_t> compressImage(const std::vector<uint8_t>& app, std::vector<uint8_t>& data,
+                                   unsigned jobs)
+{
+    size_t count = (app.size() + FLASH_COMPRESSION_BLOCK - 1) / FLASH_COMPRESSION_BLOCK;
+    std::vector<std::vector<uint8_t>> blocks(count);
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+
+    // Each thread takes the next block that nobody has started on yet
+    auto worker = [&]()
+    {
+        for(size_t block = next++; block < count; block = next++)
+        {
+            size_t offset = block * FLASH_COMPRESSION_BLOCK;
+            size_t length = std::min<size_t>(FLASH_COMPRESSION_BLOCK, app.size() - offset);
+
+            if(!compressBlock(&app[offset], length, blocks[block]))
+            {
+                std::cerr << "Block at offset " << offset << " did not decompress correctly\n";
+                failed = true;
+            }
+        }
+    };
+
+    for(unsigned i = 0; i < std::max(1u, std::min<unsigned>(jobs, count)); i++)
+        threads.emplace_back(worker);
+
+    for(auto& thread : threads)
+        thread.join();
+
+    if(failed)
+        return {};
+
+    std::vector<uint8_t> record;
+
+    record.push_back(FLASH_COMPRESSION_LZ4);
+    record.push_back(FLASH_COMPRESSION_SHIFT);
+    put16(record, 0);
+    put32(record, app.size());
+    put32(record, hostCrc32(app.data(), app.size(), FLASH_CRC32_INIT));
+
+    data.clear();
+
+    for(const auto& block : blocks)
+    {
+        put32(record, data.size());
+        data.insert(data.end(), block.begin(), block.end());
+    }
+
+    put32(record, data.size());
+    return record;
+}
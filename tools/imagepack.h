@@ -0,0 +1,54 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Building blocks for update images, shared by the packer (flashpack.cpp)
+// and the update data path benchmark (updatebench.cpp): little-endian
+// fields, extension records and the LZ4 block compression that the
+// flashloader can undo with flashLzDecode (see flashlz.h).
+
+#ifndef __TOOLS_IMAGEPACK_INCL__
+#define __TOOLS_IMAGEPACK_INCL__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "flashloader.h"
+
+// Size of the blocks the application is split into for compression
+const uint32_t FLASH_COMPRESSION_BLOCK = 1u << FLASH_COMPRESSION_SHIFT;
+
+//****************************************************************************
+void put16(std::vector<uint8_t>& buf, uint16_t value);
+
+//****************************************************************************
+void put32(std::vector<uint8_t>& buf, uint32_t value);
+
+//****************************************************************************
+// Append an extension record (padded to a multiple of 4 bytes)
+void putTlv(std::vector<uint8_t>& buf, uint16_t type, const std::vector<uint8_t>& value);
+
+//****************************************************************************
+// Simple greedy LZ4 block compressor.  Follows the LZ4 rules for the end of
+// a block (no match starting in the last 12 bytes, the last 5 bytes are
+// always literals) so the output can also be decoded by the reference
+// implementation.
+std::vector<uint8_t> lz4Compress(const uint8_t* src, size_t length);
+
+//****************************************************************************
+// Compress a single block of the application.  Blocks that don't get any
+// smaller are stored as they are.
+// Returns false if it doesn't decompress to what we started with.
+bool compressBlock(const uint8_t* src, size_t length, std::vector<uint8_t>& block);
+
+//****************************************************************************
+// Compress each block of the application independently (and in parallel
+// using 'jobs' threads).  Returns the compression extension record and
+// fills in 'data' with the compressed blocks.  Returns an empty record if
+// any block failed.
+std::vector<uint8_t> compressImage(const std::vector<uint8_t>& app, std::vector<uint8_t>& data,
+                                   unsigned jobs);
+
+#endif // __TOOLS_IMAGEPACK_INCL__
@@ -0,0 +1,786 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Host micro-benchmarks for the update data path, run against a real
+// application binary (or a generated one that compresses about as well as
+// code does):
+//   hex/*    the application's Intel hex parsing (intelhex.c, the same code
+//            the device runs) and the whole receive loop from readIntelHex
+//   crc/*    every CRC32 implementation over the whole application
+//   pack/*   compressing, decompressing (as the flashloader does) and
+//            building and checking the image header
+//   aes/*    generating the AES-CTR keystream and decrypting an encrypted
+//            image (flashaes.h, the same code the flashloader runs)
+//   model/*  a cycle-approximate model of the flashloader's copyPage and
+//            flash_range_program for each page, as these can't be timed
+//            on the host, and whether decrypting on core1 keeps up
+//
+// Like Google Benchmark, each benchmark is repeated until it has run for at
+// least '--min-time' seconds and the time per iteration and throughput are
+// printed.
+//
+// With '--history', the results are compared with the median of the last
+// few runs recorded in that file and then appended to it, so a drop in
+// parse or CRC throughput shows up before it reaches a device.  Each line
+// of the history is "<time> <label> <benchmark> <bytes/s>".  Exits with 2 if
+// anything is more than '--tolerance' percent slower than before.
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "flashaes.h"
+#include "flashcrc.h"
+#include "flashloader.h"
+#include "flashlz.h"
+#include "intelhex.h"
+#include "hostcrc.h"
+#include "imagepack.h"
+
+namespace
+{
+
+const uint32_t FLASH_PAGE_SIZE   = 256;
+const uint32_t FLASH_SECTOR_SIZE = 4096;
+const uint32_t HEX_RECORD_LENGTH = 16;      // What objcopy writes
+
+struct tOptions
+{
+    std::string app;
+    std::string filter;
+    std::string history;
+    std::string label     = "-";
+    double      minTime   = 0.2;            // Seconds per benchmark
+    double      tolerance = 10.0;           // Percent
+    unsigned    keep      = 5;              // Runs to compare against
+    size_t      size      = 65536;          // Generated application
+    double      clkMHz    = 125.0;          // clk_sys
+    unsigned    xipDiv    = 2;              // SSI divider set by boot2
+    unsigned    romDiv    = 6;              // SSI divider used by the bootrom
+    double      pageUs    = 400.0;          // Typical page program time
+    double      eraseMs   = 45.0;           // Typical 4k sector erase time
+    double      aesCycles = 1500;           // Per AES block (estimate, measure with crcbench)
+};
+
+struct tBenchmark
+{
+    std::string           name;
+    size_t                bytes;            // Processed per iteration
+    size_t                items;            // Records, blocks, etc.
+    std::function<void()> run;
+};
+
+struct tResult
+{
+    std::string name;
+    double      seconds;                    // Per iteration
+    uint64_t    iterations;
+    double      bytesPerSecond;
+    double      itemsPerSecond;
+};
+
+// Somewhere for results to go so the compiler can't leave anything out
+volatile uint32_t sSink;
+
+// The generated application is always the same
+uint32_t sRandom = 1;
+
+//****************************************************************************
+uint32_t nextRandom()
+{
+    sRandom = sRandom * 1103515245u + 12345u;
+    return sRandom >> 8;
+}
+
+//****************************************************************************
+// Generate something that compresses about as well as Thumb code: mostly
+// instructions picked (unevenly) from a limited set, with the odd literal
+// and plenty of short sequences that have been seen not long before
+std::vector<uint8_t> generateApp(size_t size)
+{
+    std::vector<uint16_t> instructions(512);
+    std::vector<uint8_t> app;
+
+    for(auto& instruction : instructions)
+        instruction = nextRandom();
+
+    while(app.size() < size)
+    {
+        uint32_t pick = nextRandom();
+        uint16_t value;
+
+        if((app.size() >= 2048) && ((pick & 3) == 0))
+        {
+            size_t from   = app.size() - 2 * (1 + (pick >> 2) % 1024);
+            size_t length = 2 * (2 + (pick >> 12) % 6);
+
+            for(size_t i = 0; i < length; i++)
+                app.push_back(app[from + i]);
+
+            continue;
+        }
+
+        if((pick & 15) == 1)
+            value = nextRandom();
+        else
+            value = instructions[((pick >> 4) % 512) * ((pick >> 13) % 512) / 512];
+
+        app.push_back(value & 0xff);
+        app.push_back(value >> 8);
+    }
+
+    app.resize(size);
+    return app;
+}
+
+//****************************************************************************
+void putHexRecord(std::string& text, uint8_t type, uint16_t addr,
+                  const uint8_t* data, size_t count)
+{
+    char    field[3];
+    uint8_t checksum = count + (addr >> 8) + (addr & 0xff) + type;
+
+    auto putByte = [&](uint8_t value)
+    {
+        std::snprintf(field, sizeof(field), "%02X", value);
+        text += field;
+    };
+
+    text += ':';
+    putByte(count);
+    putByte(addr >> 8);
+    putByte(addr & 0xff);
+    putByte(type);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        putByte(data[i]);
+        checksum += data[i];
+    }
+
+    putByte(-checksum);
+    text += "\r\n";
+}
+
+//****************************************************************************
+// Convert the application to Intel hex (as objcopy would) for 'address'
+std::string toIntelHex(const std::vector<uint8_t>& app, uint32_t address)
+{
+    std::string text;
+
+    for(size_t offset = 0; offset < app.size(); offset += HEX_RECORD_LENGTH)
+    {
+        uint32_t addr = address + offset;
+
+        if((offset == 0) || ((addr & 0xffff) < HEX_RECORD_LENGTH))
+        {
+            uint8_t upper[2] = { uint8_t(addr >> 24), uint8_t(addr >> 16) };
+
+            putHexRecord(text, 0x04, 0, upper, sizeof(upper));
+        }
+
+        putHexRecord(text, 0x00, addr & 0xffff, &app[offset],
+                     std::min<size_t>(HEX_RECORD_LENGTH, app.size() - offset));
+    }
+
+    putHexRecord(text, 0x01, 0, nullptr, 0);
+    return text;
+}
+
+//****************************************************************************
+// Split the text into lines (without the line endings, as getLine does)
+std::vector<std::string> splitLines(const std::string& text)
+{
+    std::vector<std::string> lines;
+    std::istringstream stream(text);
+    std::string line;
+
+    while(std::getline(stream, line))
+    {
+        if(!line.empty() && (line.back() == '\r'))
+            line.pop_back();
+
+        lines.push_back(line);
+    }
+
+    return lines;
+}
+
+//****************************************************************************
+// Run the benchmark for long enough to get a stable time, increasing the
+// number of iterations the same way Google Benchmark does
+tResult measure(const tBenchmark& benchmark, double minTime)
+{
+    uint64_t iterations = 1;
+    double   elapsed;
+
+    while(true)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        for(uint64_t i = 0; i < iterations; i++)
+            benchmark.run();
+
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if((elapsed >= minTime) || (iterations >= 1000000000))
+            break;
+
+        // Aim a bit past the minimum (but don't jump too far on a
+        // measurement that's mostly noise)
+        double scale = (elapsed > 0) ? (1.4 * minTime / elapsed) : 100.0;
+
+        iterations = std::max<uint64_t>(iterations + 1,
+                                        iterations * std::min(scale, 100.0));
+    }
+
+    tResult result;
+
+    result.name           = benchmark.name;
+    result.seconds        = elapsed / iterations;
+    result.iterations     = iterations;
+    result.bytesPerSecond = benchmark.bytes / result.seconds;
+    result.itemsPerSecond = benchmark.items / result.seconds;
+    return result;
+}
+
+//****************************************************************************
+// Cycle-approximate model of programming one page in the flashloader:
+// copyPage (a DMA transfer of 64 words out of the staged image through the
+// XIP cache) and then flash_range_program from RAM.
+// Returns the cycles for each in 'copy' and 'program'.
+void modelPage(const tOptions& options, double& copy, double& program)
+{
+    // The image is only read once so every 8-byte cache line misses.  boot2
+    // leaves the flash in quad I/O continuous read mode: 24 address bits
+    // plus 8 mode bits over 4 lines, 4 dummy clocks then 16 clocks for the
+    // 8 bytes.  The DMA then takes a cycle to write each word.
+    const double lines     = FLASH_PAGE_SIZE / 8;
+    const double lineClock = 8 + 4 + 16;
+
+    copy = lines * lineClock * options.xipDiv + (FLASH_PAGE_SIZE / 4);
+
+    // The bootrom drops out of XIP (a few dozen clocks of 0xff), sends write
+    // enable, then the page program command, address and data one bit at a
+    // time, then polls the status register until the flash has finished.
+    // Afterwards the SDK flushes the cache and runs boot2 again (which reads
+    // and may write the status registers and issues the first XIP read).
+    const double exitXip   = 32;
+    const double command   = 8 + (1 + 3 + FLASH_PAGE_SIZE) * 8;
+    const double pollClock = 16;
+    const double busy      = options.pageUs * options.clkMHz;
+    const double polls     = busy / (pollClock * options.romDiv);
+    const double enterXip  = 3 * 16 + 8 + 4;
+    const double overhead  = 2000;          // Function calls, cache flush, etc.
+
+    program = (exitXip + command + enterXip) * options.romDiv +
+              polls * pollClock * options.romDiv + overhead;
+}
+
+//****************************************************************************
+// Print the modelled cycles and add the throughput to the results so it's
+// tracked along with everything else
+void reportModel(const tOptions& options, size_t appLength, std::vector<tResult>& results)
+{
+    double copy;
+    double program;
+    double pages   = (appLength + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+    double sectors = (appLength + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+    double hz      = options.clkMHz * 1e6;
+
+    modelPage(options, copy, program);
+
+    std::printf("\nDevice model at %.0f MHz (XIP divider %u, bootrom divider %u, %.0fus page program)\n",
+                options.clkMHz, options.xipDiv, options.romDiv, options.pageUs);
+    std::printf("%-28s %12.0f cycles/page %8.2f us/page\n", "model/copyPage", copy, copy * 1e6 / hz);
+    std::printf("%-28s %12.0f cycles/page %8.2f us/page\n", "model/flash_range_program",
+                program, program * 1e6 / hz);
+    std::printf("%-28s %12.1f ms for %.0f pages and %.0f sectors\n", "model/flashFirmware",
+                (pages * (copy + program) / hz + sectors * options.eraseMs / 1000) * 1000,
+                pages, sectors);
+
+    // Core1 generates the keystream for the next page while core0 programs
+    // this one, so core0 only has to wait if that takes longer.  Core0 then
+    // XORs the page a word at a time (about five cycles a word).
+    double keystream = options.aesCycles * (FLASH_PAGE_SIZE / FLASH_AES_BLOCK_LENGTH);
+    double decrypt   = (FLASH_PAGE_SIZE / 4) * 5;
+
+    std::printf("%-28s %12.0f cycles/page %8.2f us/page (%s)\n", "model/aesKeystream",
+                keystream, keystream * 1e6 / hz,
+                (keystream < program) ? "would be hidden behind flash_range_program on core1" :
+                                        "would be slower than flash_range_program");
+    std::printf("%-28s %12.1f ms for %.0f pages and %.0f sectors\n", "model/flashEncrypted",
+                (pages * (copy + decrypt + std::max(program, keystream)) / hz +
+                 sectors * options.eraseMs / 1000) * 1000,
+                pages, sectors);
+
+    for(auto [name, cycles] : { std::make_pair("model/copyPage", copy),
+                                std::make_pair("model/flash_range_program", program),
+                                std::make_pair("model/aesKeystream", keystream) })
+    {
+        tResult result;
+
+        result.name           = name;
+        result.seconds        = cycles / hz;
+        result.iterations     = 1;
+        result.bytesPerSecond = FLASH_PAGE_SIZE / result.seconds;
+        result.itemsPerSecond = 1 / result.seconds;
+        results.push_back(result);
+    }
+}
+
+//****************************************************************************
+// Compare the results with the median of the last 'keep' runs in the
+// history and then add them to it.
+// Returns false if anything has got slower by more than the tolerance.
+bool checkHistory(const tOptions& options, const std::vector<tResult>& results)
+{
+    std::map<std::string, std::vector<std::pair<long, double>>> previous;
+    std::ifstream input(options.history);
+    std::string line;
+    bool passed = true;
+
+    while(std::getline(input, line))
+    {
+        std::istringstream fields(line);
+        long        time;
+        std::string label;
+        std::string name;
+        double      rate;
+
+        if(fields >> time >> label >> name >> rate)
+            previous[name].emplace_back(time, rate);
+    }
+
+    std::printf("\nCompared with the last %u runs in %s\n", options.keep, options.history.c_str());
+
+    for(const auto& result : results)
+    {
+        auto& runs = previous[result.name];
+
+        if(runs.empty())
+        {
+            std::printf("%-28s %12s\n", result.name.c_str(), "new");
+            continue;
+        }
+
+        std::vector<double> rates;
+
+        for(size_t i = runs.size() - std::min<size_t>(runs.size(), options.keep); i < runs.size(); i++)
+            rates.push_back(runs[i].second);
+
+        std::sort(rates.begin(), rates.end());
+
+        double median = rates[rates.size() / 2];
+        double change = 100.0 * (result.bytesPerSecond - median) / median;
+        bool   slower = (change < -options.tolerance);
+
+        std::printf("%-28s %+11.1f%%%s\n", result.name.c_str(), change, slower ? "  REGRESSION" : "");
+        passed &= !slower;
+    }
+
+    std::ofstream output(options.history, std::ios::app);
+    long now = std::time(nullptr);
+
+    for(const auto& result : results)
+        output << now << ' ' << options.label << ' ' << result.name << ' '
+               << (uint64_t)result.bytesPerSecond << '\n';
+
+    if(!output)
+        std::perror(options.history.c_str());
+
+    return passed;
+}
+
+//****************************************************************************
+void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [options] [application.bin]\n"
+                 "  --filter <text>       Only run benchmarks with this in their name\n"
+                 "  --min-time <s>        Minimum time to run each benchmark for\n"
+                 "  --size <n>            Size of the generated application (no file given)\n"
+                 "  --history <file>      Compare with and add to the results in this file\n"
+                 "  --label <text>        Label for the history (e.g. a commit hash)\n"
+                 "  --keep <n>            Number of previous runs to compare against\n"
+                 "  --tolerance <pct>     Slow-down allowed before failing\n"
+                 "  --clk-mhz <MHz>       System clock for the device model\n"
+                 "  --xip-div <n>         SSI clock divider set up by boot2\n"
+                 "  --rom-div <n>         SSI clock divider used by the bootrom flash functions\n"
+                 "  --page-us <us>        Time taken to program a 256 byte page\n"
+                 "  --erase-ms <ms>       Time taken to erase a 4k sector\n"
+                 "  --aes-cycles <n>      Cycles taken to encrypt an AES block on the device\n"
+                 "                        (measure with crcbench, the default 1500 is an estimate)\n";
+    exit(1);
+}
+
+//****************************************************************************
+tOptions parseOptions(int argc, char* argv[])
+{
+    tOptions options;
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        // Options that take a value
+        if((arg == "--filter") || (arg == "--min-time") || (arg == "--size") ||
+           (arg == "--history") || (arg == "--label") || (arg == "--keep") ||
+           (arg == "--tolerance") || (arg == "--clk-mhz") || (arg == "--xip-div") ||
+           (arg == "--rom-div") || (arg == "--page-us") || (arg == "--erase-ms") ||
+           (arg == "--aes-cycles"))
+        {
+            if(++i == argc)
+                usage(argv[0]);
+
+            if(arg == "--filter")
+                options.filter = argv[i];
+            else if(arg == "--min-time")
+                options.minTime = std::strtod(argv[i], nullptr);
+            else if(arg == "--size")
+                options.size = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--history")
+                options.history = argv[i];
+            else if(arg == "--label")
+                options.label = argv[i];
+            else if(arg == "--keep")
+                options.keep = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--tolerance")
+                options.tolerance = std::strtod(argv[i], nullptr);
+            else if(arg == "--clk-mhz")
+                options.clkMHz = std::strtod(argv[i], nullptr);
+            else if(arg == "--xip-div")
+                options.xipDiv = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--rom-div")
+                options.romDiv = std::strtoul(argv[i], nullptr, 0);
+            else if(arg == "--page-us")
+                options.pageUs = std::strtod(argv[i], nullptr);
+            else if(arg == "--aes-cycles")
+                options.aesCycles = std::strtod(argv[i], nullptr);
+            else
+                options.eraseMs = std::strtod(argv[i], nullptr);
+        }
+        else if((arg[0] == '-') || !options.app.empty())
+            usage(argv[0]);
+        else
+            options.app = arg;
+    }
+
+    if((options.size < FLASH_PAGE_SIZE) || (options.keep == 0) || (options.clkMHz <= 0))
+        usage(argv[0]);
+
+    // The label is one field of the history
+    for(auto& c : options.label)
+    {
+        if(std::isspace((unsigned char)c))
+            c = '_';
+    }
+
+    return options;
+}
+
+} // namespace
+
+//****************************************************************************
+int main(int argc, char* argv[])
+{
+    tOptions options = parseOptions(argc, argv);
+    std::vector<uint8_t> app;
+
+    if(options.app.empty())
+        app = generateApp(options.size);
+    else
+    {
+        std::ifstream input(options.app, std::ios::binary);
+
+        if(!input)
+        {
+            std::perror(options.app.c_str());
+            return 1;
+        }
+
+        app.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+
+        if(app.size() < FLASH_PAGE_SIZE)
+        {
+            std::cerr << options.app << " is too small to be an application\n";
+            return 1;
+        }
+    }
+
+    // Everything the benchmarks work on is prepared up front
+    std::string hex = toIntelHex(app, 0x10001000);
+    std::vector<std::string> lines = splitLines(hex);
+    std::vector<uint8_t> received(app.size() + FLASH_PAGE_SIZE);
+    std::vector<uint8_t> decoded(FLASH_COMPRESSION_BLOCK);
+    std::vector<std::vector<uint8_t>> blocks;
+    std::vector<uint8_t> compressed;
+    tFlashCrcTable tables[8];
+
+    flashCrc32MakeTables(tables, 8);
+
+    for(size_t offset = 0; offset < app.size(); offset += FLASH_COMPRESSION_BLOCK)
+    {
+        blocks.emplace_back();
+        if(!compressBlock(&app[offset], std::min<size_t>(FLASH_COMPRESSION_BLOCK, app.size() - offset),
+                          blocks.back()))
+        {
+            std::cerr << "Block at offset " << offset << " did not decompress correctly\n";
+            return 1;
+        }
+
+        compressed.insert(compressed.end(), blocks.back().begin(), blocks.back().end());
+    }
+
+    std::vector<uint8_t> image(sizeof(tFlashHeader) + sizeof(tFlashTlv) + sizeof(uint32_t) + app.size());
+    tFlashHeader* header = reinterpret_cast<tFlashHeader*>(image.data());
+    tFlashTlv*    tlv    = reinterpret_cast<tFlashTlv*>(header->tlv);
+
+    std::copy(app.begin(), app.end(), image.end() - app.size());
+
+    // Encrypted with the FIPS-197 example key (checked below)
+    const uint8_t key[FLASH_AES_KEY_LENGTH] =
+        { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+          0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+    const uint8_t nonce[FLASH_AES_NONCE_LENGTH] = { 0 };
+    std::vector<uint8_t> encrypted(app);
+    std::vector<uint8_t> keystream(FLASH_PAGE_SIZE);
+    tFlashAes aes;
+
+    flashAesInit(&aes, key);
+    flashAesCtr(&aes, nonce, 0, encrypted.data(), encrypted.size());
+
+    // What readIntelHex does with each line, keeping the CRC up to date as
+    // it goes (slice-by-8 standing in for whichever APP_CRC is chosen)
+    auto receive = [&]()
+    {
+        uint32_t offset    = 0;
+        uint32_t crc       = FLASH_CRC32_INIT;
+        uint32_t crcLength = 0;
+        tRecord  record;
+
+        for(const auto& line : lines)
+        {
+            if(!processRecord(line.c_str(), &record))
+                continue;
+
+            if(record.type == 0x00)
+            {
+                std::copy(record.data, record.data + record.count, &received[offset]);
+
+                if(crcLength == offset)
+                {
+                    crc = flashCrc32Slice8(tables, record.data, record.count, crc);
+                    crcLength += record.count;
+                }
+
+                offset += record.count;
+            }
+        }
+
+        sSink = crc;
+    };
+
+    size_t pairs = 0;
+
+    for(const auto& line : lines)
+        pairs += (line.size() - 1) / 2;
+
+    const std::vector<tBenchmark> benchmarks =
+    {
+        { "hex/hex2nibble", hex.size(), hex.size(), [&]()
+            {
+                uint8_t value = 0;
+
+                for(char c : hex)
+                    hex2nibble(c, &value);
+
+                sSink = value;
+            } },
+        { "hex/parseHex", pairs * 2, pairs, [&]()
+            {
+                uint8_t value;
+                uint8_t sum = 0;
+
+                for(const auto& line : lines)
+                {
+                    for(size_t i = 1; (i + 1) < line.size(); i += 2)
+                    {
+                        parseHex(&line[i], &value);
+                        sum += value;
+                    }
+                }
+
+                sSink = sum;
+            } },
+        { "hex/processRecord", hex.size(), lines.size(), [&]()
+            {
+                tRecord record;
+                uint32_t count = 0;
+
+                for(const auto& line : lines)
+                    count += processRecord(line.c_str(), &record);
+
+                sSink = count;
+            } },
+        { "hex/receive", hex.size(), lines.size(), receive },
+
+        { "crc/bitwise", app.size(), 1, [&]()
+            { sSink = flashCrc32Bitwise(app.data(), app.size(), FLASH_CRC32_INIT); } },
+        { "crc/table", app.size(), 1, [&]()
+            { sSink = flashCrc32Table(tables, app.data(), app.size(), FLASH_CRC32_INIT); } },
+        { "crc/slice4", app.size(), 1, [&]()
+            { sSink = flashCrc32Slice4(tables, app.data(), app.size(), FLASH_CRC32_INIT); } },
+        { "crc/slice8", app.size(), 1, [&]()
+            { sSink = flashCrc32Slice8(tables, app.data(), app.size(), FLASH_CRC32_INIT); } },
+        { "crc/host", app.size(), 1, [&]()
+            { sSink = hostCrc32(app.data(), app.size(), FLASH_CRC32_INIT); } },
+
+        { "pack/compressBlock", app.size(), blocks.size(), [&]()
+            {
+                std::vector<uint8_t> block;
+
+                for(size_t offset = 0; offset < app.size(); offset += FLASH_COMPRESSION_BLOCK)
+                    compressBlock(&app[offset], std::min<size_t>(FLASH_COMPRESSION_BLOCK, app.size() - offset),
+                                  block);
+
+                sSink = block.size();
+            } },
+        { "pack/compressImage", app.size(), blocks.size(), [&]()
+            {
+                std::vector<uint8_t> data;
+
+                sSink = compressImage(app, data, std::thread::hardware_concurrency()).size();
+            } },
+        { "pack/flashLzDecode", app.size(), blocks.size(), [&]()
+            {
+                uint32_t total = 0;
+
+                for(const auto& block : blocks)
+                {
+                    if(block.size() < FLASH_COMPRESSION_BLOCK)
+                        total += flashLzDecode(block.data(), block.size(), decoded.data(), decoded.size());
+                    else
+                        total += block.size();
+                }
+
+                sSink = total;
+            } },
+        { "pack/header", app.size(), 1, [&]()
+            {
+                uint32_t sequence = 1;
+
+                // What the application does before staging the image and
+                // the flashloader does before accepting it
+                tlv->type   = FLASH_TLV_SEQUENCE;
+                tlv->length = sizeof(uint32_t);
+                std::copy((uint8_t*)&sequence, (uint8_t*)&sequence + sizeof(sequence), tlv->value);
+
+                flashHeaderInit(header, sizeof(tFlashHeader) + sizeof(tFlashTlv) + sizeof(uint32_t));
+                header->length   = app.size();
+                header->crc32    = hostCrc32(flashHeaderData(header), app.size(), FLASH_CRC32_INIT);
+                header->tlvCrc32 = flashCrc32(header->tlv, flashHeaderTlvLength(header), FLASH_CRC32_INIT);
+
+                sSink = flashHeaderValid(header, image.size()) &&
+                        (flashCrc32(header->tlv, flashHeaderTlvLength(header), FLASH_CRC32_INIT) == header->tlvCrc32) &&
+                        (hostCrc32(flashHeaderData(header), header->length, FLASH_CRC32_INIT) == header->crc32);
+            } },
+
+        { "aes/init", sizeof(tFlashAes), 1, [&]()
+            {
+                tFlashAes init;
+
+                flashAesInit(&init, key);
+                sSink = init.roundKey[43];
+            } },
+        { "aes/keystream", app.size(), (app.size() + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE, [&]()
+            {
+                // A page at a time, as core1 does in the flashloader
+                for(size_t offset = 0; offset < app.size(); offset += FLASH_PAGE_SIZE)
+                    flashAesKeystream(&aes, nonce, offset / FLASH_AES_BLOCK_LENGTH,
+                                      keystream.data(), keystream.size());
+
+                sSink = keystream[0];
+            } },
+        { "aes/ctr", 2 * app.size(), 2 * ((app.size() + FLASH_AES_BLOCK_LENGTH - 1) / FLASH_AES_BLOCK_LENGTH), [&]()
+            {
+                // Twice, so it ends up back as it started
+                flashAesCtr(&aes, nonce, 0, encrypted.data(), encrypted.size());
+                flashAesCtr(&aes, nonce, 0, encrypted.data(), encrypted.size());
+                sSink = encrypted[0];
+            } },
+    };
+
+    std::printf("Application %s: %zu bytes, %zu bytes of Intel hex in %zu records, "
+                "%zu bytes compressed\n\n",
+                options.app.empty() ? "(generated)" : options.app.c_str(),
+                app.size(), hex.size(), lines.size(), compressed.size());
+    std::printf("%-28s %14s %12s %12s %14s\n", "Benchmark", "Time", "Iterations", "MB/s", "items/s");
+
+    std::vector<tResult> results;
+
+    for(const auto& benchmark : benchmarks)
+    {
+        if(benchmark.name.find(options.filter) == std::string::npos)
+            continue;
+
+        tResult result = measure(benchmark, options.minTime);
+
+        std::printf("%-28s %11.0f ns %12llu %12.1f %14.0f\n", result.name.c_str(),
+                    result.seconds * 1e9, (unsigned long long)result.iterations,
+                    result.bytesPerSecond / 1e6, result.itemsPerSecond);
+        results.push_back(result);
+    }
+
+    // Check the benchmarks are actually doing what they say
+    receive();
+    if(!std::equal(app.begin(), app.end(), received.begin()) ||
+       (sSink != flashCrc32(app.data(), app.size(), FLASH_CRC32_INIT)))
+    {
+        std::cerr << "The Intel hex data was not received correctly\n";
+        return 1;
+    }
+
+    // FIPS-197 appendix C.1
+    const uint8_t plain[FLASH_AES_BLOCK_LENGTH] =
+        { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+          0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+    const uint8_t cipher[FLASH_AES_BLOCK_LENGTH] =
+        { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+          0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+    uint8_t block[FLASH_AES_BLOCK_LENGTH];
+
+    flashAesEncrypt(&aes, plain, block);
+    flashAesCtr(&aes, nonce, 0, encrypted.data(), encrypted.size());
+
+    if(!std::equal(block, block + sizeof(block), cipher) ||
+       !std::equal(app.begin(), app.end(), encrypted.begin()))
+    {
+        std::cerr << "AES did not encrypt or decrypt correctly\n";
+        return 1;
+    }
+
+    if((std::string("model/copyPage").find(options.filter) != std::string::npos) ||
+       (std::string("model/flash_range_program").find(options.filter) != std::string::npos) ||
+       (std::string("model/aesKeystream").find(options.filter) != std::string::npos))
+        reportModel(options, app.size(), results);
+
+    if(!options.history.empty() && !checkHistory(options, results))
+        return 2;
+
+    return 0;
+}
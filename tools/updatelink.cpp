@@ -0,0 +1,195 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Framing for the update protocol over a serial port or pseudo-terminal.
+// See updatelink.h for details.
+
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "flashcrc.h"
+#include "updatelink.h"
+
+namespace
+{
+
+//****************************************************************************
+// termios only knows about a fixed set of baud rates
+speed_t baudToSpeed(uint32_t baud)
+{
+    switch(baud)
+    {
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+#ifdef B460800
+        case 460800:  return B460800;
+#endif
+#ifdef B921600
+        case 921600:  return B921600;
+#endif
+        default:      return B0;
+    }
+}
+
+} // namespace
+
+//****************************************************************************
+bool setRaw(int fd, uint32_t baud)
+{
+    struct termios tio;
+    speed_t speed = baudToSpeed(baud);
+
+    if((speed == B0) || (tcgetattr(fd, &tio) != 0))
+        return false;
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN]  = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+//****************************************************************************
+int openSerial(const std::string& path, uint32_t baud, bool nonBlocking)
+{
+    int fd = open(path.c_str(), O_RDWR | O_NOCTTY | (nonBlocking ? O_NONBLOCK : 0));
+
+    if(fd < 0)
+        return -1;
+
+    if(!setRaw(fd, baud))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+//****************************************************************************
+bool tUpdateLink::send(uint8_t type, uint16_t seq, const void* payload, uint16_t length)
+{
+    tUpdateFrame frame;
+
+    updateFrameInit(&frame, type, seq, payload, length);
+    updateSetCrc(&frame, flashCrc32(&frame.type, updateCrcLength(&frame), FLASH_CRC32_INIT));
+
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(&frame);
+
+    // Don't let the buffer grow forever once everything has been written
+    if(!writing())
+    {
+        mOut.clear();
+        mOutPos = 0;
+    }
+
+    mOut.insert(mOut.end(), data, data + updateFrameLength(&frame));
+    return writeAvailable();
+}
+
+//****************************************************************************
+bool tUpdateLink::writeAvailable()
+{
+    while(writing())
+    {
+        ssize_t count = write(mFd, &mOut[mOutPos], mOut.size() - mOutPos);
+
+        if(count < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            // Try again when the descriptor is writable
+            return errno == EAGAIN;
+        }
+
+        mOutPos += count;
+        mSent   += count;
+    }
+
+    return true;
+}
+
+//****************************************************************************
+bool tUpdateLink::readAvailable()
+{
+    uint8_t buffer[512];
+    ssize_t count;
+
+    // Only one read as, with a blocking descriptor, a second would wait.
+    // Anything left over will still be there next time.
+    do
+    {
+        count = read(mFd, buffer, sizeof(buffer));
+    }while((count < 0) && (errno == EINTR));
+
+    if(count < 0)
+        return errno == EAGAIN;
+
+    mReceived += count;
+
+    for(ssize_t i = 0; i < count; i++)
+    {
+        if(updateParse(&mParser, buffer[i]) &&
+           (flashCrc32(&mParser.frame.type, updateCrcLength(&mParser.frame), FLASH_CRC32_INIT) ==
+            updateFrameCrc(&mParser.frame)))
+            mFrames.push_back(mParser.frame);
+    }
+
+    return true;
+}
+
+//****************************************************************************
+bool tUpdateLink::receive(tUpdateFrame& frame, int timeoutMs)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    while(!next(frame))
+    {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - std::chrono::steady_clock::now()).count();
+        struct pollfd pfd = { mFd, short(POLLIN | (writing() ? POLLOUT : 0)), 0 };
+
+        if((left < 0) || (poll(&pfd, 1, static_cast<int>(left)) <= 0))
+            return false;
+
+        if(((pfd.revents & POLLOUT) && !writeAvailable()) ||
+           ((pfd.revents & POLLIN) && !readAvailable()))
+            return false;
+    }
+
+    return true;
+}
+
+//****************************************************************************
+bool tUpdateLink::next(tUpdateFrame& frame)
+{
+    if(mFrames.empty())
+        return false;
+
+    frame = mFrames.front();
+    mFrames.pop_front();
+    return true;
+}
+
+//****************************************************************************
+void tUpdateLink::flush()
+{
+    mFrames.clear();
+    mParser.count = 0;
+}
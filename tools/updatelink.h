@@ -0,0 +1,90 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Framing for the update protocol (see updateproto.h) over a serial port or
+// pseudo-terminal, shared by the uploader and the device simulator.
+//
+// The link can be used in a blocking fashion (send() and receive()) or, with
+// a non-blocking file descriptor, from an event loop: call readAvailable()
+// when the descriptor is readable, writeAvailable() when it is writable and
+// collect the frames received with next().
+
+#ifndef __TOOLS_UPDATELINK_INCL__
+#define __TOOLS_UPDATELINK_INCL__
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "updateproto.h"
+
+//****************************************************************************
+// Put the terminal into raw mode at the given baud rate (ignored for
+// pseudo-terminals).  Returns false if the baud rate isn't supported.
+bool setRaw(int fd, uint32_t baud);
+
+//****************************************************************************
+// Open a serial port in raw mode.  Returns the file descriptor or -1 (with
+// errno set).
+int openSerial(const std::string& path, uint32_t baud, bool nonBlocking = false);
+
+class tUpdateLink
+{
+public:
+    explicit tUpdateLink(int fd) : mFd(fd) {}
+
+    //************************************************************************
+    // Send a frame.  With a blocking descriptor, this waits until it has all
+    // been written.  Otherwise, whatever can't be written straight away is
+    // kept until writeAvailable() is called.  Returns false if the link has
+    // failed.
+    bool send(uint8_t type, uint16_t seq, const void* payload, uint16_t length);
+
+    //************************************************************************
+    // Wait up to 'timeoutMs' for the next frame with a good CRC.  Anything
+    // else received is dropped.  Returns false on timeout.
+    bool receive(tUpdateFrame& frame, int timeoutMs);
+
+    //************************************************************************
+    // Read whatever has been received without blocking.  Returns false if
+    // the link has failed.
+    bool readAvailable();
+
+    //************************************************************************
+    // Write as much of the queued output as possible without blocking.
+    // Returns false if the link has failed.
+    bool writeAvailable();
+
+    //************************************************************************
+    // Get the next frame received with a good CRC, if there is one
+    bool next(tUpdateFrame& frame);
+
+    //************************************************************************
+    // Discard anything received but not yet returned
+    void flush();
+
+    //************************************************************************
+    // True if frames have been received that haven't been returned yet
+    bool pending() const { return !mFrames.empty(); }
+
+    //************************************************************************
+    // True if there is output waiting for writeAvailable()
+    bool writing() const { return mOutPos < mOut.size(); }
+
+    uint64_t bytesSent()     const { return mSent; }
+    uint64_t bytesReceived() const { return mReceived; }
+
+private:
+    int                      mFd;
+    tUpdateParser            mParser = {};
+    std::deque<tUpdateFrame> mFrames;
+    std::vector<uint8_t>     mOut;
+    size_t                   mOutPos   = 0;
+    uint64_t                 mSent     = 0;
+    uint64_t                 mReceived = 0;
+};
+
+#endif // __TOOLS_UPDATELINK_INCL__
@@ -11,6 +11,24 @@
 # Using the '-o' parameter allows multiple UF2 files to be concatenated and
 # output
 #
+# With '--sparse', gaps are left out instead of being padded with blocks of
+# 0xff.  The bootrom doesn't need the blocks to be contiguous (it erases
+# each 4k sector before writing the first block to it, so anything not
+# written reads back as 0xff anyway) and doesn't have to program the
+# padding, so the combined image is flashed faster.
+#
+# With '--delta <old>', only the 4k sectors that are different from the old
+# image (UF2 or binary, already on the device) are output, so a drag-and-drop
+# update only programs what has changed.  A whole sector is written if any
+# of it has changed because the bootrom erases the sector before writing the
+# first block to it.  Binary files (old or new) are placed at '--start'.
+#
+# With '--erase <addr>', a block of 0xff is added at the given address after
+# the files (without padding up to it).  The bootrom erases the sector before
+# writing the block to it, so the whole sector ends up erased.  This is used
+# to clear out the flashloader's boot state (see FLASHLOADER_APP_CHECK) when
+# a new application is loaded by the bootrom.
+#
 
 import argparse
 import struct;
@@ -21,6 +39,10 @@ UF2_MAGIC_END    = 0x0AB16F30 # Ditto
 
 FAMILY_ID_RP2040 = 0xe48bff56
 
+PAGE_SIZE   = 256
+SECTOR_SIZE = 4096
+BLANK_PAGE  = b'\xff' * PAGE_SIZE
+
 def auto_int(x):
     return int(x, 0)
 
@@ -48,6 +70,23 @@ def pad(start, end, buf):
 
     return (start, blocks)
 
+# Append a block writing the given data (up to a page) at 'addr'
+def add_block(addr, data, buf):
+    header = (UF2_MAGIC_START0,
+              UF2_MAGIC_START1,
+              0x00002000,
+              addr,
+              len(data),
+              0,                        # Block number - will be updated later
+              0,                        # Numblocks - will be updated lated
+              FAMILY_ID_RP2040
+              )
+
+    buf.extend(struct.pack(b"<IIIIIIII", *header))
+    buf.extend(data)
+    buf.extend(bytearray(476 - len(data)))
+    buf.extend(struct.pack(b"<I", UF2_MAGIC_END))
+
 # Update the individual block number and the total number of blocks field in
 # each block
 def updateBuf(buf):
@@ -59,10 +98,12 @@ def updateBuf(buf):
         struct.pack_into(b"<II", buf, ptr + 20, curblock, numblocks)
         curblock += 1
 
-# Check the uf2 file passed in buf is valid and contiguous
-def check_uf2(start, buf):
+# Check the uf2 file passed in buf is valid and contiguous (or at least in
+# ascending order if sparse)
+def check_uf2(start, buf, sparse=False):
     numblocks = len(buf) // 512
     numpadblocks = 0
+    skippedblocks = 0
     curaddr = start
     curblock = 0
     newbuf = bytearray()
@@ -95,9 +136,12 @@ def check_uf2(start, buf):
         padding = newaddr - curaddr
         assert padding >= 0, f"Address jumps backwards at {ptr}. Start is 0x{newaddr:08x}, expected 0x{curaddr:08x}"   # not UF2 requirement
 
-        if padding > 0:
+        if (padding > 0) and not sparse:
             curaddr, blocks = pad(curaddr, newaddr, newbuf)
             numpadblocks += blocks
+        elif padding > 0:
+            curaddr, blocks = pad(curaddr, newaddr, bytearray())
+            skippedblocks += blocks
 
         assert blockno == hd[5], f"Missing block detected at {ptr}"
 
@@ -107,12 +151,93 @@ def check_uf2(start, buf):
     # Add the number of padding blocks to the total
     numblocks += numpadblocks
 
-    return (curaddr, numblocks, newbuf)
+    return (curaddr, numblocks, newbuf, skippedblocks)
+
+
+def is_uf2(buf):
+    return (len(buf) >= 8) and (struct.unpack(b"<II", buf[0:8]) == (UF2_MAGIC_START0, UF2_MAGIC_START1))
+
+# Read a UF2 or binary file into a dictionary of pages (keyed by address).
+# Anything in a page that isn't given by the file is 0xff.
+def read_pages(filename, start):
+    pages = {}
+
+    with open(filename, mode='rb') as f:
+        buf = f.read()
+
+    if is_uf2(buf):
+        try:
+            check_uf2(struct.unpack(b"<I", buf[12:16])[0], buf, True)
+        except AssertionError as e:
+            print("***************************************************************")
+            print(f"UF2 sanity check of {filename} failed:")
+            print(e)
+            print("***************************************************************")
+            exit(1)
+
+        blocks = [(struct.unpack(b"<II", buf[ptr + 12:ptr + 20]), buf[ptr + 32:ptr + 508])
+                  for ptr in range(0, len(buf), 512)]
+    else:
+        blocks = [((start + offset, min(PAGE_SIZE, len(buf) - offset)), buf[offset:offset + PAGE_SIZE])
+                  for offset in range(0, len(buf), PAGE_SIZE)]
+
+    for (addr, length), data in blocks:
+        data = data[0:length]
+
+        while data:
+            offset = addr % PAGE_SIZE
+            count = min(PAGE_SIZE - offset, len(data))
+            page = pages.setdefault(addr - offset, bytearray(BLANK_PAGE))
 
+            page[offset:offset + count] = data[0:count]
+            addr += count
+            data = data[count:]
 
-def process(start, infiles, outfile):
+    return pages
+
+# Write the sectors of the new image(s) that differ from the old image.
+# Each sector is compared with what it will contain after the bootrom has
+# erased it and written the new pages, so a sector that only had old data
+# at the end (which would now be erased) counts as changed as well.  A
+# sector that the old image didn't touch at all is always written as
+# there's no knowing what it contains.
+def delta(start, oldfile, infiles, outfile):
+    old = read_pages(oldfile, start)
+    new = {}
+
+    for filename in infiles:
+        new.update(read_pages(filename, start))
+
+    oldsectors = {addr - addr % SECTOR_SIZE for addr in old}
+    newsectors = sorted({addr - addr % SECTOR_SIZE for addr in new})
+    data = bytearray()
+    changed = 0
+
+    for sector in newsectors:
+        pages = range(sector, sector + SECTOR_SIZE, PAGE_SIZE)
+
+        if (sector in oldsectors) and \
+           all(new.get(page, BLANK_PAGE) == old.get(page, BLANK_PAGE) for page in pages):
+            continue
+
+        for page in pages:
+            if page in new:
+                add_block(page, new[page], data)
+
+        changed += 1
+
+    updateBuf(data)
+
+    with open(outfile, mode='wb') as output:
+        output.write(data)
+        print(f"Written {outfile} ({changed} of {len(newsectors)} sectors changed, "
+              f"{len(data) // 512} of {len(new)} blocks)")
+
+
+def process(start, infiles, outfile, sparse, erase):
     data = bytearray()
     block = 0
+    skipped = 0
     curaddr = start
 
     for filename in infiles:
@@ -120,10 +245,11 @@ def process(start, infiles, outfile):
             try:
 
                 buf = f.read()
-                curaddr, blocks, buf = check_uf2(curaddr, buf)
+                curaddr, blocks, buf, skippedblocks = check_uf2(curaddr, buf, sparse)
                 data.extend(buf)
 
                 block += blocks
+                skipped += skippedblocks
 
             except AssertionError as e:
                 print("***************************************************************")
@@ -132,10 +258,19 @@ def process(start, infiles, outfile):
                 print("***************************************************************")
                 exit(1)
 
+    for addr in sorted(erase):
+        if (addr < curaddr) or (addr % PAGE_SIZE):
+            print(f"Cannot erase at 0x{addr:08x} (must be page aligned and after 0x{curaddr:08x})")
+            exit(1)
+
+        add_block(addr, BLANK_PAGE, data)
+        curaddr = addr + PAGE_SIZE
+        block += 1
+
     if outfile is not None:
         updateBuf(data)
         try:
-            check_uf2(start, data)
+            check_uf2(start, data, sparse)
         except AssertionError as e:
             print("***************************************************************")
             print(f"UF2 sanity check of combined file failed:")
@@ -145,7 +280,10 @@ def process(start, infiles, outfile):
 
         with open(outfile, mode='wb') as output:
             output.write(data)
-            print(f"Written {outfile}")
+            if sparse:
+                print(f"Written {outfile} ({block} blocks, {skipped} padding blocks left out)")
+            else:
+                print(f"Written {outfile} ({block} blocks)")
 
 
 def main():
@@ -153,13 +291,26 @@ def main():
 
     parser.add_argument('--start', type=auto_int, default=0x10000000)
     parser.add_argument('-o', dest='outfile', nargs='?')
+    parser.add_argument('--sparse', action='store_true',
+                        help="leave gaps between the files out rather than padding them")
+    parser.add_argument('--delta', metavar='OLD',
+                        help="only output the sectors that differ from this (UF2 or binary) image")
+    parser.add_argument('--erase', metavar='ADDR', type=auto_int, action='append', default=[],
+                        help="add a block of 0xff at this address so that its sector is erased")
     parser.add_argument('infile', nargs='+')
 
     args = parser.parse_args()
 
+    if args.delta is not None:
+        if args.outfile is None:
+            parser.error("--delta needs an output file")
+
+        delta(args.start, args.delta, args.infile, args.outfile)
+        return
+
     if (args.outfile is not None) and (len(args.infile) == 1):
         print("Ignoring output file setting with only one input file\n");
 
-    process(args.start, args.infile, args.outfile)
+    process(args.start, args.infile, args.outfile, args.sparse, args.erase)
 
 main()
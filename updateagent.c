@@ -0,0 +1,401 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Update agent for the application.
+// See updateagent.h for details.
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "hardware/uart.h"
+#include "flashloader.h"
+#include "flashlayout.h"
+#include "flashstage.h"
+#include "flashverify.h"
+#include "flashcommit.h"
+#include "xipstats.h"
+#include "crc32.h"
+#include "updateproto.h"
+#include "updateagent.h"
+
+#define RING_SIZE   (1u << UPDATE_AGENT_RING_BITS)
+
+// The DMA channel keeps going round the ring for as many transfers as it
+// can count (and is restarted if it ever gets to the end)
+#define RING_TRANSFERS 0xffffffffu
+#define MAX_PAGES   (FLASH_STAGING_LENGTH / FLASH_PAGE_SIZE)
+
+_Static_assert(UPDATE_PAGE_SIZE == FLASH_PAGE_SIZE, "Update protocol must send whole pages");
+
+// Receive ring buffer.  Must be aligned to its size to be used by the DMA.
+static uint8_t            sRing[RING_SIZE] __attribute__ ((aligned(RING_SIZE)));
+static uint32_t           sReadPos;
+static int                sChannel;
+static uart_inst_t*       sUart;
+static tUpdateParser      sParser;
+static uint32_t           sStatus[3];
+
+// Image currently being received
+static int                sActive;
+static uint32_t           sOffset;      // Staging offset
+static uint32_t           sLength;
+static uint32_t           sSequence;
+static uint32_t           sPagesLeft;
+static uint8_t            sWritten[(MAX_PAGES + 7) / 8];
+static uint8_t            sFirstPage[FLASH_PAGE_SIZE] __attribute__ ((aligned(4)));
+
+// CRC of the image data received so far in order, up to 'sCrcOffset' (an
+// offset into the image).  Pages that arrive early are picked up from flash
+// once the gap before them has been filled.
+static uint32_t           sCrc;
+static uint32_t           sCrcOffset;
+
+// When something was last received, so the staging area is only prepared
+// for the next image once things have gone quiet
+static uint32_t           sLastReceived;
+
+//****************************************************************************
+// Set the DMA channel copying everything received by the UART into the
+// ring buffer
+static void startReceive(void)
+{
+    dma_channel_config c = dma_channel_get_default_config(sChannel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, UPDATE_AGENT_RING_BITS);
+    channel_config_set_dreq(&c, uart_get_dreq(sUart, false));
+
+    dma_channel_configure(sChannel, &c, sRing, &uart_get_hw(sUart)->dr, RING_TRANSFERS, true);
+    sReadPos = 0;
+}
+
+//****************************************************************************
+static void respond(const tUpdateFrame* request, uint8_t status,
+                    uint32_t value0, uint32_t value1, uint32_t value2)
+{
+    tUpdateResponse response = { request->type, status, 0, { value0, value1, value2 } };
+    tUpdateFrame    frame;
+
+    updateFrameInit(&frame, UPDATE_RESPONSE, request->seq, &response, sizeof(response));
+    updateSetCrc(&frame, crc32(&frame.type, updateCrcLength(&frame), FLASH_CRC32_INIT));
+    uart_write_blocking(sUart, (const uint8_t*)&frame, updateFrameLength(&frame));
+}
+
+//****************************************************************************
+// Find somewhere to stage an image of the given length and erase it
+static uint8_t beginImage(const tUpdateFrame* frame)
+{
+    uint32_t length;
+    uint32_t eraseLength;
+
+    if(frame->length != sizeof(length))
+        return UPDATE_ERR_LENGTH;
+
+    memcpy(&length, frame->payload, sizeof(length));
+    eraseLength = (length + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+
+    // The header has to fit in the first page so the application is at
+    // least 'length' less a page (and compressed blocks are never stored
+    // bigger than they started)
+    if((length < (sizeof(tFlashHeader) + FLASH_PAGE_SIZE)) ||
+       (eraseLength > FLASH_STAGING_LENGTH) ||
+       ((length - FLASH_PAGE_SIZE) > FLASH_APPLICATION_LENGTH))
+        return UPDATE_ERR_LENGTH;
+
+    xipStatsPhase("receive");
+
+    // Nothing else can be written until core1 has finished checking any
+    // pages left over from an image that was never finished
+    flashVerifyWait();
+
+    sOffset    = nextStagingOffset(eraseLength, &sSequence);
+    sLength    = length;
+    sPagesLeft = (length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+    sCrc       = FLASH_CRC32_INIT;
+    sCrcOffset = 0;
+    memset(sWritten, 0, sizeof(sWritten));
+
+    // One sector at a time so the rest of the application isn't held up
+    // for too long (and usually nothing at all, as the sectors will have
+    // been erased while we were idle)
+    eraseStagingArea(sOffset, eraseLength);
+
+    sActive = 1;
+    return UPDATE_OK;
+}
+
+//****************************************************************************
+// Add any pages that now follow on from what has already been included to
+// the CRC.  The CRC only covers the image data, which starts part way
+// through the first page.
+static void updateCrc(void)
+{
+    const tFlashHeader* header = (const tFlashHeader*)sFirstPage;
+    uint32_t index = sCrcOffset / FLASH_PAGE_SIZE;
+    uint32_t end;
+
+    if(sCrcOffset == 0)
+    {
+        // Can't start until we know where the data starts.  If the header
+        // isn't valid, the image will be rejected at the end anyway.
+        if(!(sWritten[0] & 1) || !flashHeaderValid(header, FLASH_PAGE_SIZE))
+            return;
+
+        end = (sLength < FLASH_PAGE_SIZE) ? sLength : FLASH_PAGE_SIZE;
+        sCrc = crc32(&sFirstPage[header->headerLength], end - header->headerLength, sCrc);
+        sCrcOffset = end;
+        index = 1;
+    }
+
+    while((sCrcOffset < sLength) && (sWritten[index / 8] & (1 << (index % 8))))
+    {
+        end = ((sLength - sCrcOffset) < FLASH_PAGE_SIZE) ? sLength : (sCrcOffset + FLASH_PAGE_SIZE);
+        sCrc = crc32((const uint8_t*)(XIP_BASE + sOffset + sCrcOffset), end - sCrcOffset, sCrc);
+        sCrcOffset = end;
+        index++;
+    }
+}
+
+//****************************************************************************
+// Program a page of the image (unless we already have it).  The first page
+// is kept until the end.
+static uint8_t writePage(const tUpdateFrame* frame)
+{
+    uint8_t  page[FLASH_PAGE_SIZE] __attribute__ ((aligned(4)));
+    uint32_t offset;
+    uint32_t length;
+    uint32_t index;
+
+    if(!sActive)
+        return UPDATE_ERR_STATE;
+
+    if(frame->length <= sizeof(offset))
+        return UPDATE_ERR_LENGTH;
+
+    memcpy(&offset, frame->payload, sizeof(offset));
+    length = frame->length - sizeof(offset);
+    index  = offset / FLASH_PAGE_SIZE;
+
+    // Only the last page may be short
+    if((offset % FLASH_PAGE_SIZE) || (offset >= sLength) ||
+       (length != (((sLength - offset) < FLASH_PAGE_SIZE) ? (sLength - offset) : FLASH_PAGE_SIZE)))
+        return UPDATE_ERR_OFFSET;
+
+    if(sWritten[index / 8] & (1 << (index % 8)))
+        return UPDATE_OK;
+
+    memset(page, 0xff, sizeof(page));
+    memcpy(page, &frame->payload[sizeof(offset)], length);
+
+    if(index == 0)
+        memcpy(sFirstPage, page, sizeof(page));
+    else
+        flashVerifyProgram(sOffset + offset, page);
+
+    sWritten[index / 8] |= (1 << (index % 8));
+    sPagesLeft--;
+
+    // Done while the host is still sending the next page
+    if(offset == sCrcOffset)
+        updateCrc();
+
+    return UPDATE_OK;
+}
+
+//****************************************************************************
+// Check the complete image, fill in the staging sequence number and write
+// the header to make it visible to the flashloader
+static uint8_t endImage(void)
+{
+    tFlashHeader* header = (tFlashHeader*)sFirstPage;
+    const tFlashTlv* tlv;
+    uint32_t tlvLength;
+    int      found = 0;
+    int      repaired;
+
+    // A retry after the response was lost
+    if(!sActive && sOffset && (flashCommitPending() == sOffset))
+        return UPDATE_OK;
+
+    if(!sActive)
+        return UPDATE_ERR_STATE;
+
+    // Every page has to have been read back before the image can be
+    // accepted.  If any had to be put right, the CRC was (at least partly)
+    // calculated over what was wrongly programmed so start it again.
+    repaired = flashVerifyWait();
+    if(repaired < 0)
+        return UPDATE_ERR_IMAGE;
+
+    if(repaired > 0)
+    {
+        sCrc       = FLASH_CRC32_INIT;
+        sCrcOffset = 0;
+    }
+
+    tlvLength = flashHeaderTlvLength(header);
+
+    // The header has to fit in the first page so we can change it
+    if(sPagesLeft ||
+       !flashHeaderValid(header, FLASH_PAGE_SIZE) ||
+       ((header->headerLength + header->length) != sLength) ||
+       (crc32(header->tlv, tlvLength, FLASH_CRC32_INIT) != header->tlvCrc32))
+        return UPDATE_ERR_IMAGE;
+
+    // Normally everything is already included but pick up anything that
+    // isn't (i.e. if the first page arrived late)
+    updateCrc();
+
+    if(sCrc != header->crc32)
+        return UPDATE_ERR_IMAGE;
+
+    for(tlv = flashTlvFirst(header); tlv; tlv = flashTlvNext(header, tlv))
+    {
+        if((tlv->type == FLASH_TLV_SEQUENCE) &&
+           (tlv->length == sizeof(uint32_t)) &&
+           flashTlvValid(header, tlv))
+        {
+            memcpy((uint8_t*)tlv->value, &sSequence, sizeof(uint32_t));
+            found = 1;
+        }
+    }
+
+    // Without a sequence number, we'd lose track of where we are in the
+    // staging area
+    if(!found)
+        return UPDATE_ERR_IMAGE;
+
+    header->tlvCrc32 = crc32(header->tlv, tlvLength, FLASH_CRC32_INIT);
+
+    xipStatsPhase("stage");
+
+    flashVerifyProgram(sOffset, sFirstPage);
+
+    if(flashVerifyWait() < 0)
+        return UPDATE_ERR_IMAGE;
+
+    sActive = 0;
+
+    // There's no point committing an image the flashloader won't flash.
+    // Checked now it's all in flash as boot2 runs on past the first page.
+    if(!flashCommitCheck(sOffset))
+    {
+        invalidateStagedImage(sOffset);
+        return UPDATE_ERR_IMAGE;
+    }
+
+    flashCommitReady(sOffset);
+    return UPDATE_OK;
+}
+
+//****************************************************************************
+static void handleFrame(const tUpdateFrame* frame)
+{
+    if(crc32(&frame->type, updateCrcLength(frame), FLASH_CRC32_INIT) != updateFrameCrc(frame))
+        return;
+
+    switch(frame->type)
+    {
+        case UPDATE_PING:
+            respond(frame, UPDATE_OK, UPDATE_PROTOCOL_VERSION, RING_SIZE, 0);
+            break;
+
+        case UPDATE_BEGIN:
+        {
+            // Only known once the image has begun
+            uint8_t status = beginImage(frame);
+
+            respond(frame, status, sOffset, 0, 0);
+            break;
+        }
+
+        case UPDATE_DATA:
+            respond(frame, writePage(frame), 0, 0, 0);
+            break;
+
+        case UPDATE_END:
+        {
+            // Only predicted once the image is ready
+            uint8_t status = endImage();
+
+            respond(frame, status, sSequence, flashCommitDowntimeUs(), 0);
+            break;
+        }
+
+        case UPDATE_REBOOT:
+            if(!flashCommitPending())
+            {
+                respond(frame, UPDATE_ERR_STATE, 0, 0, 0);
+                break;
+            }
+
+            respond(frame, UPDATE_OK, 0, 0, 0);
+            uart_tx_wait_blocking(sUart);
+            flashCommitNow();
+            break;
+
+        case UPDATE_STATUS:
+            respond(frame, UPDATE_OK, sStatus[0], sStatus[1], sStatus[2]);
+            break;
+
+        default:
+            respond(frame, UPDATE_ERR_TYPE, 0, 0, 0);
+            break;
+    }
+}
+
+//****************************************************************************
+void updateAgentInit(uart_inst_t* uart,
+                     uint32_t updated, uint32_t flashloaderUs, uint32_t startupUs)
+{
+    sUart      = uart;
+    sStatus[0] = updated;
+    sStatus[1] = flashloaderUs;
+    sStatus[2] = startupUs;
+    sChannel   = dma_claim_unused_channel(true);
+
+    sLastReceived = time_us_32();
+    startReceive();
+}
+
+//****************************************************************************
+int updateAgentRead(void)
+{
+    uint8_t byte;
+
+    // Only after 4G characters but just in case
+    if(!dma_channel_is_busy(sChannel))
+        startReceive();
+
+    while(sReadPos != ((uint32_t)dma_hw->ch[sChannel].write_addr - (uint32_t)sRing))
+    {
+        sLastReceived = time_us_32();
+
+        byte = sRing[sReadPos];
+        sReadPos = (sReadPos + 1) & (RING_SIZE - 1);
+
+        if((sParser.count == 0) && (byte != UPDATE_SYNC))
+            return byte;
+
+        if(updateParse(&sParser, byte))
+            handleFrame(&sParser.frame);
+    }
+
+    // Nothing to do so erase some of the staging area ready for the next
+    // image.  Anything received in the meantime is safe in the ring buffer.
+    if(!sActive && ((time_us_32() - sLastReceived) > UPDATE_AGENT_IDLE_US))
+        stagePreErase();
+
+    return -1;
+}
+
+//****************************************************************************
+uint32_t updateAgentIdleUs(void)
+{
+    return time_us_32() - sLastReceived;
+}
@@ -0,0 +1,70 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Update agent for the application.
+//
+// Receives update images over the UART using the binary protocol in
+// updateproto.h (e.g. from tools/flashupload.cpp) and stages them in flash
+// ready for the flashloader.  Each page is programmed as soon as it arrives
+// while the host carries on sending the following ones.  The UART is read
+// by DMA into a ring buffer so nothing is lost while the flash is being
+// erased or programmed (when interrupts are disabled and nothing can run
+// from flash).
+//
+// The first page (containing the header) is kept in RAM and only written
+// once the whole image has been received and checked, after the staging
+// sequence number has been filled in, so a partially received image can
+// never be picked up by the flashloader.
+//
+// Each page is read back by core1 while the next ones are being received
+// (see flashverify.h) and the image is only accepted once every page has
+// been checked and any bad ones put right.
+//
+// A staged image is only marked as ready (see flashcommit.h).  The reboot
+// into the flashloader happens when the host asks for it or whenever the
+// application decides to commit the image.
+//
+// Anything received outside a frame is passed back to the application so
+// the Intel hex upload still works on the same UART.
+//
+// While nothing is being received, the staging area is erased ready for
+// the next image (see stagePreErase) so staging doesn't have to wait for it.
+
+#ifndef __UPDATEAGENT_INCL__
+#define __UPDATEAGENT_INCL__
+
+#include <stdint.h>
+#include "hardware/uart.h"
+
+// Size of the receive ring buffer (log2).  This limits how many frames the
+// host can usefully have in flight.
+#ifndef UPDATE_AGENT_RING_BITS
+    #define UPDATE_AGENT_RING_BITS 12
+#endif
+
+// How long nothing has to have been received for (in microseconds) before
+// the staging area is erased in the background
+#ifndef UPDATE_AGENT_IDLE_US
+    #define UPDATE_AGENT_IDLE_US 500000
+#endif
+
+//****************************************************************************
+// Start receiving on the given (already initialised) UART.  'updated',
+// 'flashloaderUs' and 'startupUs' are reported to the host if it asks for
+// the status after an update.
+void updateAgentInit(uart_inst_t* uart,
+                     uint32_t updated, uint32_t flashloaderUs, uint32_t startupUs);
+
+//****************************************************************************
+// Handle anything that has been received.  Returns the next character
+// received outside a frame or -1 if there isn't one.
+int updateAgentRead(void);
+
+//****************************************************************************
+// Returns how long (in microseconds) it has been since anything was
+// received
+uint32_t updateAgentIdleUs(void);
+
+#endif // __UPDATEAGENT_INCL__
@@ -0,0 +1,171 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// Binary protocol used to send update images to the application's update
+// agent (see updateagent.h) instead of pasting an Intel hex file into a
+// terminal.
+//
+// Every request and response is a frame:
+//   sync (UPDATE_SYNC), type, sequence number (16 bits), payload length
+//   (16 bits), payload, CRC32 (see crc32.h) of everything after the sync byte
+// All values are little-endian.  Frames with a bad CRC are dropped without a
+// response so the host just sends them again.
+//
+// The host can have several UPDATE_DATA requests in flight at once.  Each
+// carries the offset of the page within the image so it doesn't matter in
+// which order they arrive or if one is sent more than once.  The device
+// answers each request with an UPDATE_RESPONSE frame carrying the same
+// sequence number.
+//
+// This header is shared by the application and the host tools so must not
+// depend on the Pico SDK.
+
+#ifndef __UPDATEPROTO_INCL__
+#define __UPDATEPROTO_INCL__
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef __packed
+    #define __packed __attribute__((packed))
+#endif
+
+#define UPDATE_PROTOCOL_VERSION 1
+
+#define UPDATE_SYNC             0xa5
+
+// Image data is sent a flash page at a time
+#define UPDATE_PAGE_SIZE        256
+#define UPDATE_MAX_PAYLOAD      (sizeof(uint32_t) + UPDATE_PAGE_SIZE)
+
+// Request types and their payloads.  The values in the response are given
+// after the '->'.
+#define UPDATE_PING             0x01    // -> protocol version
+#define UPDATE_BEGIN            0x02    // uint32_t image length -> staging offset
+                                        // (once the staging area is erased)
+#define UPDATE_DATA             0x03    // uint32_t offset, up to a page of data
+#define UPDATE_END              0x04    // -> sequence number, predicted downtime
+                                        // (us) once the image has been checked
+                                        // and is ready to flash
+#define UPDATE_REBOOT           0x05    // Reboot into the flashloader to flash
+                                        // the image that is ready
+#define UPDATE_STATUS           0x06    // -> non-zero if just updated, time spent
+                                        // in the flashloader (us), time until
+                                        // the application started (us)
+
+// Response type.  The payload is a tUpdateResponse.
+#define UPDATE_RESPONSE         0x80
+
+// Response status
+#define UPDATE_OK               0
+#define UPDATE_ERR_TYPE         1       // Unknown request
+#define UPDATE_ERR_STATE        2       // Not valid now (e.g. data before begin)
+#define UPDATE_ERR_LENGTH       3       // Image too large or payload wrong size
+#define UPDATE_ERR_OFFSET       4       // Data outside the image or not aligned
+#define UPDATE_ERR_IMAGE        5       // Image incomplete or failed its checks
+
+#define UPDATE_FRAME_OVERHEAD   (6 + sizeof(uint32_t))
+
+typedef struct __packed
+{
+    uint8_t  sync;
+    uint8_t  type;
+    uint16_t seq;
+    uint16_t length;
+    uint8_t  payload[UPDATE_MAX_PAYLOAD + sizeof(uint32_t)];    // Plus CRC
+}tUpdateFrame;
+
+typedef struct __packed
+{
+    uint8_t  request;       // Type of request being answered
+    uint8_t  status;        // UPDATE_OK or UPDATE_ERR_xxx
+    uint16_t reserved;
+    uint32_t value[3];
+}tUpdateResponse;
+
+// Receive state
+typedef struct
+{
+    tUpdateFrame frame;
+    uint32_t     count;     // Bytes received so far
+}tUpdateParser;
+
+//****************************************************************************
+// Number of bytes covered by the frame's CRC
+static inline uint32_t updateCrcLength(const tUpdateFrame* frame)
+{
+    return 5 + frame->length;
+}
+
+//****************************************************************************
+// Returns the CRC stored at the end of the frame
+static inline uint32_t updateFrameCrc(const tUpdateFrame* frame)
+{
+    uint32_t crc;
+
+    memcpy(&crc, &frame->payload[frame->length], sizeof(crc));
+    return crc;
+}
+
+//****************************************************************************
+// Total length of the frame (including sync byte and CRC)
+static inline uint32_t updateFrameLength(const tUpdateFrame* frame)
+{
+    return UPDATE_FRAME_OVERHEAD + frame->length;
+}
+
+//****************************************************************************
+// Fill in a frame ready to send, apart from the CRC (which should be
+// calculated over updateCrcLength() bytes starting at 'type' and stored
+// with updateSetCrc)
+static inline void updateFrameInit(tUpdateFrame* frame, uint8_t type, uint16_t seq,
+                                   const void* payload, uint16_t length)
+{
+    frame->sync   = UPDATE_SYNC;
+    frame->type   = type;
+    frame->seq    = seq;
+    frame->length = length;
+    memcpy(frame->payload, payload, length);
+}
+
+//****************************************************************************
+static inline void updateSetCrc(tUpdateFrame* frame, uint32_t crc)
+{
+    memcpy(&frame->payload[frame->length], &crc, sizeof(crc));
+}
+
+//****************************************************************************
+// Pass the next received byte to the parser.  Bytes outside a frame that
+// aren't a sync byte are ignored (the caller can check 'count' first if it
+// wants them).
+// Returns non-zero when a complete frame has been received.  Its CRC still
+// has to be checked.
+static inline int updateParse(tUpdateParser* parser, uint8_t byte)
+{
+    uint8_t* raw = (uint8_t*)&parser->frame;
+
+    if((parser->count == 0) && (byte != UPDATE_SYNC))
+        return 0;
+
+    raw[parser->count++] = byte;
+
+    if(parser->count < 6)
+        return 0;
+
+    // Can't be a real frame so start looking for the next sync byte
+    if(parser->frame.length > UPDATE_MAX_PAYLOAD)
+    {
+        parser->count = 0;
+        return 0;
+    }
+
+    if(parser->count < updateFrameLength(&parser->frame))
+        return 0;
+
+    parser->count = 0;
+    return 1;
+}
+
+#endif // __UPDATEPROTO_INCL__
@@ -0,0 +1,97 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// XIP cache statistics for the application.
+// See xipstats.h for details.
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "hardware/structs/xip_ctrl.h"
+#include "xipstats.h"
+
+static tXipPhase sPhases[XIP_STATS_MAX_PHASES] = { { "boot", 0, 0 } };
+static uint32_t  sPhaseCount = 1;
+static uint32_t  sCurrent = 0;
+
+static struct repeating_timer sTimer;
+
+//****************************************************************************
+static bool sampleCallback(struct repeating_timer *t)
+{
+    (void)t;
+    xipStatsSample();
+    return true;
+}
+
+//****************************************************************************
+void xipStatsStart(uint32_t periodMs)
+{
+    add_repeating_timer_ms(periodMs, sampleCallback, NULL, &sTimer);
+}
+
+//****************************************************************************
+void xipStatsSample(void)
+{
+    // Called from both the timer interrupt and the main loop so make sure
+    // we don't count anything twice
+    uint32_t status = save_and_disable_interrupts();
+
+    sPhases[sCurrent].hits     += xip_ctrl_hw->ctr_hit;
+    sPhases[sCurrent].accesses += xip_ctrl_hw->ctr_acc;
+
+    // Writing any value clears the counter
+    xip_ctrl_hw->ctr_hit = 0;
+    xip_ctrl_hw->ctr_acc = 0;
+
+    restore_interrupts(status);
+}
+
+//****************************************************************************
+void xipStatsPhase(const char* name)
+{
+    uint32_t phase;
+
+    xipStatsSample();
+
+    for(phase = 0; phase < sPhaseCount; phase++)
+    {
+        if(strcmp(sPhases[phase].name, name) == 0)
+            break;
+    }
+
+    if(phase == sPhaseCount)
+    {
+        // Not seen this one before.  If there's no room left, just keep
+        // counting in the current phase.
+        if(sPhaseCount == XIP_STATS_MAX_PHASES)
+            return;
+
+        sPhases[phase].name     = name;
+        sPhases[phase].hits     = 0;
+        sPhases[phase].accesses = 0;
+        sPhaseCount++;
+    }
+
+    sCurrent = phase;
+}
+
+//****************************************************************************
+const tXipPhase* xipStatsPhases(uint32_t* count)
+{
+    xipStatsSample();
+
+    *count = sPhaseCount;
+    return sPhases;
+}
+
+//****************************************************************************
+uint32_t xipStatsHitRate(const tXipPhase* phase)
+{
+    if(phase->accesses == 0)
+        return 0;
+
+    return (uint32_t)((phase->hits * 1000) / phase->accesses);
+}
@@ -0,0 +1,53 @@
+//****************************************************************************
+// Copyright 2021 Richard Hulme
+//
+// SPDX-License-Identifier: BSD-3-Clause
+//
+// XIP cache statistics for the application.
+//
+// The XIP controller counts cache hits and accesses in two 32-bit counters,
+// which the flashloader clears just before starting the application.  This
+// samples and clears them periodically (so they can't overflow) and adds the
+// results to whichever phase the application says it is in, giving a cheap
+// measure of how well the flash layout suits the cache.
+
+#ifndef __XIPSTATS_INCL__
+#define __XIPSTATS_INCL__
+
+#include <stdint.h>
+
+// Maximum number of different phases that can be tracked
+#ifndef XIP_STATS_MAX_PHASES
+    #define XIP_STATS_MAX_PHASES 8
+#endif
+
+typedef struct
+{
+    const char* name;
+    uint64_t    hits;
+    uint64_t    accesses;
+}tXipPhase;
+
+//****************************************************************************
+// Start sampling the counters every 'periodMs' milliseconds.  Everything up
+// to the first call to xipStatsPhase is counted as the "boot" phase.
+void xipStatsStart(uint32_t periodMs);
+
+//****************************************************************************
+// Move to the named phase (which is created if it doesn't exist yet).
+// The counts so far are added to the previous phase.
+void xipStatsPhase(const char* name);
+
+//****************************************************************************
+// Add the current counts to the current phase and clear the counters
+void xipStatsSample(void);
+
+//****************************************************************************
+// Returns the phases seen so far (after taking a final sample)
+const tXipPhase* xipStatsPhases(uint32_t* count);
+
+//****************************************************************************
+// Returns the hit rate of the given phase in tenths of a percent
+uint32_t xipStatsHitRate(const tXipPhase* phase);
+
+#endif // __XIPSTATS_INCL__